@@ -0,0 +1,297 @@
+//========================================================//
+//  bench.c                                               //
+//  Simulator throughput benchmark                        //
+//                                                        //
+//  Times predictor configurations over traces preloaded  //
+//  into memory, so that only the simulation is measured, //
+//  and compares the results with a stored baseline       //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "predictor.h"
+#include "trace.h"
+#include "config.h"
+
+// Used when no --config is given: every predictor type
+static const char *defaultConfigs[] = {
+  "static", "gshare:13", "tournament:9:10:10", "custom", "tage:64"
+};
+
+// Table sizes from L1-resident to DRAM-resident for --scaling
+static const char *scalingConfigs[] = {
+  "gshare:10..26", "tage:16", "tage:64", "tage:256", "tage:1024", "tage:4096",
+  "tage:16384"
+};
+
+struct BenchResult
+{
+  char config[64];
+  const char *trace;
+  uint64_t branches;
+  uint64_t bits;       // predictor storage
+  double median_ns;    // per branch
+  double stddev_ns;
+  double baseline_ns;  // 0 without a baseline entry
+};
+typedef struct BenchResult BenchResult;
+
+int reps = 5;
+int warmup = 1;
+double threshold = 5.0; // percent slowdown counted as a regression
+
+void
+usage()
+{
+  fprintf(stderr,"Usage: bench <options> <trace>...\n");
+  fprintf(stderr," Options:\n");
+  fprintf(stderr," --help             Print this message\n");
+  fprintf(stderr," --config <type>    Configuration to time. Numeric fields may be\n"
+                 "                    ranges, e.g. gshare:8..20. May be given more\n"
+                 "                    than once. Defaults to one of each type\n");
+  fprintf(stderr," --scaling          Also time gshare and tage from L1-sized to\n"
+                 "                    DRAM-sized tables\n");
+  fprintf(stderr," --reps <n>         Timed runs per measurement, default 5\n");
+  fprintf(stderr," --warmup <n>       Untimed runs before them, default 1\n");
+  fprintf(stderr," --json <file>      Write the results as JSON\n");
+  fprintf(stderr," --baseline <file>  Compare with JSON written by an earlier run\n");
+  fprintf(stderr," --threshold <pct>  Slowdown reported as a regression, default 5\n");
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *
+basename_of(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Time 'reps' runs of configuration 'c' over 'data' after 'warmup'
+// untimed ones. Each run starts from a freshly created predictor
+//
+void
+bench_one(const PredictorConfig *c, const TraceData *data, BenchResult *r)
+{
+  double *ns = (double *)malloc(reps * sizeof(double));
+  uint64_t expected = 0;
+  for (int i = -warmup; i < reps; i++) {
+    predictor_t *p = predictor_create(c);
+    double start = now();
+    uint64_t mispredictions = predictor_run(p, data->pc, data->outcome, NULL, data->n);
+    double elapsed = now() - start;
+    predictor_destroy(p);
+
+    if (i == -warmup) {
+      expected = mispredictions;
+    } else if (mispredictions != expected) {
+      fprintf(stderr, "%s is not deterministic\n", r->config);
+      exit(1);
+    }
+    if (i >= 0) {
+      ns[i] = elapsed * 1e9 / data->n;
+    }
+  }
+
+  qsort(ns, reps, sizeof(double), double_cmp);
+  r->median_ns = reps % 2 ? ns[reps / 2] : (ns[reps / 2 - 1] + ns[reps / 2]) / 2;
+  double mean = 0, var = 0;
+  for (int i = 0; i < reps; i++) {
+    mean += ns[i] / reps;
+  }
+  for (int i = 0; i < reps; i++) {
+    var += (ns[i] - mean) * (ns[i] - mean);
+  }
+  r->stddev_ns = reps > 1 ? sqrt(var / (reps - 1)) : 0;
+  r->branches = data->n;
+  r->bits = predictor_storage_bits(c);
+  free(ns);
+}
+
+// Look up the median of 'r' in a file written by write_json. Every
+// result is on a line of its own
+//
+void
+read_baseline(const char *path, BenchResult *results, int n)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open baseline %s\n", path);
+    exit(1);
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    char config[64], trace[256];
+    double median;
+    const char *c = strstr(line, "\"config\": \"");
+    const char *t = strstr(line, "\"trace\": \"");
+    const char *m = strstr(line, "\"median_ns\": ");
+    if (c == NULL || t == NULL || m == NULL ||
+        sscanf(c, "\"config\": \"%63[^\"]", config) != 1 ||
+        sscanf(t, "\"trace\": \"%255[^\"]", trace) != 1 ||
+        sscanf(m, "\"median_ns\": %lf", &median) != 1) {
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      if (!strcmp(results[i].config, config) &&
+          !strcmp(basename_of(results[i].trace), trace)) {
+        results[i].baseline_ns = median;
+      }
+    }
+  }
+  fclose(f);
+}
+
+void
+write_json(FILE *out, BenchResult *results, int n)
+{
+  fprintf(out, "[\n");
+  for (int i = 0; i < n; i++) {
+    BenchResult *r = &results[i];
+    fprintf(out, "%s  {\"trace\": \"%s\", \"config\": \"%s\", \"branches\": %llu, "
+            "\"bits\": %llu, \"median_ns\": %.3f, \"stddev_ns\": %.3f, "
+            "\"branches_per_sec\": %.0f}",
+            i ? ",\n" : "", basename_of(r->trace), r->config,
+            (unsigned long long)r->branches, (unsigned long long)r->bits,
+            r->median_ns, r->stddev_ns, 1e9 / r->median_ns);
+  }
+  fprintf(out, "\n]\n");
+}
+
+// Print the results as a table, with the change from the baseline
+// where there is one
+//
+// Returns the number of regressions
+//
+int
+report(BenchResult *results, int n)
+{
+  int regressions = 0;
+  printf("%-12s %-22s %12s %9s %8s %12s %9s\n", "Trace", "Config", "Table bytes",
+         "ns/branch", "stddev", "branches/s", "vs base");
+  for (int i = 0; i < n; i++) {
+    BenchResult *r = &results[i];
+    printf("%-12s %-22s %12llu %9.2f %8.2f %12.0f", basename_of(r->trace),
+           r->config, (unsigned long long)(r->bits + 7) / 8, r->median_ns,
+           r->stddev_ns, 1e9 / r->median_ns);
+    if (r->baseline_ns > 0) {
+      double change = 100.0 * (r->median_ns - r->baseline_ns) / r->baseline_ns;
+      int slower = change > threshold;
+      regressions += slower;
+      printf(" %+8.1f%%%s", change, slower ? " REGRESSION" : "");
+    }
+    printf("\n");
+  }
+  return regressions;
+}
+
+int
+main(int argc, char *argv[])
+{
+  PredictorConfig *configs = NULL;
+  int nconfigs = 0;
+  const char **traces = (const char **)calloc(argc, sizeof(char *));
+  int ntraces = 0;
+  int scaling = 0;
+  const char *json = NULL;
+  const char *baseline = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i],"--help")) {
+      usage();
+      exit(0);
+    } else if (!strcmp(argv[i],"--config") && i + 1 < argc) {
+      if (config_expand(argv[++i], &configs, &nconfigs) == 0) {
+        fprintf(stderr, "Unrecognized config %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (!strcmp(argv[i],"--scaling")) {
+      scaling = 1;
+    } else if (!strcmp(argv[i],"--reps") && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else if (!strcmp(argv[i],"--warmup") && i + 1 < argc) {
+      warmup = atoi(argv[++i]);
+    } else if (!strcmp(argv[i],"--json") && i + 1 < argc) {
+      json = argv[++i];
+    } else if (!strcmp(argv[i],"--baseline") && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (!strcmp(argv[i],"--threshold") && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    } else if (!strncmp(argv[i],"--",2)) {
+      fprintf(stderr, "Unrecognized option %s\n", argv[i]);
+      usage();
+      exit(1);
+    } else {
+      traces[ntraces++] = argv[i];
+    }
+  }
+
+  if (ntraces == 0 || reps < 1 || warmup < 0) {
+    usage();
+    exit(1);
+  }
+  if (nconfigs == 0) {
+    for (size_t i = 0; i < sizeof(defaultConfigs) / sizeof(*defaultConfigs); i++) {
+      config_expand(defaultConfigs[i], &configs, &nconfigs);
+    }
+  }
+  if (scaling) {
+    for (size_t i = 0; i < sizeof(scalingConfigs) / sizeof(*scalingConfigs); i++) {
+      config_expand(scalingConfigs[i], &configs, &nconfigs);
+    }
+  }
+
+  int n = ntraces * nconfigs;
+  BenchResult *results = (BenchResult *)calloc(n, sizeof(BenchResult));
+  for (int t = 0; t < ntraces; t++) {
+    TraceData *data = traceData_load(traces[t]);
+    if (data == NULL) {
+      fprintf(stderr, "Unable to open trace %s\n", traces[t]);
+      exit(1);
+    }
+    for (int c = 0; c < nconfigs; c++) {
+      BenchResult *r = &results[t * nconfigs + c];
+      config_name(&configs[c], r->config, sizeof(r->config));
+      r->trace = traces[t];
+      bench_one(&configs[c], data, r);
+    }
+    traceData_destroy(data);
+  }
+
+  if (baseline != NULL) {
+    read_baseline(baseline, results, n);
+  }
+  int regressions = report(results, n);
+
+  if (json != NULL) {
+    FILE *out = fopen(json, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Unable to create %s\n", json);
+      exit(1);
+    }
+    write_json(out, results, n);
+    fclose(out);
+  }
+
+  free(results);
+  free(configs);
+  free(traces);
+  return regressions > 0;
+}
@@ -0,0 +1,132 @@
+//========================================================//
+//  config.c                                              //
+//  Source file for predictor configuration strings       //
+//========================================================//
+
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+
+// Command line names, indexed by bpType, and how many numeric
+// fields follow each of them
+static const char *typeName[5] = {"static", "gshare", "tournament", "custom", "tage"};
+static const int typeFields[5] = {0, 1, 3, 0, 1};
+
+// Match the type name at the start of 'spec'
+//
+// Returns the bpType, or -1 if there is none
+//
+static int
+config_type(const char *spec, const char **rest)
+{
+  for (int t = 0; t < 5; t++) {
+    size_t len = strlen(typeName[t]);
+    if (!strncmp(spec, typeName[t], len) &&
+        (spec[len] == '\0' || spec[len] == ':')) {
+      *rest = spec + len;
+      return t;
+    }
+  }
+  return -1;
+}
+
+int
+config_parse(const char *spec, PredictorConfig *c)
+{
+  const char *rest;
+  int type = config_type(spec, &rest);
+  if (type < 0 || (typeFields[type] > 0 && *rest != ':')) {
+    return 0;
+  }
+
+  memset(c, 0, sizeof(*c));
+  c->bpType = type;
+  if (type == GSHARE || type == TAGE) {
+    sscanf(rest, ":%d", &c->ghistoryBits);
+  } else if (type == TOURNAMENT) {
+    sscanf(rest, ":%d:%d:%d", &c->ghistoryBits, &c->lhistoryBits,
+           &c->pcIndexBits);
+  }
+  return predictor_config_valid(c);
+}
+
+int
+config_expand(const char *spec, PredictorConfig **list, int *n)
+{
+  const char *rest;
+  int type = config_type(spec, &rest);
+  if (type < 0) {
+    return 0;
+  }
+
+  // Inclusive bounds of each field
+  int lo[3] = {0, 0, 0};
+  int hi[3] = {0, 0, 0};
+  for (int f = 0; f < typeFields[type]; f++) {
+    int used;
+    if (sscanf(rest, ":%d%n", &lo[f], &used) != 1) {
+      return 0;
+    }
+    rest += used;
+    hi[f] = lo[f];
+    if (!strncmp(rest, "..", 2)) {
+      if (sscanf(rest, "..%d%n", &hi[f], &used) != 1 || hi[f] < lo[f]) {
+        return 0;
+      }
+      rest += used;
+    }
+  }
+  // The limits bound each field separately, so a range is valid if
+  // both of its ends are
+  PredictorConfig first = {type, lo[0], lo[1], lo[2]};
+  PredictorConfig last = {type, hi[0], hi[1], hi[2]};
+  if (*rest != '\0' || !predictor_config_valid(&first) ||
+      !predictor_config_valid(&last)) {
+    return 0;
+  }
+
+  int added = 0;
+  for (int g = lo[0]; g <= hi[0]; g++) {
+    for (int l = lo[1]; l <= hi[1]; l++) {
+      for (int p = lo[2]; p <= hi[2]; p++) {
+        *list = (PredictorConfig *)realloc(*list, (*n + 1) * sizeof(PredictorConfig));
+        PredictorConfig *c = &(*list)[(*n)++];
+        c->bpType = type;
+        c->ghistoryBits = g;
+        c->lhistoryBits = l;
+        c->pcIndexBits = p;
+        added++;
+      }
+    }
+  }
+  return added;
+}
+
+void
+config_name(const PredictorConfig *c, char *buf, size_t len)
+{
+  switch (c->bpType) {
+  case GSHARE:
+    snprintf(buf, len, "gshare:%d", c->ghistoryBits);
+    break;
+  case TOURNAMENT:
+    snprintf(buf, len, "tournament:%d:%d:%d", c->ghistoryBits,
+             c->lhistoryBits, c->pcIndexBits);
+    break;
+  case TAGE:
+    snprintf(buf, len, "tage:%d", c->ghistoryBits);
+    break;
+  default:
+    snprintf(buf, len, "%s", typeName[c->bpType]);
+    break;
+  }
+}
+
+void
+config_apply(const PredictorConfig *c)
+{
+  bpType = c->bpType;
+  ghistoryBits = c->ghistoryBits;
+  lhistoryBits = c->lhistoryBits;
+  pcIndexBits = c->pcIndexBits;
+}
@@ -0,0 +1,40 @@
+//========================================================//
+//  config.h                                              //
+//  Header file for predictor configuration strings       //
+//                                                        //
+//  Parses the <type> strings accepted on the command     //
+//  line, including ranges used by sweeps                 //
+//========================================================//
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include "predictor.h"
+
+// Parse a single configuration such as "gshare:13" or
+// "tournament:9:10:10"
+//
+// Returns True if Successful and within the limits of
+// predictor_config_valid
+//
+int config_parse(const char *spec, PredictorConfig *c);
+
+// Expand a configuration whose numeric fields may be ranges, such
+// as "gshare:8..20" or "tournament:9:8..12:10", appending every
+// combination to the growable array '*list' of length '*n'
+//
+// Returns the number of configurations added, 0 on a parse error or
+// if any would be outside the limits of predictor_config_valid
+//
+int config_expand(const char *spec, PredictorConfig **list, int *n);
+
+// Format 'c' the way it is written on the command line
+//
+void config_name(const PredictorConfig *c, char *buf, size_t len);
+
+// Copy 'c' into the global predictor configuration
+//
+void config_apply(const PredictorConfig *c);
+
+#endif
@@ -0,0 +1,232 @@
+//========================================================//
+//  dse.c                                                 //
+//  Design-space exploration driver                       //
+//                                                        //
+//  Runs the cross-product of traces and predictor        //
+//  configurations on a work-stealing thread pool and     //
+//  writes the results as CSV or JSON                     //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "predictor.h"
+#include "trace.h"
+#include "config.h"
+#include "sim.h"
+
+// Used when no --config is given, matching trace_runner.py
+static const char *defaultConfigs[] = {
+  "gshare:13", "tournament:9:10:10", "custom"
+};
+
+const char **paths;
+int ntraces;
+PredictorConfig *configs = NULL;
+int nconfigs = 0;
+SimResult *results; // ntraces x nconfigs
+
+void
+usage()
+{
+  fprintf(stderr,"Usage: dse <options> <trace>...\n");
+  fprintf(stderr," Options:\n");
+  fprintf(stderr," --help            Print this message\n");
+  fprintf(stderr," --config <type>   Configuration to run on every trace. Numeric\n"
+                 "                   fields may be ranges, e.g. gshare:8..20. May be\n"
+                 "                   given more than once. Defaults to gshare:13,\n"
+                 "                   tournament:9:10:10 and custom\n");
+  fprintf(stderr," --jobs <n>        Worker threads, default one per core\n");
+  fprintf(stderr," --format <fmt>    csv (default) or json\n");
+  fprintf(stderr," --output <file>   Write results to <file> instead of stdout\n");
+  fprintf(stderr," --trace-cache <dir>\n"
+                 "                   Keep decoded text and bzip2 traces in <dir>\n");
+  fprintf(stderr," --trace-cache-limit <MB>\n"
+                 "                   Size of the trace cache, default 1024\n");
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *
+basename_of(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+// Misprediction rate in percent, 0 for an empty trace rather than nan
+static double
+dse_rate(const SimResult *r)
+{
+  return r->branches ? 100.0 * r->mispredictions / r->branches : 0.0;
+}
+
+// Write 's' as a quoted JSON string
+static void
+json_string(FILE *out, const char *s)
+{
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (ch == '"' || ch == '\\') {
+      fprintf(out, "\\%c", ch);
+    } else if (ch < 0x20) {
+      fprintf(out, "\\u%04x", ch);
+    } else {
+      fputc(ch, out);
+    }
+  }
+  fputc('"', out);
+}
+
+void
+write_csv(FILE *out)
+{
+  fprintf(out, "trace,config,branches,mispredictions,rate,seconds,bits\n");
+  for (int t = 0; t < ntraces; t++) {
+    for (int c = 0; c < nconfigs; c++) {
+      SimResult *r = &results[t * nconfigs + c];
+      if (r->failed) {
+        continue;
+      }
+      char name[64];
+      config_name(&configs[c], name, sizeof(name));
+      fprintf(out, "%s,%s,%llu,%llu,%.3f,%.3f,%llu\n", basename_of(paths[t]),
+              name, (unsigned long long)r->branches,
+              (unsigned long long)r->mispredictions,
+              dse_rate(r), r->seconds,
+              (unsigned long long)predictor_storage_bits(&configs[c]));
+    }
+  }
+}
+
+void
+write_json(FILE *out)
+{
+  int first = 1;
+  fprintf(out, "[\n");
+  for (int t = 0; t < ntraces; t++) {
+    for (int c = 0; c < nconfigs; c++) {
+      SimResult *r = &results[t * nconfigs + c];
+      if (r->failed) {
+        continue;
+      }
+      char name[64];
+      config_name(&configs[c], name, sizeof(name));
+      fprintf(out, "%s  {\"trace\": ", first ? "" : ",\n");
+      json_string(out, basename_of(paths[t]));
+      fprintf(out, ", \"config\": ");
+      json_string(out, name);
+      fprintf(out, ", \"branches\": %llu, \"mispredictions\": %llu, "
+              "\"rate\": %.3f, \"seconds\": %.3f, \"bits\": %llu}",
+              (unsigned long long)r->branches,
+              (unsigned long long)r->mispredictions,
+              dse_rate(r), r->seconds,
+              (unsigned long long)predictor_storage_bits(&configs[c]));
+      first = 0;
+    }
+  }
+  fprintf(out, "\n]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int jobs = 0;
+  const char *cache = NULL;
+  uint64_t cacheLimit = 0;
+  int json = 0;
+  const char *output = NULL;
+
+  paths = (const char **)calloc(argc, sizeof(char *));
+  ntraces = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i],"--help")) {
+      usage();
+      exit(0);
+    } else if (!strcmp(argv[i],"--config") && i + 1 < argc) {
+      if (config_expand(argv[++i], &configs, &nconfigs) == 0) {
+        fprintf(stderr, "Unrecognized config %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (!strcmp(argv[i],"--jobs") && i + 1 < argc) {
+      jobs = atoi(argv[++i]);
+    } else if (!strcmp(argv[i],"--format") && i + 1 < argc) {
+      json = !strcmp(argv[++i], "json");
+      if (!json && strcmp(argv[i], "csv")) {
+        fprintf(stderr, "Unrecognized format %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (!strcmp(argv[i],"--trace-cache") && i + 1 < argc) {
+      cache = argv[++i];
+    } else if (!strcmp(argv[i],"--trace-cache-limit") && i + 1 < argc) {
+      cacheLimit = strtoull(argv[++i], NULL, 0) << 20;
+    } else if (!strcmp(argv[i],"--output") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (!strncmp(argv[i],"--",2)) {
+      fprintf(stderr, "Unrecognized option %s\n", argv[i]);
+      usage();
+      exit(1);
+    } else {
+      paths[ntraces++] = argv[i];
+    }
+  }
+
+  if (ntraces == 0) {
+    usage();
+    exit(1);
+  }
+  if (nconfigs == 0) {
+    for (size_t i = 0; i < sizeof(defaultConfigs) / sizeof(*defaultConfigs); i++) {
+      config_expand(defaultConfigs[i], &configs, &nconfigs);
+    }
+  }
+
+  if (cache != NULL) {
+    trace_cache_configure(cache, cacheLimit);
+  }
+
+  results = (SimResult *)calloc(ntraces * nconfigs, sizeof(SimResult));
+
+  double start = now();
+  sim_run_matrix(paths, ntraces, configs, nconfigs, jobs, results);
+  fprintf(stderr, "%d runs in %.2fs\n", ntraces * nconfigs, now() - start);
+
+  FILE *out = stdout;
+  if (output != NULL && (out = fopen(output, "w")) == NULL) {
+    fprintf(stderr, "Unable to create %s\n", output);
+    exit(1);
+  }
+  if (json) {
+    write_json(out);
+  } else {
+    write_csv(out);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  // Runs of a trace that could not be opened are left out of the
+  // results, so say which and fail rather than look complete
+  int failed = 0;
+  for (int t = 0; t < ntraces; t++) {
+    if (results[t * nconfigs].failed) {
+      fprintf(stderr, "Skipped %s: unable to open trace\n", paths[t]);
+      failed++;
+    }
+  }
+
+  free(results);
+  free(paths);
+  free(configs);
+  return failed ? 1 : 0;
+}
@@ -8,27 +8,166 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "predictor.h"
+#include "trace.h"
+#include "config.h"
+#include "sim.h"
+#include "profile.h"
+#include "tune.h"
+#include "perf.h"
+#include "server.h"
+#include "predictions.h"
 
-FILE *stream;
-char *buf = NULL;
-size_t len = 0;
+Trace *trace;
+int stats;
+int perfCounters; // host counters for the parse and predict phases
+
+// Per-branch misprediction profile, reported at exit
+int profileTop = 0;
+const char *profileCsv = NULL;
+
+// Checkpointing: snapshot files and the range of branches simulated
+const char *saveState = NULL;
+const char *loadState = NULL;
+uint64_t skip = 0;
+int skipGiven = 0;
+uint64_t limit = 0; // 0 runs to the end of the trace
+
+// Sampled simulation, measuring only part of the trace
+int sampling = 0;
+SampleSpec sampleSpec;
+
+// Chunk-parallel simulation of one trace
+int chunks = 0;
+uint64_t chunkWarmup = 1000000;
+int jobs = 0;
+int compare = 0; // also run sequentially and report the difference
+
+// Configuration search within a storage budget
+int tune = 0;
+uint64_t budget = 0;
+
+// Windowed time series of mispredictions
+uint64_t interval = 0;
+const char *intervalOut = NULL; // stdout if NULL
+int intervalBinary = 0;
+
+// Directory of decoded copies of text and bzip2 traces
+const char *traceCache = NULL;
+uint64_t traceCacheLimit = 0; // bytes, 0 for the default
+
+// File listing traces to run as well as those on the command line
+const char *manifest = NULL;
+
+// Prediction server on a Unix socket, or stdin/stdout for "-"
+const char *serve = NULL;
+
+// Bit-packed predictions, to stdout for "-"
+const char *packed = NULL;
+int packedCorrect = 0;
+
+// Options whose value may also be given as the next argument
+static const char *valueOptions[] = {
+  "--sweep", "--save-state", "--load-state", "--skip", "--limit",
+  "--sample", "--chunks", "--chunk-warmup", "--jobs", "--budget",
+  "--serve", "--interval", "--interval-out", "--interval-format", "--packed",
+  "--manifest", "--trace-cache", "--trace-cache-limit"
+};
+
+// Configurations to run in a single pass over the trace
+PredictorConfig *sweep = NULL;
+int nsweep = 0;
 
 // Print out the Usage information to stderr
 //
 void
 usage()
 {
-  fprintf(stderr,"Usage: predictor <options> [<trace>]\n");
+  fprintf(stderr,"Usage: predictor <options> [<trace>...]\n");
   fprintf(stderr,"       bunzip -kc trace.bz2 | predictor <options>\n");
+  fprintf(stderr," <trace> may be a text trace, a bzip2 compressed text\n"
+                 " trace or a binary trace written by tracetool\n");
   fprintf(stderr," Options:\n");
   fprintf(stderr," --help       Print this message\n");
   fprintf(stderr," --verbose    Print predictions on stdout\n");
+  fprintf(stderr," --stats      Print trace parse throughput on stderr\n");
+  fprintf(stderr," --perf       Print host performance counters per branch for\n"
+                 "              trace parsing and prediction on stderr\n");
+  fprintf(stderr," --profile[=<n>]\n"
+                 "              Print the <n> (default 20) branches with the\n"
+                 "              most mispredictions\n");
+  fprintf(stderr," --profile-csv=<file>\n"
+                 "              Also write the profile to <file> as CSV\n");
+  fprintf(stderr," --save-state <file>\n"
+                 "              Snapshot the predictor tables after the run\n");
+  fprintf(stderr," --load-state <file>\n"
+                 "              Start from a snapshot instead of an empty\n"
+                 "              predictor. The snapshot's configuration is used\n"
+                 "              and, unless --skip is given, the trace resumes\n"
+                 "              where the snapshot was taken\n");
+  fprintf(stderr," --skip <n>   Skip the first <n> branches of the trace\n");
+  fprintf(stderr," --limit <n>  Stop after simulating <n> branches\n");
+  fprintf(stderr," --sample <fastforward>:<warmup>:<measure>\n"
+                 "              Repeatedly skip <fastforward> branches updating\n"
+                 "              only history registers, train on <warmup> and\n"
+                 "              count <measure>, and report the sampled rate\n"
+                 "              with a 95%% confidence interval\n");
+  fprintf(stderr," --interval <n>\n"
+                 "              Also print the branches, mispredictions and the\n"
+                 "              choices of two-component predictors for every\n"
+                 "              window of <n> branches\n");
+  fprintf(stderr," --interval-out <file>\n"
+                 "              Write the windows to <file> instead of stdout\n");
+  fprintf(stderr," --interval-format csv|binary\n"
+                 "              Format of the windows, default csv. binary\n"
+                 "              needs --interval-out and is described in sim.h\n");
+  fprintf(stderr," --chunks <k> Split the trace into <k> chunks simulated in\n"
+                 "              parallel, each by its own predictor\n");
+  fprintf(stderr," --chunk-warmup <n>\n"
+                 "              Branches before each chunk trained on without\n"
+                 "              counting, default 1000000\n");
+  fprintf(stderr," --jobs <n>   Threads for --chunks, --sweep and several traces,\n"
+                 "              default one per core\n");
+  fprintf(stderr," --compare    With --chunks, also run the trace sequentially\n"
+                 "              and print the difference\n");
+  fprintf(stderr," --tune --budget <size>\n"
+                 "              Search every configuration whose storage fits\n"
+                 "              <size>, e.g. 64Kbit or 8KB, for the best on each\n"
+                 "              trace and overall. Takes several traces\n");
+  fprintf(stderr," --packed <file>\n"
+                 "              Write predictions one bit each to <file>, or\n"
+                 "              to stdout if it is -. See predictions.h\n");
+  fprintf(stderr," --packed-correct\n"
+                 "              With --packed, also record whether each\n"
+                 "              prediction was correct\n");
+  fprintf(stderr," --serve <socket>\n"
+                 "              Keep predictors resident and answer batches of\n"
+                 "              branches on the Unix socket <socket>, or on\n"
+                 "              stdin and stdout if it is -. See server.h\n");
+  fprintf(stderr," --sweep <type>\n"
+                 "              Decode the trace once and run every listed\n"
+                 "              configuration over it, one result row each.\n"
+                 "              Numeric fields may be ranges, e.g. gshare:8..20.\n"
+                 "              May be given more than once\n");
+  fprintf(stderr," --trace-cache <dir>\n"
+                 "              Decode each text or bzip2 trace once into <dir>\n"
+                 "              and map the copy on later runs\n");
+  fprintf(stderr," --trace-cache-limit <MB>\n"
+                 "              Remove the least recently used copies beyond\n"
+                 "              <MB> megabytes, default 1024\n");
+  fprintf(stderr," --manifest <file>\n"
+                 "              Also run the traces listed in <file>, one per\n"
+                 "              line. With several traces every --sweep\n"
+                 "              configuration, or the --<type> given, runs on\n"
+                 "              each and the rates print as one table\n");
   fprintf(stderr," --<type>     Branch prediction scheme:\n");
   fprintf(stderr,"    static\n"
                  "    gshare:<# ghistory>\n"
                  "    tournament:<# ghistory>:<# lhistory>:<# index>\n"
-                 "    custom\n");
+                 "    custom\n"
+                 "    tage:<budget in Kbits, at least 9>\n");
 }
 
 // Process an option and update the predictor
@@ -39,18 +178,81 @@ usage()
 int
 handle_option(char *arg)
 {
-  if (!strcmp(arg,"--static")) {
-    bpType = STATIC;
-  } else if (!strncmp(arg,"--gshare:",9)) {
-    bpType = GSHARE;
-    sscanf(arg+9,"%d", &ghistoryBits);
-  } else if (!strncmp(arg,"--tournament:",13)) {
-    bpType = TOURNAMENT;
-    sscanf(arg+13,"%d:%d:%d", &ghistoryBits, &lhistoryBits, &pcIndexBits);
-  } else if (!strcmp(arg,"--custom")) {
-    bpType = CUSTOM;
+  PredictorConfig config;
+
+  if (config_parse(arg+2, &config)) {
+    config_apply(&config);
+    if (predictor_config_capped(&config)) {
+      fprintf(stderr, "TAGE tables are capped, using %llu of %d Kbits\n",
+              (unsigned long long)(predictor_storage_bits(&config) + 1023) / 1024,
+              config.ghistoryBits);
+    }
+  } else if (!strncmp(arg,"--sweep=",8)) {
+    return config_expand(arg+8, &sweep, &nsweep) > 0;
   } else if (!strcmp(arg,"--verbose")) {
     verbose = 1;
+  } else if (!strcmp(arg,"--stats")) {
+    stats = 1;
+  } else if (!strcmp(arg,"--perf")) {
+    perfCounters = 1;
+  } else if (!strcmp(arg,"--profile")) {
+    profileTop = 20;
+  } else if (!strncmp(arg,"--profile=",10)) {
+    profileTop = atoi(arg+10);
+    return profileTop > 0;
+  } else if (!strncmp(arg,"--save-state=",13)) {
+    saveState = arg+13;
+  } else if (!strncmp(arg,"--load-state=",13)) {
+    loadState = arg+13;
+  } else if (!strncmp(arg,"--skip=",7)) {
+    skip = strtoull(arg+7, NULL, 0);
+    skipGiven = 1;
+  } else if (!strncmp(arg,"--limit=",8)) {
+    limit = strtoull(arg+8, NULL, 0);
+    return limit > 0;
+  } else if (!strncmp(arg,"--sample=",9)) {
+    sampling = 1;
+    return sampleSpec_parse(arg+9, &sampleSpec);
+  } else if (!strncmp(arg,"--chunks=",9)) {
+    chunks = atoi(arg+9);
+    return chunks > 0;
+  } else if (!strncmp(arg,"--chunk-warmup=",15)) {
+    chunkWarmup = strtoull(arg+15, NULL, 0);
+  } else if (!strncmp(arg,"--jobs=",7)) {
+    jobs = atoi(arg+7);
+  } else if (!strcmp(arg,"--tune")) {
+    tune = 1;
+  } else if (!strncmp(arg,"--budget=",9)) {
+    budget = tune_parse_budget(arg+9);
+    return budget > 0;
+  } else if (!strncmp(arg,"--interval=",11)) {
+    interval = strtoull(arg+11, NULL, 0);
+    return interval > 0 && interval <= UINT32_MAX;
+  } else if (!strncmp(arg,"--interval-out=",15)) {
+    intervalOut = arg+15;
+  } else if (!strncmp(arg,"--interval-format=",18)) {
+    intervalBinary = !strcmp(arg+18, "binary");
+    return intervalBinary || !strcmp(arg+18, "csv");
+  } else if (!strncmp(arg,"--serve=",8)) {
+    serve = arg+8;
+  } else if (!strncmp(arg,"--packed=",9)) {
+    packed = arg+9;
+  } else if (!strncmp(arg,"--trace-cache=",14)) {
+    traceCache = arg+14;
+  } else if (!strncmp(arg,"--trace-cache-limit=",20)) {
+    traceCacheLimit = strtoull(arg+20, NULL, 0) << 20;
+    return traceCacheLimit > 0;
+  } else if (!strncmp(arg,"--manifest=",11)) {
+    manifest = arg+11;
+  } else if (!strcmp(arg,"--packed-correct")) {
+    packedCorrect = 1;
+  } else if (!strcmp(arg,"--compare")) {
+    compare = 1;
+  } else if (!strncmp(arg,"--profile-csv=",14)) {
+    profileCsv = arg+14;
+    if (profileTop == 0) {
+      profileTop = 20;
+    }
   } else {
     return 0;
   }
@@ -58,30 +260,213 @@ handle_option(char *arg)
   return 1;
 }
 
-// Reads a line from the input stream and extracts the
-// PC and Outcome of a branch
+// Add the traces listed in 'path' to 'paths', which has room for
+// 'cap'. Blank lines and lines starting with # are skipped, and
+// relative paths are taken from the manifest's directory
 //
-// Returns True if Successful 
+// Returns True if Successful
 //
 int
-read_branch(uint32_t *pc, uint8_t *outcome)
+read_manifest(const char *path, const char ***paths, int *npaths, int *cap)
 {
-  if (getline(&buf, &len, stream) == -1) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
     return 0;
   }
+  const char *slash = strrchr(path, '/');
+  int dirLen = slash ? slash - path + 1 : 0;
 
-  uint32_t tmp;
-  sscanf(buf,"0x%x %d\n",pc,&tmp);
-  *outcome = tmp;
+  char line[4096];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *start = line + strspn(line, " \t");
+    size_t len = strcspn(start, "\r\n");
+    while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t')) {
+      len--;
+    }
+    if (len == 0 || start[0] == '#') {
+      continue;
+    }
 
+    size_t size = len + dirLen + 1;
+    char *trace = (char *)malloc(size);
+    if (start[0] == '/') {
+      snprintf(trace, size, "%.*s", (int)len, start);
+    } else {
+      snprintf(trace, size, "%.*s%.*s", dirLen, path, (int)len, start);
+    }
+    if (*npaths == *cap) {
+      *cap = 2 * *cap + 8;
+      *paths = (const char **)realloc(*paths, *cap * sizeof(char *));
+    }
+    (*paths)[(*npaths)++] = trace;
+  }
+  fclose(f);
   return 1;
 }
 
+// Run every configuration in 'sweep' over every trace in 'paths'
+// on the pool, decoding each trace only once. A single trace prints
+// one row per configuration, several a table of rates with a row
+// per trace and a column per configuration
+//
+int
+run_sweep(const char **paths, int npaths)
+{
+  // Read stdin when no trace is given
+  const char *input = NULL;
+  if (npaths == 0) {
+    paths = &input;
+    npaths = 1;
+  }
+  SimResult *results = (SimResult *)calloc(npaths * nsweep, sizeof(SimResult));
+  sim_run_matrix(paths, npaths, sweep, nsweep, jobs, results);
+
+  int failed = 0;
+  for (int i = 0; i < npaths * nsweep; i++) {
+    failed |= results[i].failed;
+  }
+
+  char name[64];
+  if (npaths == 1) {
+    if (failed) {
+      free(results);
+      return 1;
+    }
+    printf("%-24s %10s %10s %8s\n", "Config", "Branches", "Incorrect", "Rate");
+    for (int c = 0; c < nsweep; c++) {
+      uint64_t mispredictions = results[c].mispredictions;
+      uint64_t branches = results[c].branches;
+      config_name(&sweep[c], name, sizeof(name));
+      float mispredict_rate = 100*((float)mispredictions / (float)branches);
+      printf("%-24s %10llu %10llu %8.3f\n", name, (unsigned long long)branches,
+             (unsigned long long)mispredictions, mispredict_rate);
+    }
+    free(results);
+    return 0;
+  }
+
+  // Columns are as wide as the configuration names
+  int width = 16;
+  for (int t = 0; t < npaths; t++) {
+    const char *slash = strrchr(paths[t], '/');
+    int len = strlen(slash ? slash + 1 : paths[t]);
+    width = len > width ? len : width;
+  }
+  printf("%-*s", width, "Trace");
+  for (int c = 0; c < nsweep; c++) {
+    config_name(&sweep[c], name, sizeof(name));
+    int len = strlen(name);
+    printf("  %*s", len > 8 ? len : 8, name);
+  }
+  printf("\n");
+  for (int t = 0; t < npaths; t++) {
+    const char *slash = strrchr(paths[t], '/');
+    printf("%-*s", width, slash ? slash + 1 : paths[t]);
+    for (int c = 0; c < nsweep; c++) {
+      SimResult *r = &results[t * nsweep + c];
+      config_name(&sweep[c], name, sizeof(name));
+      int len = strlen(name);
+      if (r->failed) {
+        printf("  %*s", len > 8 ? len : 8, "n/a");
+      } else {
+        printf("  %*.3f", len > 8 ? len : 8,
+               100*((float)r->mispredictions / (float)r->branches));
+      }
+    }
+    printf("\n");
+  }
+  free(results);
+  return failed;
+}
+
+// Simulate the trace at 'path' as 'chunks' chunks in parallel with
+// the predictor configured on the command line
+//
+int
+run_chunks(const char *path)
+{
+  TraceData *data = traceData_load(path);
+  if (data == NULL) {
+    printf("Unable to open trace %s\n", path);
+    return 1;
+  }
+
+  PredictorConfig c = {bpType, ghistoryBits, lhistoryBits, pcIndexBits};
+  uint64_t mispredictions = sim_run_chunks(&c, data, chunks, chunkWarmup, jobs);
+
+  printf("Branches:        %10llu\n", (unsigned long long)data->n);
+  printf("Incorrect:       %10llu\n", (unsigned long long)mispredictions);
+  float mispredict_rate = 100*((float)mispredictions / (float)data->n);
+  printf("Misprediction Rate: %7.3f\n", mispredict_rate);
+
+  if (compare) {
+    uint64_t sequential = sim_run(&c, data);
+    int64_t diff = (int64_t)mispredictions - (int64_t)sequential;
+    printf("Sequential:      %10llu\n", (unsigned long long)sequential);
+    printf("Difference:      %+10lld (%+.3f%% of sequential)\n",
+           (long long)diff, sequential ? 100.0 * diff / sequential : 0.0);
+  }
+
+  traceData_destroy(data);
+  return 0;
+}
+
+// Serve predictions with instance 0 configured on the command line
+//
+int
+run_serve()
+{
+  PredictorConfig c = {bpType, ghistoryBits, lhistoryBits, pcIndexBits};
+  Server *server = server_create(&c);
+  int ok = 1;
+  if (!strcmp(serve, "-")) {
+    server_serve(server, STDIN_FILENO, STDOUT_FILENO);
+  } else if (!server_listen(server, serve)) {
+    printf("Unable to serve on %s\n", serve);
+    ok = 0;
+  }
+  server_destroy(server);
+  return !ok;
+}
+
+// Print the best configuration within the budget for each trace in
+// 'paths' and for all of them together
+//
+int
+run_tune(const char **paths, int npaths)
+{
+  if (npaths == 0) {
+    printf("--tune needs at least one trace file\n");
+    return 1;
+  }
+  TuneResult *best = (TuneResult *)calloc(npaths + 1, sizeof(TuneResult));
+  if (!tune_run(paths, npaths, budget, jobs, best, stderr)) {
+    free(best);
+    return 1;
+  }
+
+  printf("Budget: %llu bits\n", (unsigned long long)budget);
+  printf("%-24s %-24s %10s %8s\n", "Trace", "Config", "Bits", "Rate");
+  for (int t = 0; t <= npaths; t++) {
+    char name[64];
+    config_name(&best[t].config, name, sizeof(name));
+    const char *trace = t < npaths ? paths[t] : "Overall (mean)";
+    const char *slash = strrchr(trace, '/');
+    printf("%-24s %-24s %10llu %8.3f\n", slash ? slash + 1 : trace, name,
+           (unsigned long long)best[t].bits, best[t].rate);
+  }
+  free(best);
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
   // Set defaults
-  stream = stdin;
+  const char *trace_path = NULL;
+  int cap = argc;
+  const char **paths = (const char **)calloc(cap, sizeof(char *));
+  int npaths = 0;
   bpType = STATIC;
   verbose = 0;
 
@@ -91,51 +476,300 @@ main(int argc, char *argv[])
       usage();
       exit(0);
     } else if (!strncmp(argv[i],"--",2)) {
-      if (!handle_option(argv[i])) {
-        printf("Unrecognized option %s\n", argv[i]);
+      // Join "--option value" into "--option=value". Options keep
+      // pointers into their argument, so it is never freed
+      char *arg = argv[i];
+      for (size_t o = 0; o < sizeof(valueOptions) / sizeof(*valueOptions); o++) {
+        if (!strcmp(arg, valueOptions[o]) && i + 1 < argc) {
+          size_t len = strlen(arg) + strlen(argv[i + 1]) + 2;
+          arg = (char *)malloc(len);
+          snprintf(arg, len, "%s=%s", argv[i], argv[i + 1]);
+          i++;
+          break;
+        }
+      }
+      if (!handle_option(arg)) {
+        printf("Unrecognized option %s\n", arg);
         usage();
         exit(1);
       }
     } else {
       // Use as input file
-      stream = fopen(argv[i], "r");
+      trace_path = argv[i];
+      paths[npaths++] = argv[i];
+    }
+  }
+  if (traceCache != NULL) {
+    trace_cache_configure(traceCache, traceCacheLimit);
+  }
+  if (manifest != NULL && !read_manifest(manifest, &paths, &npaths, &cap)) {
+    printf("Unable to read manifest %s\n", manifest);
+    exit(1);
+  }
+  if (trace_path == NULL && npaths > 0) {
+    trace_path = paths[0];
+  }
+
+  // Several traces run the configuration given like a sweep of one
+  if (npaths > 1 && nsweep == 0 && !tune) {
+    PredictorConfig c = {bpType, ghistoryBits, lhistoryBits, pcIndexBits};
+    sweep = (PredictorConfig *)malloc(sizeof(PredictorConfig));
+    sweep[nsweep++] = c;
+  }
+
+  if (sampling && (verbose || profileTop || nsweep > 0)) {
+    printf("--sample predicts only part of the trace and cannot be\n"
+           "combined with --verbose, --profile or --sweep\n");
+    exit(1);
+  }
+  if (interval > 0 && (sampling || chunks > 0 || nsweep > 0 || tune)) {
+    printf("--interval follows a single sequential run and cannot be\n"
+           "combined with --sample, --chunks, --sweep or --tune\n");
+    exit(1);
+  }
+  if (interval > 0 && intervalOut == NULL && (verbose || intervalBinary)) {
+    printf("--interval with --verbose or --interval-format binary needs\n"
+           "--interval-out\n");
+    exit(1);
+  }
+  if (packed != NULL && (sampling || chunks > 0 || nsweep > 0 || tune)) {
+    printf("--packed records every prediction of a single sequential run\n"
+           "and cannot be combined with --sample, --chunks, --sweep or --tune\n");
+    exit(1);
+  }
+  if (packedCorrect && packed == NULL) {
+    printf("--packed-correct needs --packed\n");
+    exit(1);
+  }
+  if (packed != NULL && !strcmp(packed, "-") &&
+      (verbose || (interval > 0 && intervalOut == NULL))) {
+    printf("--packed - writes stdout and cannot be combined with --verbose\n"
+           "or --interval without --interval-out\n");
+    exit(1);
+  }
+  if (serve != NULL) {
+    if (verbose || profileTop || nsweep > 0 || sampling || chunks > 0 || tune ||
+        perfCounters || interval || packed || saveState || loadState ||
+        skipGiven || limit) {
+      printf("--serve takes its branches and commands from clients and\n"
+             "cannot be combined with options for a trace run\n");
+      exit(1);
     }
+    return run_serve();
+  }
+  if (perfCounters && (tune || chunks > 0 || nsweep > 0)) {
+    printf("--perf measures a single sequential run and cannot be\n"
+           "combined with --tune, --chunks or --sweep\n");
+    exit(1);
+  }
+  if (tune) {
+    if (budget == 0) {
+      printf("--tune needs a --budget\n");
+      exit(1);
+    }
+    return run_tune(paths, npaths);
+  }
+  if (chunks > 0) {
+    if (verbose || profileTop || nsweep > 0 || sampling || saveState ||
+        loadState || skipGiven || limit) {
+      printf("--chunks runs a whole trace from empty predictors and cannot\n"
+             "be combined with --verbose, --profile, --sweep, --sample or\n"
+             "checkpointing\n");
+      exit(1);
+    }
+    return run_chunks(trace_path);
+  }
+  if (nsweep > 0) {
+    if (verbose || profileTop || saveState || loadState || skipGiven || limit) {
+      printf("--sweep runs whole traces from an empty predictor and cannot\n"
+             "be combined with --verbose, --profile or checkpointing\n");
+      exit(1);
+    }
+    return run_sweep(paths, npaths);
+  }
+
+  trace = trace_open(trace_path);
+  if (trace == NULL) {
+    printf("Unable to open trace %s\n", trace_path);
+    exit(1);
   }
 
   // Initialize the predictor
-  init_predictor();
+  if (loadState != NULL) {
+    uint64_t position;
+    if (!load_predictor(loadState, &position)) {
+      printf("Unable to load predictor state %s\n", loadState);
+      exit(1);
+    }
+    if (!skipGiven) {
+      skip = position;
+    }
+  } else {
+    init_predictor();
+  }
+  trace_skip(trace, skip);
 
-  uint32_t num_branches = 0;
-  uint32_t mispredictions = 0;
-  uint32_t pc = 0;
-  uint8_t outcome = NOTTAKEN;
+  uint64_t num_branches = 0;
+  uint64_t mispredictions = 0;
+  TraceBatch batch;
+  static uint8_t predictions[TRACE_BATCH];
+  Profile *profile = profileTop ? profile_create() : NULL;
+  Sampler sampler;
+  if (sampling) {
+    sampler_init(&sampler, &sampleSpec);
+  }
 
-  // Reach each branch from the trace
-  while (read_branch(&pc, &outcome)) {
-    num_branches++;
+  // The statistics move to stderr when stdout carries the predictions
+  FILE *report = stdout;
+  PredictionWriter *packedOut = NULL;
+  int packedFd = -1;
+  if (packed != NULL) {
+    if (!strcmp(packed, "-")) {
+      packedFd = STDOUT_FILENO;
+      report = stderr;
+    } else if ((packedFd = open(packed, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+      printf("Unable to create %s\n", packed);
+      exit(1);
+    }
+    packedOut = predictionWriter_open(packedFd,
+                                      packedCorrect ? PREDICTIONS_CORRECT : 0);
+  }
 
-    // Make a prediction and compare with actual outcome
-    uint8_t prediction = make_prediction(pc);
-    if (prediction != outcome) {
-      mispredictions++;
+  // The --verbose text of a batch, written at once
+  static char text[2 * TRACE_BATCH];
+  int keep = verbose || profile || packedOut;
+
+  Series series;
+  FILE *seriesOut = NULL;
+  if (interval > 0) {
+    seriesOut = intervalOut ? fopen(intervalOut, "wb") : stdout;
+    if (seriesOut == NULL) {
+      printf("Unable to create %s\n", intervalOut);
+      exit(1);
+    }
+    series_init(&series, default_predictor(), interval, skip, seriesOut,
+                intervalBinary);
+  }
+
+  Perf *perf = NULL;
+  if (perfCounters && (perf = perf_open()) == NULL) {
+    fprintf(stderr, "Performance counters are unavailable on this host\n");
+  }
+
+  // Predict and train each batch of branches from the trace
+  if (perf != NULL) {
+    perf_phase(perf, PERF_PARSE);
+  }
+  while (trace_next(trace, &batch)) {
+    if (perf != NULL) {
+      perf_phase(perf, PERF_SIMULATE);
+    }
+    if (limit > 0 && batch.n > limit - num_branches) {
+      batch.n = limit - num_branches;
+    }
+    num_branches += batch.n;
+    if (sampling) {
+      sampler_run(&sampler, default_predictor(), batch.pc, batch.outcome,
+                  batch.n);
+    } else if (interval > 0) {
+      mispredictions += series_run(&series, default_predictor(), batch.pc,
+                                   batch.outcome,
+                                   keep ? predictions : NULL,
+                                   batch.n);
+    } else {
+      mispredictions += run_predictor(batch.pc, batch.outcome,
+                                      keep ? predictions : NULL,
+                                      batch.n);
+    }
+    if (profile != NULL) {
+      profile_add(profile, batch.pc, batch.outcome, predictions, batch.n);
+    }
+    if (packedOut != NULL) {
+      predictionWriter_append(packedOut, predictions, batch.outcome, batch.n);
     }
     if (verbose != 0) {
-      printf ("%d\n", prediction);
+      fwrite(text, 1, predictions_format_text(predictions, batch.n, text), stdout);
+    }
+    if (limit > 0 && num_branches == limit) {
+      break;
+    }
+    if (perf != NULL) {
+      perf_phase(perf, PERF_PARSE);
+    }
+  }
+  if (sampling) {
+    mispredictions = sampler.mispredictions + sampler.sampleMisses;
+  }
+  if (interval > 0) {
+    series_finish(&series, default_predictor());
+    if (seriesOut != stdout) {
+      fclose(seriesOut);
     }
+  }
+
+  if (packedOut != NULL) {
+    if (!predictionWriter_close(packedOut)) {
+      fprintf(stderr, "Error writing %s\n", packed);
+    }
+    if (packedFd != STDOUT_FILENO) {
+      close(packedFd);
+    }
+  }
 
-    // Train the predictor
-    train_predictor(pc, outcome);
+  if (saveState != NULL && !save_predictor(saveState, skip + num_branches)) {
+    printf("Unable to save predictor state %s\n", saveState);
   }
 
   // Print out the mispredict statistics
-  printf("Branches:        %10d\n", num_branches);
-  printf("Incorrect:       %10d\n", mispredictions);
+  fprintf(report, "Branches:        %10llu\n", (unsigned long long)num_branches);
   float mispredict_rate = 100*((float)mispredictions / (float)num_branches);
-  printf("Misprediction Rate: %7.3f\n", mispredict_rate);
+  if (sampling) {
+    double interval;
+    double rate = sampler_rate(&sampler, &interval);
+    fprintf(report, "Samples:         %10llu\n",
+            (unsigned long long)sampler.samples);
+    fprintf(report, "Measured:        %10llu\n",
+            (unsigned long long)sampler.measured);
+    fprintf(report, "Incorrect:       %10llu\n",
+            (unsigned long long)mispredictions);
+    fprintf(report, "Misprediction Rate: %7.3f +/- %.3f (95%%)\n", rate,
+            interval);
+  } else {
+    fprintf(report, "Incorrect:       %10llu\n",
+            (unsigned long long)mispredictions);
+    fprintf(report, "Misprediction Rate: %7.3f\n", mispredict_rate);
+  }
+
+  if (profile != NULL) {
+    FILE *csv = NULL;
+    if (profileCsv != NULL && (csv = fopen(profileCsv, "w")) == NULL) {
+      printf("Unable to create %s\n", profileCsv);
+    }
+    fprintf(report, "\n");
+    profile_report(profile, profileTop, report, csv);
+    if (csv != NULL) {
+      fclose(csv);
+    }
+    profile_destroy(profile);
+  }
+
+  if (stats) {
+    TraceStats ts;
+    trace_stats(trace, &ts);
+    double secs = ts.parse_ns / 1e9;
+    fprintf(stderr, "Trace bytes:     %10llu\n", (unsigned long long)ts.bytes);
+    fprintf(stderr, "Parse time (s):  %10.3f\n", secs);
+    fprintf(stderr, "Parse MB/s:      %10.1f\n",
+            secs > 0 ? ts.bytes / 1e6 / secs : 0.0);
+  }
+
+  if (perf != NULL) {
+    perf_report(perf, num_branches, !trace_threaded(trace), stderr);
+    perf_close(perf);
+  }
 
   // Cleanup
-  fclose(stream);
-  free(buf);
+  trace_close(trace);
 
   return 0;
 }
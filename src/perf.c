@@ -0,0 +1,154 @@
+//========================================================//
+//  perf.c                                                //
+//  Source file for hardware performance counters         //
+//                                                        //
+//  Every event is its own group so that one the PMU      //
+//  lacks does not take the others with it. The kernel    //
+//  multiplexes them if there are more events than        //
+//  counters, so counts are scaled by the fraction of     //
+//  time each one was actually running                    //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+
+#define PERF_CACHE(cache, op, result) \
+  ((cache) | ((op) << 8) | ((result) << 16))
+
+struct PerfEvent
+{
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+typedef struct PerfEvent PerfEvent;
+
+static const PerfEvent perfEvents[PERF_EVENTS] = {
+  {"Time (ns)",     PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+  {"Cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"Instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"L1D misses",    PERF_TYPE_HW_CACHE,
+   PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+              PERF_COUNT_HW_CACHE_RESULT_MISS)},
+  {"LLC misses",    PERF_TYPE_HW_CACHE,
+   PERF_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+              PERF_COUNT_HW_CACHE_RESULT_MISS)},
+  {"Branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"dTLB misses",   PERF_TYPE_HW_CACHE,
+   PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+              PERF_COUNT_HW_CACHE_RESULT_MISS)}
+};
+
+// Layout of a read() with TOTAL_TIME_ENABLED and TOTAL_TIME_RUNNING
+struct PerfReading
+{
+  uint64_t value;
+  uint64_t enabled;
+  uint64_t running;
+};
+typedef struct PerfReading PerfReading;
+
+struct Perf
+{
+  int fd[PERF_EVENTS];              // -1 if unavailable
+  int phase;                        // current phase, -1 for none
+  PerfReading last[PERF_EVENTS];    // at the start of the phase
+  PerfReading total[PERF_PHASES][PERF_EVENTS];
+};
+
+static int
+perf_event_open(struct perf_event_attr *attr)
+{
+  return syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+Perf *
+perf_open()
+{
+  Perf *p = (Perf *)calloc(1, sizeof(Perf));
+  int opened = 0;
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perfEvents[e].type;
+    attr.config = perfEvents[e].config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    p->fd[e] = perf_event_open(&attr);
+    opened += p->fd[e] >= 0;
+  }
+  if (opened == 0) {
+    free(p);
+    return NULL;
+  }
+  p->phase = -1;
+  return p;
+}
+
+void
+perf_close(Perf *p)
+{
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (p->fd[e] >= 0) {
+      close(p->fd[e]);
+    }
+  }
+  free(p);
+}
+
+void
+perf_phase(Perf *p, int phase)
+{
+  if (phase == p->phase) {
+    return;
+  }
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    PerfReading now;
+    if (p->fd[e] < 0 || read(p->fd[e], &now, sizeof(now)) != sizeof(now)) {
+      continue;
+    }
+    if (p->phase >= 0) {
+      PerfReading *t = &p->total[p->phase][e];
+      t->value += now.value - p->last[e].value;
+      t->enabled += now.enabled - p->last[e].enabled;
+      t->running += now.running - p->last[e].running;
+    }
+    p->last[e] = now;
+  }
+  p->phase = phase;
+}
+
+void
+perf_report(Perf *p, uint64_t branches, int parseCounted, FILE *out)
+{
+  perf_phase(p, -1);
+  fprintf(out, "Per branch:          Parse   Predict\n");
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    fprintf(out, "%-15s", perfEvents[e].name);
+    for (int ph = 0; ph < PERF_PHASES; ph++) {
+      PerfReading *t = &p->total[ph][e];
+      if (p->fd[e] < 0 || (ph == PERF_PARSE && !parseCounted)) {
+        fprintf(out, "  %8s", "n/a");
+      } else if (t->running == 0 || branches == 0) {
+        fprintf(out, "  %8s", t->enabled ? "n/c" : "0");
+      } else {
+        double scaled = (double)t->value * t->enabled / t->running;
+        fprintf(out, "  %8.3f", scaled / branches);
+      }
+    }
+    fprintf(out, "\n");
+  }
+  if (!parseCounted) {
+    fprintf(out, "Parse is n/a: the trace is parsed on a producer thread that\n"
+                 "is not counted, and the simulating thread only waits for it\n");
+  }
+}
@@ -0,0 +1,55 @@
+//========================================================//
+//  perf.h                                                //
+//  Header file for hardware performance counters         //
+//                                                        //
+//  Counts host cycles, instructions, cache, TLB and      //
+//  branch misses with perf_event_open and attributes     //
+//  them to the phases of a run                           //
+//========================================================//
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Phases counts are attributed to
+enum { PERF_PARSE, PERF_SIMULATE, PERF_PHASES };
+
+// Events counted, in report order
+enum {
+  PERF_TASK_CLOCK,
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_EVENTS
+};
+
+typedef struct Perf Perf;
+
+// Open every event that this host and its perf_event_paranoid
+// setting allow, counting user space of the calling thread only.
+// Events that cannot be opened are reported as unavailable
+//
+// Returns NULL if no event at all can be opened
+//
+Perf *perf_open();
+
+void perf_close(Perf *p);
+
+// Attribute everything counted from now on to 'phase', or to no
+// phase if it is negative
+//
+void perf_phase(Perf *p, int phase);
+
+// Print the counts of each phase divided by 'branches'. Events
+// that could not be opened show n/a, and ones the kernel never got
+// to schedule on a counter show n/c. Unless 'parseCounted', parsing
+// ran on another thread and the whole parse column shows n/a
+//
+void perf_report(Perf *p, uint64_t branches, int parseCounted, FILE *out);
+
+#endif
@@ -0,0 +1,258 @@
+//========================================================//
+//  pool.c                                                //
+//  Source file for the work-stealing thread pool         //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+
+struct PoolTask
+{
+  PoolFn fn;
+  void *arg;
+};
+typedef struct PoolTask PoolTask;
+
+// Ring buffer of tasks. The owner works at 'bottom', thieves take
+// from 'top'. Tasks are coarse (a whole simulation), so a lock per
+// deque costs nothing measurable
+struct PoolDeque
+{
+  pthread_mutex_t lock;
+  PoolTask *tasks;
+  size_t cap; // power of two
+  size_t top;
+  size_t bottom;
+};
+typedef struct PoolDeque PoolDeque;
+
+struct Pool
+{
+  int nthreads;
+  pthread_t *threads;
+  PoolDeque *deques;
+  unsigned next; // round-robin target for outside submissions
+
+  pthread_mutex_t lock;
+  pthread_cond_t work; // signalled when a task is queued
+  pthread_cond_t done; // signalled when 'pending' reaches zero
+  long queued;         // tasks sitting in deques
+  long pending;        // tasks submitted but not finished
+  int stop;
+};
+
+struct PoolWorkerArg
+{
+  Pool *pool;
+  int id;
+};
+typedef struct PoolWorkerArg PoolWorkerArg;
+
+static __thread int pool_self = -1;
+
+static void
+deque_push(PoolDeque *d, PoolTask t)
+{
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->cap) {
+    size_t cap = d->cap ? 2 * d->cap : 64;
+    PoolTask *tasks = (PoolTask *)malloc(cap * sizeof(PoolTask));
+    for (size_t i = d->top; i != d->bottom; i++) {
+      tasks[i & (cap - 1)] = d->tasks[i & (d->cap - 1)];
+    }
+    free(d->tasks);
+    d->tasks = tasks;
+    d->cap = cap;
+  }
+  d->tasks[d->bottom & (d->cap - 1)] = t;
+  d->bottom++;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Take from the owner's end (newest first)
+//
+static int
+deque_pop(PoolDeque *d, PoolTask *t)
+{
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom != d->top) {
+    d->bottom--;
+    *t = d->tasks[d->bottom & (d->cap - 1)];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Take from the thieves' end (oldest first)
+//
+static int
+deque_steal(PoolDeque *d, PoolTask *t)
+{
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom != d->top) {
+    *t = d->tasks[d->top & (d->cap - 1)];
+    d->top++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static int
+pool_take(Pool *pool, int self, unsigned *seed, PoolTask *t)
+{
+  if (deque_pop(&pool->deques[self], t)) {
+    return 1;
+  }
+  int start = rand_r(seed) % pool->nthreads;
+  for (int i = 0; i < pool->nthreads; i++) {
+    int victim = (start + i) % pool->nthreads;
+    if (victim != self && deque_steal(&pool->deques[victim], t)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *
+pool_run(void *arg)
+{
+  PoolWorkerArg *wa = (PoolWorkerArg *)arg;
+  Pool *pool = wa->pool;
+  int self = wa->id;
+  unsigned seed = self + 1;
+  free(wa);
+  pool_self = self;
+
+  for (;;) {
+    PoolTask t;
+    if (pool_take(pool, self, &seed, &t)) {
+      __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+      t.fn(pool, t.arg);
+      if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0 && !pool->stop) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    int stop = pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (stop) {
+      return NULL;
+    }
+  }
+}
+
+Pool *
+pool_create(int nthreads)
+{
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) {
+      nthreads = 1;
+    }
+  }
+
+  Pool *pool = (Pool *)calloc(1, sizeof(Pool));
+  pool->nthreads = nthreads;
+  pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+  pool->deques = (PoolDeque *)calloc(nthreads, sizeof(PoolDeque));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (int i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    PoolWorkerArg *wa = (PoolWorkerArg *)malloc(sizeof(PoolWorkerArg));
+    wa->pool = pool;
+    wa->id = i;
+    if (pthread_create(&pool->threads[i], NULL, pool_run, wa)) {
+      fprintf(stderr, "Unable to start worker thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return pool;
+}
+
+void
+pool_submit(Pool *pool, PoolFn fn, void *arg)
+{
+  PoolTask t = {fn, arg};
+  int target = pool_self;
+  if (target < 0) {
+    target = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->nthreads;
+  }
+
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+  deque_push(&pool->deques[target], t);
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void
+pool_wait(Pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int
+pool_size(Pool *pool)
+{
+  return pool->nthreads;
+}
+
+int
+pool_worker()
+{
+  return pool_self;
+}
+
+void
+pool_destroy(Pool *pool)
+{
+  pool_wait(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  // A worker may still be stealing from any deque until it exits, so
+  // every worker is joined before a deque goes
+  for (int i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (int i = 0; i < pool->nthreads; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  free(pool->threads);
+  free(pool->deques);
+  free(pool);
+}
@@ -0,0 +1,43 @@
+//========================================================//
+//  pool.h                                                //
+//  Header file for the work-stealing thread pool         //
+//                                                        //
+//  Each worker owns a deque. It pushes and pops tasks at //
+//  the bottom of its own deque and steals from the top   //
+//  of the others when it runs dry                        //
+//========================================================//
+
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct Pool Pool;
+typedef void (*PoolFn)(Pool *pool, void *arg);
+
+// Start a pool with 'nthreads' workers, or one per online core if
+// 'nthreads' is not positive
+//
+Pool *pool_create(int nthreads);
+
+// Queue fn(pool, arg). Tasks submitted from inside a task go on the
+// running worker's own deque, others are spread round-robin
+//
+void pool_submit(Pool *pool, PoolFn fn, void *arg);
+
+// Block until every submitted task, including tasks they submitted,
+// has finished
+//
+void pool_wait(Pool *pool);
+
+// Number of workers
+//
+int pool_size(Pool *pool);
+
+// Index of the worker running the calling task, -1 outside the pool
+//
+int pool_worker();
+
+// Wait for outstanding tasks and stop the workers
+//
+void pool_destroy(Pool *pool);
+
+#endif
@@ -0,0 +1,278 @@
+//========================================================//
+//  predictions.c                                         //
+//  Source file for prediction output                     //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "predictions.h"
+
+struct PredictionWriter
+{
+  int fd;
+  uint32_t flags;
+  int ok;
+  uint8_t *buf;
+  size_t len;
+};
+
+struct PredictionReader
+{
+  int fd;
+  uint32_t flags;
+  uint8_t *bits;
+  uint8_t *predictions;
+  uint8_t *correct;
+  size_t cap; // branches the arrays hold
+};
+
+// Pack the low bits of 8 bytes into one, byte k to bit k. The
+// multiply moves bit 8k to bit 56 + k without any two terms meeting
+static inline uint8_t
+pack8(uint64_t x)
+{
+  return (uint8_t)((x * 0x0102040810204080ull) >> 56);
+}
+
+static inline uint64_t
+unpack8(uint8_t b)
+{
+  uint64_t x = b * 0x0101010101010101ull;
+  x &= 0x8040201008040201ull;
+  return ((x + 0x7F7F7F7F7F7F7F7Full) >> 7) & 0x0101010101010101ull;
+}
+
+static void
+pack_bits(const uint8_t *v, size_t n, uint8_t *out)
+{
+  size_t whole = n / 8;
+  for (size_t k = 0; k < whole; k++) {
+    uint64_t x;
+    memcpy(&x, v + 8 * k, 8);
+    out[k] = pack8(x & 0x0101010101010101ull);
+  }
+  if (n % 8) {
+    uint8_t last = 0;
+    for (size_t j = 8 * whole; j < n; j++) {
+      last |= (v[j] & 1) << (j % 8);
+    }
+    out[whole] = last;
+  }
+}
+
+static void
+unpack_bits(const uint8_t *bits, size_t n, uint8_t *out)
+{
+  size_t whole = n / 8;
+  for (size_t k = 0; k < whole; k++) {
+    uint64_t x = unpack8(bits[k]);
+    memcpy(out + 8 * k, &x, 8);
+  }
+  for (size_t j = 8 * whole; j < n; j++) {
+    out[j] = (bits[j / 8] >> (j % 8)) & 1;
+  }
+}
+
+static int
+write_all(int fd, const uint8_t *p, size_t len)
+{
+  while (len > 0) {
+    ssize_t r = write(fd, p, len);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return 0;
+    }
+    p += r;
+    len -= r;
+  }
+  return 1;
+}
+
+static void
+predictionWriter_flush(PredictionWriter *w)
+{
+  w->ok = write_all(w->fd, w->buf, w->len) && w->ok;
+  w->len = 0;
+}
+
+PredictionWriter *
+predictionWriter_open(int fd, uint32_t flags)
+{
+  PredictionWriter *w = (PredictionWriter *)calloc(1, sizeof(PredictionWriter));
+  w->fd = fd;
+  w->flags = flags;
+  w->ok = 1;
+  w->buf = (uint8_t *)malloc(PREDICTIONS_BUFFER);
+
+  uint32_t version = PREDICTIONS_VERSION;
+  memcpy(w->buf, PREDICTIONS_MAGIC, sizeof(PREDICTIONS_MAGIC));
+  memcpy(w->buf + 8, &version, 4);
+  memcpy(w->buf + 12, &flags, 4);
+  w->len = 16;
+  return w;
+}
+
+void
+predictionWriter_append(PredictionWriter *w, const uint8_t *predictions,
+                        const uint8_t *outcome, size_t n)
+{
+  // Chunks are limited so that one always fits the buffer
+  const size_t most = 8 * (PREDICTIONS_BUFFER / 2 - 8);
+  while (n > 0) {
+    uint32_t m = n < most ? n : most;
+    size_t bytes = (m + 7) / 8;
+    size_t need = 4 + bytes * (w->flags & PREDICTIONS_CORRECT ? 2 : 1);
+    if (w->len + need > PREDICTIONS_BUFFER) {
+      predictionWriter_flush(w);
+    }
+
+    uint8_t *p = w->buf + w->len;
+    memcpy(p, &m, 4);
+    pack_bits(predictions, m, p + 4);
+    if (w->flags & PREDICTIONS_CORRECT) {
+      uint8_t *correct = p + 4 + bytes;
+      size_t whole = m / 8;
+      for (size_t k = 0; k < whole; k++) {
+        uint64_t a, b;
+        memcpy(&a, predictions + 8 * k, 8);
+        memcpy(&b, outcome + 8 * k, 8);
+        correct[k] = pack8(~(a ^ b) & 0x0101010101010101ull);
+      }
+      if (m % 8) {
+        uint8_t last = 0;
+        for (size_t j = 8 * whole; j < m; j++) {
+          last |= (predictions[j] == outcome[j]) << (j % 8);
+        }
+        correct[whole] = last;
+      }
+    }
+    w->len += need;
+    predictions += m;
+    outcome += m;
+    n -= m;
+  }
+}
+
+int
+predictionWriter_close(PredictionWriter *w)
+{
+  predictionWriter_flush(w);
+  int ok = w->ok;
+  free(w->buf);
+  free(w);
+  return ok;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+  uint8_t *p = (uint8_t *)buf;
+  while (len > 0) {
+    ssize_t r = read(fd, p, len);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return 0;
+    }
+    p += r;
+    len -= r;
+  }
+  return 1;
+}
+
+PredictionReader *
+predictionReader_open(const char *path)
+{
+  int fd = STDIN_FILENO;
+  if (strcmp(path, "-") && (fd = open(path, O_RDONLY)) < 0) {
+    return NULL;
+  }
+
+  uint8_t header[16];
+  uint32_t version, flags;
+  if (!read_all(fd, header, sizeof(header)) ||
+      memcmp(header, PREDICTIONS_MAGIC, sizeof(PREDICTIONS_MAGIC))) {
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    return NULL;
+  }
+  memcpy(&version, header + 8, 4);
+  memcpy(&flags, header + 12, 4);
+  if (version != PREDICTIONS_VERSION) {
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  PredictionReader *r = (PredictionReader *)calloc(1, sizeof(PredictionReader));
+  r->fd = fd;
+  r->flags = flags;
+  return r;
+}
+
+uint32_t
+predictionReader_flags(const PredictionReader *r)
+{
+  return r->flags;
+}
+
+size_t
+predictionReader_next(PredictionReader *r, const uint8_t **predictions,
+                      const uint8_t **correct)
+{
+  uint32_t n;
+  if (!read_all(r->fd, &n, 4) || n == 0) {
+    return 0;
+  }
+  size_t bytes = ((size_t)n + 7) / 8;
+  int withCorrect = r->flags & PREDICTIONS_CORRECT;
+  if (n > r->cap) {
+    r->cap = n;
+    r->bits = (uint8_t *)realloc(r->bits, 2 * bytes);
+    r->predictions = (uint8_t *)realloc(r->predictions, n);
+    r->correct = (uint8_t *)realloc(r->correct, n);
+  }
+  if (!read_all(r->fd, r->bits, bytes * (withCorrect ? 2 : 1))) {
+    fprintf(stderr, "Truncated prediction stream\n");
+    return 0;
+  }
+  unpack_bits(r->bits, n, r->predictions);
+  *predictions = r->predictions;
+  *correct = NULL;
+  if (withCorrect) {
+    unpack_bits(r->bits + bytes, n, r->correct);
+    *correct = r->correct;
+  }
+  return n;
+}
+
+void
+predictionReader_close(PredictionReader *r)
+{
+  if (r->fd != STDIN_FILENO) {
+    close(r->fd);
+  }
+  free(r->bits);
+  free(r->predictions);
+  free(r->correct);
+  free(r);
+}
+
+size_t
+predictions_format_text(const uint8_t *predictions, size_t n, char *buf)
+{
+  for (size_t i = 0; i < n; i++) {
+    buf[2 * i] = '0' + predictions[i];
+    buf[2 * i + 1] = '\n';
+  }
+  return 2 * n;
+}
@@ -0,0 +1,91 @@
+//========================================================//
+//  predictions.h                                         //
+//  Header file for prediction output                     //
+//                                                        //
+//  Writes the predictions of a run as the one-digit-per- //
+//  line text of --verbose or as a bit-packed stream      //
+//========================================================//
+
+#ifndef PREDICTIONS_H
+#define PREDICTIONS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+//------------------------------------//
+//      Packed Prediction Format      //
+//------------------------------------//
+//
+// All fields are little-endian. The stream can be written to a pipe,
+// so it holds no total count.
+//
+//   offset 0   char     magic[8]   "BPPREDS\0"
+//   offset 8   uint32_t version    PREDICTIONS_VERSION
+//   offset 12  uint32_t flags      PREDICTIONS_CORRECT
+//   offset 16  chunks to the end of the stream, each
+//                uint32_t n
+//                uint8_t  prediction[(n + 7) / 8]
+//                uint8_t  correct[(n + 7) / 8]   with PREDICTIONS_CORRECT
+//
+// Branch i of a chunk is bit (i % 8) of byte i / 8. A correct bit is
+// set when the prediction matched the outcome.
+//
+#define PREDICTIONS_MAGIC   "BPPREDS"
+#define PREDICTIONS_VERSION 1
+#define PREDICTIONS_CORRECT 1
+
+// Bytes buffered before each write(2)
+#define PREDICTIONS_BUFFER (1 << 20)
+
+typedef struct PredictionWriter PredictionWriter;
+
+// Start a packed stream on 'fd', with correctness bits if 'flags'
+// has PREDICTIONS_CORRECT. The descriptor is not closed
+//
+PredictionWriter *predictionWriter_open(int fd, uint32_t flags);
+
+// Append the 'n' predictions of a batch and the outcomes they are
+// checked against
+//
+void predictionWriter_append(PredictionWriter *w, const uint8_t *predictions,
+                             const uint8_t *outcome, size_t n);
+
+// Flush the buffer
+//
+// Returns True if every write succeeded
+//
+int predictionWriter_close(PredictionWriter *w);
+
+typedef struct PredictionReader PredictionReader;
+
+// Open a packed stream, "-" reading stdin
+//
+// Returns NULL if it cannot be opened or is not a packed stream
+//
+PredictionReader *predictionReader_open(const char *path);
+
+uint32_t predictionReader_flags(const PredictionReader *r);
+
+// Unpack the next chunk. The arrays hold one byte per branch, are
+// owned by the reader and stay valid until the next call. 'correct'
+// is NULL without PREDICTIONS_CORRECT
+//
+// Returns the number of branches, 0 at the end of the stream
+//
+size_t predictionReader_next(PredictionReader *r, const uint8_t **predictions,
+                             const uint8_t **correct);
+
+void predictionReader_close(PredictionReader *r);
+
+//------------------------------------//
+//        Text Prediction Output      //
+//------------------------------------//
+
+// Format 'n' predictions as the "%d\n" lines of --verbose into
+// 'buf', which must hold 2 * n bytes
+//
+// Returns the number of bytes written
+//
+size_t predictions_format_text(const uint8_t *predictions, size_t n, char *buf);
+
+#endif
@@ -5,8 +5,19 @@
 //  Implement the various branch predictors below as      //
 //  described in the README                               //
 //========================================================//
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PERCEPTRON_X86
+#endif
 #include "predictor.h"
 
 //
@@ -21,10 +32,32 @@ const char *email = "tgujar@ucsd.edu";
 //------------------------------------//
 
 // Handy Global for use in output routines
-const char *bpName[4] = {"Static", "Gshare",
-                         "Tournament", "Custom"};
+const char *bpName[5] = {"Static", "Gshare",
+                         "Tournament", "Custom", "TAGE"};
 const int perceptron_threshold = 32768;
 
+// Sizes of the custom predictor, see pshare_init
+#define CUSTOM_PC_BITS 4     // perceptron table index
+#define CUSTOM_GHIST_BITS 13 // gshare and chooser history
+#define CUSTOM_PHIST_BITS 32 // perceptron history
+
+// Shape of the TAGE predictor, see tage_init. Only the table size
+// follows the storage budget
+#define TAGE_TABLES 8
+#define TAGE_FOLDS (3 * TAGE_TABLES) // folded registers
+#define TAGE_MAX_HIST 640
+#define TAGE_HIST_BUFFER 1024 // power of two above TAGE_MAX_HIST
+#define TAGE_PATH_BITS 16
+#define TAGE_CTR_BITS 3
+#define TAGE_U_BITS 2
+#define TAGE_USE_ALT_BITS 4
+#define TAGE_TICK_BITS 18 // branches between usefulness decays
+#define TAGE_MIN_TABLE_BITS 6
+#define TAGE_MAX_TABLE_BITS 20
+static const int tage_tag_bits[TAGE_TABLES] = {8, 8, 9, 9, 10, 10, 11, 11};
+// Geometric from 4 to TAGE_MAX_HIST, 4 * 160^(i / 7) rounded
+static const int tage_history_length[TAGE_TABLES] = {4, 8, 17, 35, 73, 150, 310, 640};
+
 int ghistoryBits; // Number of bits used for Global History
 int lhistoryBits; // Number of bits used for Local History
 int pcIndexBits;  // Number of bits used for PC index
@@ -64,21 +97,35 @@ void checkMem(void *v)
   }
 }
 
+// Saturating counters packed into 64-bit words, COUNTER_BITS bits
+// each. Counters never straddle words, so with the default 2 bits a
+// word holds 32 of them and a 2^20 entry table takes 256 KB. Wider
+// counters need a power of two COUNTER_BITS and a matching shift
+#define COUNTER_BITS 2
+#define COUNTER_SHIFT 5 // log2(64 / COUNTER_BITS), counters per word
+#define COUNTER_MASK ((1ULL << COUNTER_BITS) - 1)
+
 struct Counter
 {
-  int *counts;
+  uint64_t *words;
   int table_size;
-  int max_count;
+  int max_count; // at most COUNTER_MASK
 };
 typedef struct Counter Counter;
 
 Counter *counter_init(int table_size, int max_count)
 {
+  if (max_count > (int)COUNTER_MASK)
+  {
+    printf("counter max %d does not fit in %d bits", max_count, COUNTER_BITS);
+    exit(EXIT_FAILURE);
+  }
   Counter *c = (Counter *)malloc(sizeof(Counter));
   checkMem(c);
-  int *counters_arr = (int *)calloc(table_size, sizeof(int));
-  checkMem(counters_arr);
-  c->counts = counters_arr;
+  int words = (table_size + (1 << COUNTER_SHIFT) - 1) >> COUNTER_SHIFT;
+  uint64_t *words_arr = (uint64_t *)calloc(words, sizeof(uint64_t));
+  checkMem(words_arr);
+  c->words = words_arr;
   c->table_size = table_size;
   c->max_count = max_count;
   return c;
@@ -86,24 +133,55 @@ Counter *counter_init(int table_size, int max_count)
 
 void counter_destroy(Counter *c)
 {
-  free(c->counts);
+  free(c->words);
   free(c);
 }
 
-void increment(Counter *c, int index)
+// Bit offset of counter 'index' within its word
+static inline int counter_offset(uint32_t index)
+{
+  return (index & ((1 << COUNTER_SHIFT) - 1)) * COUNTER_BITS;
+}
+
+static inline int counter_get(Counter *c, uint32_t index)
+{
+  return (c->words[index >> COUNTER_SHIFT] >> counter_offset(index)) & COUNTER_MASK;
+}
+
+static inline void counter_set(Counter *c, uint32_t index, int val)
+{
+  uint64_t *w = &c->words[index >> COUNTER_SHIFT];
+  int off = counter_offset(index);
+  *w = (*w & ~(COUNTER_MASK << off)) | ((uint64_t)val << off);
+}
+
+// Set every counter to 'val'
+void counter_fill(Counter *c, int val)
+{
+  uint64_t pattern = 0;
+  for (int i = 0; i < 64; i += COUNTER_BITS)
+    pattern |= (uint64_t)val << i;
+  int words = (c->table_size + (1 << COUNTER_SHIFT) - 1) >> COUNTER_SHIFT;
+  for (int i = 0; i < words; i++)
+    c->words[i] = pattern;
+}
+
+// Increment and decrement saturate without branching: the
+// comparison adds or subtracts 0 at the ends of the range
+static inline void increment(Counter *c, uint32_t index)
 {
-  int *val = &(c->counts[index]);
-  *val += 1;
-  if (*val > c->max_count)
-    *val = c->max_count;
+  uint64_t *w = &c->words[index >> COUNTER_SHIFT];
+  int off = counter_offset(index);
+  uint64_t val = (*w >> off) & COUNTER_MASK;
+  *w += (uint64_t)(val < (uint64_t)c->max_count) << off;
 }
 
-void decrement(Counter *c, int index)
+static inline void decrement(Counter *c, uint32_t index)
 {
-  int *val = &(c->counts[index]);
-  *val -= 1;
-  if (*val == -1)
-    *val = 0;
+  uint64_t *w = &c->words[index >> COUNTER_SHIFT];
+  int off = counter_offset(index);
+  uint64_t val = (*w >> off) & COUNTER_MASK;
+  *w -= (uint64_t)(val != 0) << off;
 }
 
 struct BimodalCounter
@@ -129,7 +207,7 @@ void bimodalCounter_destroy(BimodalCounter *bc)
 
 uint8_t getOutcome(BimodalCounter *bc, int index)
 {
-  return bc->counter->counts[index] >= 2;
+  return counter_get(bc->counter, index) >= 2;
 }
 
 //------------------------------------//
@@ -144,7 +222,6 @@ struct Gshare
   BimodalCounter *bc;
 };
 typedef struct Gshare Gshare;
-Gshare *gshare;
 
 // LocalHistory
 struct Lhist
@@ -155,7 +232,6 @@ struct Lhist
   BimodalCounter *bc;
 };
 typedef struct Lhist Lhist;
-Lhist *lhist;
 
 // Choice
 struct Choice
@@ -167,27 +243,22 @@ struct Choice
   BimodalCounter *global_bc;
 };
 typedef struct Choice Choice;
-Choice *choice;
 
 // Custom
-struct Perceptron
-{
-  uint32_t width;
-  int16_t *weights;
-  int16_t bias;
-};
-typedef struct Perceptron Perceptron;
-
+// All perceptrons share one row-major weight matrix. Rows are padded
+// to a whole number of SIMD vectors and the padding weights stay zero
 struct PerceptronTable
 {
-  Perceptron **pt;
+  int16_t *weights; // table_size rows of 'stride' weights
+  int16_t *bias;
+  int width;
+  int stride;
   int table_size;
   uint64_t ghistory;
   uint64_t ghistoryMask;
   uint32_t pcMask;
 };
 typedef struct PerceptronTable PerceptronTable;
-PerceptronTable *ptable;
 
 struct PShare // Hybid Gshare and PerceptronTable, weakly favor gshare at start
 {
@@ -198,7 +269,93 @@ struct PShare // Hybid Gshare and PerceptronTable, weakly favor gshare at start
   uint32_t ghistoryMask;
 };
 typedef struct PShare PShare;
-PShare *pshare;
+
+// TAGE
+// Tagged entries take 4 bytes, so a lookup reads one cache line per
+// table and a line holds 16 neighbouring entries
+struct TageEntry
+{
+  uint16_t tag;
+  int8_t ctr; // signed TAGE_CTR_BITS counter, taken when >= 0
+  uint8_t u;  // usefulness
+};
+typedef struct TageEntry TageEntry;
+
+// Every register of the predictor. It holds no pointers, so a
+// snapshot can store it as it is
+struct TageHistory
+{
+  uint8_t buffer[TAGE_HIST_BUFFER]; // outcome i branches ago at head + i
+  uint32_t head;
+  uint32_t path; // low PC bits of recent branches
+  // Per table, its history length of outcomes XORed together in
+  // chunks of the index width and of the two tag widths, table i
+  // at fold[i], fold[TAGE_TABLES + i] and fold[2 * TAGE_TABLES + i]
+  uint32_t fold[TAGE_FOLDS];
+  int32_t useAlt; // trust the alternate over new provider entries when >= 0
+  uint32_t tick;
+  uint32_t seed; // allocation randomness
+};
+typedef struct TageHistory TageHistory;
+
+struct Tage
+{
+  int tableBits; // log2 entries of each tagged table
+  int baseBits;  // log2 entries of the base table
+  // Per folded register, its top bit (1 << width) and the bit where
+  // the outcome leaving the window sits (history length % width)
+  uint32_t foldTop[TAGE_FOLDS];
+  uint32_t foldOut[TAGE_FOLDS];
+  BimodalCounter *base;
+  TageEntry *entries; // TAGE_TABLES tables, each 1 << tableBits entries
+  TageHistory *hist;
+};
+typedef struct Tage Tage;
+
+// Everything a prediction looked up. The update for the same branch
+// works from these values instead of repeating the lookups
+struct Lookup
+{
+  bool valid;
+  uint32_t pc;
+  uint8_t prediction;
+  uint32_t choiceIdx; // chooser counter index
+  bool chooseGlobal;  // chooser picked global/gshare
+  uint32_t gidx;      // global or gshare counter index
+  uint8_t gpred;      // global or gshare prediction
+  uint32_t tidx;      // local history table index
+  uint32_t cidx;      // local counter index
+  uint32_t row;       // perceptron row
+  int32_t y;          // perceptron output
+  uint8_t lpred;      // local, perceptron or TAGE provider prediction
+  int8_t provider;    // longest matching TAGE table, -1 for the base
+  int8_t alt;         // next longest matching TAGE table
+  uint8_t altpred;    // prediction without the provider
+  uint8_t component;  // see PredictorComponents
+  uint32_t tageIdx[TAGE_TABLES];
+  uint16_t tageTag[TAGE_TABLES];
+};
+typedef struct Lookup Lookup;
+
+// Runs a batch of branches through a predictor, see predictor_run
+typedef uint64_t (*PredictorKernel)(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                                    uint8_t *predictions, size_t n);
+
+// A predictor instance: its configuration and the tables of its type
+struct predictor
+{
+  PredictorConfig config;
+  PredictorKernel run; // specialized for the configuration when possible
+  Gshare *gshare;
+  Choice *choice;
+  PShare *pshare;
+  Tage *tage;
+  Lookup pending; // from predictor_predict, for predictor_update
+  PredictorComponents components;
+};
+
+// The instance behind init_predictor, make_prediction and friends
+static predictor_t *defaultPredictor;
 
 //------------------------------------//
 //        Predictor Functions         //
@@ -236,19 +393,18 @@ uint32_t gshare_getIndex(Gshare *g, uint32_t pc)
   return (pc & g->ghistoryMask) ^ g->ghistory;
 }
 
-uint8_t gshare_predict(Gshare *g, uint32_t pc)
+void gshare_lookup(Gshare *g, uint32_t pc, Lookup *l)
 {
-  uint32_t idx = gshare_getIndex(g, pc);
-  return getOutcome(g->bc, idx);
+  l->gidx = gshare_getIndex(g, pc);
+  l->gpred = getOutcome(g->bc, l->gidx);
 }
 
-void gshare_update(Gshare *g, uint32_t pc, uint8_t outcome)
+void gshare_apply(Gshare *g, Lookup *l, uint8_t outcome)
 {
-  uint32_t idx = gshare_getIndex(g, pc);
   if (outcome == 0)
-    decrement(g->bc->counter, idx);
+    decrement(g->bc->counter, l->gidx);
   else
-    increment(g->bc->counter, idx);
+    increment(g->bc->counter, l->gidx);
   gshare_add_history(g, outcome == 1);
 }
 
@@ -282,16 +438,15 @@ uint32_t lhist_get_hist_index(Lhist *lh, uint32_t pc)
   return getLowerNBits(pc, lh->pc_bits);
 }
 
-uint8_t lhist_predict(Lhist *lh, uint32_t pc)
+void lhist_lookup(Lhist *lh, uint32_t pc, Lookup *l)
 {
-  uint32_t tidx = lhist_get_hist_index(lh, pc);
-  uint32_t cidx = lh->hist_table[tidx];
-  return getOutcome(lh->bc, cidx);
+  l->tidx = lhist_get_hist_index(lh, pc); // index into history table
+  l->cidx = lh->hist_table[l->tidx];      // index for counter = value of history at index tidx
+  l->lpred = getOutcome(lh->bc, l->cidx);
 }
 
-void lhist_add_history(Lhist *lh, uint32_t pc, bool taken)
+void lhist_add_history(Lhist *lh, uint32_t tidx, bool taken)
 {
-  uint32_t tidx = lhist_get_hist_index(lh, pc);
   int *curr_hist = &(lh->hist_table[tidx]);
   *curr_hist = *curr_hist << 1;
   if (taken)
@@ -299,19 +454,17 @@ void lhist_add_history(Lhist *lh, uint32_t pc, bool taken)
   *curr_hist = getLowerNBits(*curr_hist, lh->hist_bits);
 }
 
-void lhist_update(Lhist *lh, uint32_t pc, uint8_t outcome)
+void lhist_apply(Lhist *lh, Lookup *l, uint8_t outcome)
 {
-  uint32_t tidx = lhist_get_hist_index(lh, pc); // index into history table
-  uint32_t cidx = lh->hist_table[tidx];         // index for counter = value of history at index tidx
   if (outcome == 1)
   {
-    increment(lh->bc->counter, cidx);
+    increment(lh->bc->counter, l->cidx);
   }
   else
   {
-    decrement(lh->bc->counter, cidx);
+    decrement(lh->bc->counter, l->cidx);
   }
-  lhist_add_history(lh, pc, outcome == 1);
+  lhist_add_history(lh, l->tidx, outcome == 1);
 }
 
 //////////////////////////////////////// Choice/ Tournament ////////////////////////////////////////////
@@ -326,11 +479,7 @@ Choice *choice_init(int ghistoryBits, int pcIndexBits, int lhistoryBits)
   cp->global_bc = bimodalCounter_init(table_size);
 
   BimodalCounter *bc = bimodalCounter_init(table_size);
-  int *arr = bc->counter->counts;
-  for (int i = 0; i < table_size; i++)
-  {
-    arr[i] = 2; // set to weakly select global
-  }
+  counter_fill(bc->counter, 2); // set to weakly select global
   cp->choice_bc = bc;
 
   return cp;
@@ -344,7 +493,7 @@ void choice_destroy(Choice *cp)
   free(cp);
 }
 
-void choice_add_history(Choice *cp, uint32_t pc, bool taken)
+void choice_add_history(Choice *cp, bool taken)
 {
   cp->ghistory = cp->ghistory << 1;
   if (taken)
@@ -352,112 +501,211 @@ void choice_add_history(Choice *cp, uint32_t pc, bool taken)
   cp->ghistory &= cp->ghistoryMask;
 }
 
-uint8_t choice_predict(Choice *cp, uint32_t pc)
+void choice_lookup(Choice *cp, uint32_t pc, Lookup *l)
 {
-  bool chooseGlobal = getOutcome(cp->choice_bc, cp->ghistory); // history decides index in table
-  if (chooseGlobal)
-  {
-    return getOutcome(cp->global_bc, cp->ghistory); // global depends only on history
-  }
-  return lhist_predict(cp->lhist, pc);
+  l->choiceIdx = cp->ghistory; // history decides index in table
+  l->gidx = cp->ghistory;      // global depends only on history
+  l->chooseGlobal = getOutcome(cp->choice_bc, l->choiceIdx);
+  l->gpred = getOutcome(cp->global_bc, l->gidx);
+  lhist_lookup(cp->lhist, pc, l);
+  l->prediction = l->chooseGlobal ? l->gpred : l->lpred;
 }
 
-void choice_update(Choice *cp, uint32_t pc, uint8_t outcome)
+void choice_apply(Choice *cp, Lookup *l, uint8_t outcome)
 {
-  uint32_t idx = cp->ghistory;
   ////// Update choice predictor
-  uint8_t global_pred = getOutcome(cp->global_bc, idx);
-  uint8_t lhist_pred = lhist_predict(cp->lhist, pc);
+  uint8_t global_pred = l->gpred;
+  uint8_t lhist_pred = l->lpred;
   // if both predict wrong or both predict correct, stay in the current state
   if (!((global_pred != outcome && lhist_pred != outcome) || (global_pred == outcome && lhist_pred == outcome)))
   {
     if (global_pred == outcome) // if correct pred, enforce
     {
-      increment(cp->choice_bc->counter, idx);
+      increment(cp->choice_bc->counter, l->choiceIdx);
     }
     else
     {
-      decrement(cp->choice_bc->counter, idx);
+      decrement(cp->choice_bc->counter, l->choiceIdx);
     }
   }
 
   // Update local history predictor
-  lhist_update(cp->lhist, pc, outcome == 1);
+  lhist_apply(cp->lhist, l, outcome == 1);
 
   // Update global predictor
   if (outcome == 0)
-    decrement(cp->global_bc->counter, idx);
+    decrement(cp->global_bc->counter, l->gidx);
   else
-    increment(cp->global_bc->counter, idx);
+    increment(cp->global_bc->counter, l->gidx);
 
-  choice_add_history(cp, pc, outcome == 1);
+  choice_add_history(cp, outcome == 1);
 }
 
 //////////////////////////////////////// CUSTOM ////////////////////////////////////////////
 
-Perceptron *perceptron_init(uint32_t width)
+// Perceptron kernels. Each history bit becomes a multiplier of +1
+// (taken) or -1 (not taken), and 0 for padding lanes, so the output
+// is bias + sum(m[i] * w[i]) and training adds sign * m[i] to w[i].
+// Weights wrap at 16 bits in every kernel
+typedef int32_t (*PerceptronDot)(const int16_t *w, int16_t bias, uint64_t history, int width);
+typedef void (*PerceptronTrain)(int16_t *w, uint64_t history, int width, int sign);
+
+#define PERCEPTRON_STRIDE 16 // weights per AVX2 vector
+
+int32_t perceptron_dot_scalar(const int16_t *w, int16_t bias, uint64_t history, int width)
 {
-  Perceptron *p = (Perceptron *)malloc(sizeof(Perceptron));
-  p->weights = calloc(width, sizeof(int16_t));
-  p->width = width;
-  return p;
+  int32_t out = bias;
+  for (int i = 0; i < width; i++)
+  {
+    int32_t m = (int32_t)((history >> i) & 1) * 2 - 1;
+    out += m * w[i];
+  }
+  return out;
 }
 
-int32_t perceptron_compute(Perceptron *p, uint64_t history)
+void perceptron_train_scalar(int16_t *w, uint64_t history, int width, int sign)
 {
-  int32_t out = p->bias;
-  for (int i = 0; i < p->width; i++)
+  for (int i = 0; i < width; i++)
   {
-    if (history & (1 << i)) // if bit is 1 then taken
-    {
-      out += p->weights[i];
-    }
-    else // not taken
-    {
-      out -= p->weights[i];
-    }
+    int32_t m = (int32_t)((history >> i) & 1) * 2 - 1;
+    w[i] = (int16_t)(w[i] + sign * m);
   }
-  return out;
 }
 
-void perceptron_train(Perceptron *p, uint8_t outcome, uint64_t history) // -1 is NT, 1 is T
+#ifdef PERCEPTRON_X86
+// Expand 8 history bits, starting at bit 'base', into 16-bit multipliers
+static inline __m128i perceptron_signs_sse(uint64_t history, int base, int width)
 {
-  int32_t y_out = perceptron_compute(p, history);
-  int8_t br_outcome = outcome == 1 ? 1 : -1;
-  if (getSign(y_out) != br_outcome || abs(y_out) <= perceptron_threshold)
+  const __m128i sel = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m128i lane = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+  __m128i bits = _mm_set1_epi16((int16_t)((history >> base) & 0xFF));
+  __m128i set = _mm_cmpeq_epi16(_mm_and_si128(bits, sel), sel);
+  __m128i m = _mm_sub_epi16(_mm_and_si128(set, _mm_set1_epi16(2)), _mm_set1_epi16(1));
+  __m128i valid = _mm_cmpgt_epi16(_mm_set1_epi16((int16_t)(width - base)), lane);
+  return _mm_and_si128(m, valid);
+}
+
+int32_t perceptron_dot_sse(const int16_t *w, int16_t bias, uint64_t history, int width)
+{
+  __m128i acc = _mm_setzero_si128();
+  for (int i = 0; i < width; i += 8)
   {
-    p->bias += getSign(y_out);
-    for (int i = 0; i < p->width; i++)
-    {
-      if (history & (1 << i))
-      {
-        p->weights[i] += getSign(y_out);
-      }
-      else
-      {
-        p->weights[i] -= getSign(y_out);
-      }
-    }
+    __m128i m = perceptron_signs_sse(history, i, width);
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(w + i)), m));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return bias + _mm_cvtsi128_si32(acc);
+}
+
+void perceptron_train_sse(int16_t *w, uint64_t history, int width, int sign)
+{
+  for (int i = 0; i < width; i += 8)
+  {
+    __m128i m = perceptron_signs_sse(history, i, width);
+    __m128i *p = (__m128i *)(w + i);
+    __m128i v = _mm_loadu_si128(p);
+    v = sign > 0 ? _mm_add_epi16(v, m) : _mm_sub_epi16(v, m);
+    _mm_storeu_si128(p, v);
+  }
+}
+
+// Expand 16 history bits, starting at bit 'base', into 16-bit multipliers
+__attribute__((target("avx2"))) static inline __m256i perceptron_signs_avx2(uint64_t history, int base, int width)
+{
+  const __m256i sel = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048,
+                                        4096, 8192, 16384, (int16_t)0x8000);
+  const __m256i lane = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m256i bits = _mm256_set1_epi16((int16_t)((history >> base) & 0xFFFF));
+  __m256i set = _mm256_cmpeq_epi16(_mm256_and_si256(bits, sel), sel);
+  __m256i m = _mm256_sub_epi16(_mm256_and_si256(set, _mm256_set1_epi16(2)), _mm256_set1_epi16(1));
+  __m256i valid = _mm256_cmpgt_epi16(_mm256_set1_epi16((int16_t)(width - base)), lane);
+  return _mm256_and_si256(m, valid);
+}
+
+__attribute__((target("avx2"))) int32_t perceptron_dot_avx2(const int16_t *w, int16_t bias, uint64_t history, int width)
+{
+  __m256i acc = _mm256_setzero_si256();
+  for (int i = 0; i < width; i += 16)
+  {
+    __m256i m = perceptron_signs_avx2(history, i, width);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(w + i)), m));
+  }
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return bias + _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2"))) void perceptron_train_avx2(int16_t *w, uint64_t history, int width, int sign)
+{
+  for (int i = 0; i < width; i += 16)
+  {
+    __m256i m = perceptron_signs_avx2(history, i, width);
+    __m256i *p = (__m256i *)(w + i);
+    __m256i v = _mm256_loadu_si256(p);
+    v = sign > 0 ? _mm256_add_epi16(v, m) : _mm256_sub_epi16(v, m);
+    _mm256_storeu_si256(p, v);
   }
 }
+#endif
+
+PerceptronDot perceptron_dot = NULL;
+PerceptronTrain perceptron_train_kernel = NULL;
+// Tables are created on pool threads, so the kernels are picked once
+static pthread_once_t perceptronKernelsOnce = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernels the host supports
+void perceptron_select_kernels()
+{
+  perceptron_dot = perceptron_dot_scalar;
+  perceptron_train_kernel = perceptron_train_scalar;
+#ifdef PERCEPTRON_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    perceptron_dot = perceptron_dot_avx2;
+    perceptron_train_kernel = perceptron_train_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    perceptron_dot = perceptron_dot_sse;
+    perceptron_train_kernel = perceptron_train_sse;
+  }
+#endif
+}
 
 PerceptronTable *perceptronTable_init(int pcIndexBits, int ghistoryBits)
 {
-  PerceptronTable *ptable = (PerceptronTable *)malloc(sizeof(PerceptronTable));
+  pthread_once(&perceptronKernelsOnce, perceptron_select_kernels);
+
+  PerceptronTable *ptable = (PerceptronTable *)calloc(1, sizeof(PerceptronTable));
+  checkMem(ptable);
   int table_size = getTableSize(pcIndexBits);
-  int perceptron_width = ghistoryBits;
+  ptable->width = ghistoryBits;
+  ptable->stride = (ghistoryBits + PERCEPTRON_STRIDE - 1) / PERCEPTRON_STRIDE * PERCEPTRON_STRIDE;
   ptable->table_size = table_size;
   ptable->ghistory = 0;
-  ptable->ghistoryMask = (1 << ghistoryBits) - 1; // need 64bit val
+  ptable->ghistoryMask = ghistoryBits >= 64 ? ~0ULL : (1ULL << ghistoryBits) - 1;
   ptable->pcMask = getLowerNBits(~0, pcIndexBits);
-  ptable->pt = calloc(table_size, sizeof(Perceptron *));
-  for (int i = 0; i < table_size; i++)
-  {
-    ptable->pt[i] = perceptron_init(perceptron_width);
-  }
+
+  size_t bytes = (size_t)table_size * ptable->stride * sizeof(int16_t);
+  if (posix_memalign((void **)&ptable->weights, 64, bytes ? bytes : 64) != 0)
+    ptable->weights = NULL;
+  checkMem(ptable->weights);
+  memset(ptable->weights, 0, bytes);
+  ptable->bias = (int16_t *)calloc(table_size, sizeof(int16_t));
+  checkMem(ptable->bias);
   return ptable;
 }
 
+void perceptronTable_destroy(PerceptronTable *ptable)
+{
+  free(ptable->weights);
+  free(ptable->bias);
+  free(ptable);
+}
+
 void perceptronTable_addHistory(PerceptronTable *ptable, bool taken)
 {
   ptable->ghistory = ptable->ghistory << 1;
@@ -466,25 +714,32 @@ void perceptronTable_addHistory(PerceptronTable *ptable, bool taken)
   ptable->ghistory &= ptable->ghistoryMask;
 }
 
-Perceptron *perceptronTable_getPerceptron(PerceptronTable *ptable, uint32_t pc)
+uint32_t perceptronTable_getRow(PerceptronTable *ptable, uint32_t pc)
 {
   uint32_t hash = ((uint64_t)pc) * (pc + 7) % (ptable->pcMask + 1);
-  return ptable->pt[hash];
-  // return ptable->pt[(pc ^ ptable->ghistory) & ptable->pcMask];
-  // return ptable->pt[pc & ptable->pcMask];
+  return hash;
+  // return (pc ^ ptable->ghistory) & ptable->pcMask;
+  // return pc & ptable->pcMask;
 }
 
-bool perceptronTable_predict(PerceptronTable *ptable, uint32_t pc)
+void perceptronTable_lookup(PerceptronTable *ptable, uint32_t pc, Lookup *l)
 {
-  Perceptron *p = perceptronTable_getPerceptron(ptable, pc);
-  int32_t y = perceptron_compute(p, ptable->ghistory);
-  return y >= 0;
+  l->row = perceptronTable_getRow(ptable, pc);
+  l->y = perceptron_dot(ptable->weights + (size_t)l->row * ptable->stride,
+                        ptable->bias[l->row], ptable->ghistory, ptable->width);
+  l->lpred = l->y >= 0;
 }
 
-void perceptronTable_update(PerceptronTable *ptable, uint32_t pc, uint8_t outcome)
+void perceptronTable_apply(PerceptronTable *ptable, Lookup *l, uint8_t outcome) // -1 is NT, 1 is T
 {
-  Perceptron *p = perceptronTable_getPerceptron(ptable, pc);
-  perceptron_train(p, outcome, ptable->ghistory);
+  int32_t y_out = l->y;
+  int8_t br_outcome = outcome == 1 ? 1 : -1;
+  if (getSign(y_out) != br_outcome || abs(y_out) <= perceptron_threshold)
+  {
+    ptable->bias[l->row] += getSign(y_out);
+    perceptron_train_kernel(ptable->weights + (size_t)l->row * ptable->stride,
+                            ptable->ghistory, ptable->width, getSign(y_out));
+  }
   perceptronTable_addHistory(ptable, outcome == 1);
 }
 
@@ -495,27 +750,30 @@ PShare *pshare_init(int pcIndexBits, int ghistoryBits, int phistoryBits)
   pshare->bc = bimodalCounter_init(table_size);
   pshare->ghistory = 0;
   pshare->ghistoryMask = getLowerNBits(~0, ghistoryBits);
-  int *arr = pshare->bc->counter->counts;
-  for (int i = 0; i < table_size; i++)
-  {
-    arr[i] = 2; // set to weakly select gshare
-  }
+  counter_fill(pshare->bc->counter, 2); // set to weakly select gshare
   pshare->ptable = perceptronTable_init(pcIndexBits, phistoryBits);
   pshare->gshare = gshare_init(ghistoryBits);
   return pshare;
 }
 
-uint8_t pshare_predict(PShare *pshare, uint32_t pc)
+void pshare_destroy(PShare *pshare)
 {
-  bool chooseGshare = getOutcome(pshare->bc, pshare->ghistory); // history decides index in table
-  if (chooseGshare)
-  {
-    return gshare_predict(pshare->gshare, pc);
-  }
-  return perceptronTable_predict(pshare->ptable, pc);
+  perceptronTable_destroy(pshare->ptable);
+  gshare_destroy(pshare->gshare);
+  bimodalCounter_destroy(pshare->bc);
+  free(pshare);
+}
+
+void pshare_lookup(PShare *pshare, uint32_t pc, Lookup *l)
+{
+  l->choiceIdx = pshare->ghistory; // history decides index in table
+  l->chooseGlobal = getOutcome(pshare->bc, l->choiceIdx);
+  gshare_lookup(pshare->gshare, pc, l);
+  perceptronTable_lookup(pshare->ptable, pc, l);
+  l->prediction = l->chooseGlobal ? l->gpred : l->lpred;
 }
 
-void pshare_add_history(PShare *pshare, uint32_t pc, bool taken)
+void pshare_add_history(PShare *pshare, bool taken)
 {
   pshare->ghistory = pshare->ghistory << 1;
   if (taken)
@@ -523,103 +781,1158 @@ void pshare_add_history(PShare *pshare, uint32_t pc, bool taken)
   pshare->ghistory &= pshare->ghistoryMask;
 }
 
-void pshare_update(PShare *pshare, uint32_t pc, uint8_t outcome)
+void pshare_apply(PShare *pshare, Lookup *l, uint8_t outcome)
 {
-  uint32_t idx = pshare->ghistory;
   ////// Update choice predictor
-  uint8_t gshare_pred = gshare_predict(pshare->gshare, pc);
-  uint8_t ptable_pred = perceptronTable_predict(pshare->ptable, pc);
+  uint8_t gshare_pred = l->gpred;
+  uint8_t ptable_pred = l->lpred;
   // if both predict wrong or both predict correct, stay in the current state
   if (!((gshare_pred != outcome && ptable_pred != outcome) || (gshare_pred == outcome && ptable_pred == outcome)))
   {
     if (gshare_pred == outcome) // if correct pred, enforce
     {
-      increment(pshare->bc->counter, idx);
+      increment(pshare->bc->counter, l->choiceIdx);
     }
     else
     {
-      decrement(pshare->bc->counter, idx);
+      decrement(pshare->bc->counter, l->choiceIdx);
     }
   }
 
   // Update ptable predictor
-  perceptronTable_update(pshare->ptable, pc, outcome);
+  perceptronTable_apply(pshare->ptable, l, outcome);
 
   // Update gshare predictor
-  gshare_update(pshare->gshare, pc, outcome);
+  gshare_apply(pshare->gshare, l, outcome);
 
-  pshare_add_history(pshare, pc, outcome == 1);
+  pshare_add_history(pshare, outcome == 1);
 }
 
-// Initialize the predictor
+//////////////////////////////////////// TAGE ////////////////////////////////////////////
+// A base bimodal table backed by tagged tables indexed with global
+// histories of geometrically increasing length. The global history
+// lives in a circular buffer and each table hashes folded copies of
+// its own length of it, so the cost per branch does not depend on
+// the history lengths
+
+// Storage of a TAGE predictor with tagged tables of 2^tableBits
+// entries: tables, history, path, folded registers and counters
 //
-void init_predictor()
+uint64_t tage_storage_bits(int tableBits)
 {
-  switch (bpType)
+  uint64_t entries = 1ULL << tableBits;
+  uint64_t bits = (entries << 1) * 2; // base table
+  for (int i = 0; i < TAGE_TABLES; i++)
   {
-  case STATIC:
+    bits += entries * (TAGE_CTR_BITS + TAGE_U_BITS + tage_tag_bits[i]);
+    bits += tableBits + tage_tag_bits[i] + (tage_tag_bits[i] - 1); // folded registers
+  }
+  return bits + TAGE_MAX_HIST + TAGE_PATH_BITS + TAGE_USE_ALT_BITS + TAGE_TICK_BITS;
+}
+
+// Largest tagged table size whose storage fits 'kbits' Kbits
+//
+int tage_table_bits(int kbits)
+{
+  int bits = TAGE_MIN_TABLE_BITS;
+  while (bits < TAGE_MAX_TABLE_BITS && tage_storage_bits(bits + 1) <= (uint64_t)kbits * 1024)
+    bits++;
+  return bits;
+}
+
+// Shift the newest outcome 'in' into a folded history with top bit
+// 'top', wrapping the bit shifted out of it back to bit 0, and fold
+// out the outcome that just left the window where 'outMask' selects
+// its bit. There are no variable shifts, so the same steps update
+// four registers at once in SSE2
+static inline uint32_t tage_fold(uint32_t v, uint32_t in, uint32_t outMask, uint32_t top)
+{
+  v = ((v << 1) | in) ^ outMask;
+  v ^= (v & top) != 0;
+  return v & (top - 1);
+}
+
+Tage *tage_init(int budgetKbits)
+{
+  Tage *t = (Tage *)calloc(1, sizeof(Tage));
+  checkMem(t);
+  t->tableBits = tage_table_bits(budgetKbits);
+  t->baseBits = t->tableBits + 1;
+  t->base = bimodalCounter_init(getTableSize(t->baseBits));
+  counter_fill(t->base->counter, WN);
+
+  size_t bytes = ((size_t)TAGE_TABLES << t->tableBits) * sizeof(TageEntry);
+  if (posix_memalign((void **)&t->entries, 64, bytes) != 0)
+    t->entries = NULL;
+  checkMem(t->entries);
+  memset(t->entries, 0, bytes);
+
+  for (int i = 0; i < TAGE_TABLES; i++)
+  {
+    int width[3] = {t->tableBits, tage_tag_bits[i], tage_tag_bits[i] - 1};
+    for (int k = 0; k < 3; k++)
+    {
+      t->foldTop[k * TAGE_TABLES + i] = 1u << width[k];
+      t->foldOut[k * TAGE_TABLES + i] = 1u << (tage_history_length[i] % width[k]);
+    }
+  }
+  t->hist = (TageHistory *)calloc(1, sizeof(TageHistory));
+  checkMem(t->hist);
+  t->hist->seed = 1;
+  return t;
+}
+
+void tage_destroy(Tage *t)
+{
+  bimodalCounter_destroy(t->base);
+  free(t->entries);
+  free(t->hist);
+  free(t);
+}
+
+static inline TageEntry *tage_entry(Tage *t, int table, uint32_t idx)
+{
+  return &t->entries[((size_t)table << t->tableBits) + idx];
+}
+
+void tage_lookup(Tage *t, uint32_t pc, Lookup *l)
+{
+  TageHistory *h = t->hist;
+  uint32_t mask = (1u << t->tableBits) - 1;
+
+  l->gidx = pc & getLowerNBits(~0, t->baseBits);
+  l->gpred = getOutcome(t->base, l->gidx);
+  l->provider = -1;
+  l->alt = -1;
+  for (int i = TAGE_TABLES - 1; i >= 0; i--)
+  {
+    int pathBits = tage_history_length[i] < TAGE_PATH_BITS ? tage_history_length[i] : TAGE_PATH_BITS;
+    uint32_t path = h->path & ((1u << pathBits) - 1);
+    l->tageIdx[i] = (pc ^ (pc >> t->tableBits) ^ h->fold[i] ^ path ^ (path >> (i + 1))) & mask;
+    l->tageTag[i] = (pc ^ h->fold[TAGE_TABLES + i] ^ (h->fold[2 * TAGE_TABLES + i] << 1)) &
+                    ((1u << tage_tag_bits[i]) - 1);
+    if (tage_entry(t, i, l->tageIdx[i])->tag == l->tageTag[i])
+    {
+      if (l->provider < 0)
+        l->provider = i;
+      else if (l->alt < 0)
+        l->alt = i;
+    }
+  }
+
+  l->altpred = l->alt >= 0 ? tage_entry(t, l->alt, l->tageIdx[l->alt])->ctr >= 0 : l->gpred;
+  if (l->provider < 0)
+  {
+    l->prediction = l->gpred;
+    l->component = 1;
     return;
+  }
+  TageEntry *e = tage_entry(t, l->provider, l->tageIdx[l->provider]);
+  l->lpred = e->ctr >= 0;
+  // A weak entry that has never been useful is likely new, and the
+  // alternate is often better than it
+  bool fresh = e->u == 0 && (e->ctr == 0 || e->ctr == -1);
+  bool useAlt = fresh && h->useAlt >= 0;
+  l->prediction = useAlt ? l->altpred : l->lpred;
+  l->component = useAlt && l->alt < 0;
+}
+
+void tage_add_history(Tage *t, uint32_t pc, bool taken)
+{
+  TageHistory *h = t->hist;
+  h->head = (h->head - 1) & (TAGE_HIST_BUFFER - 1);
+  h->buffer[h->head] = taken;
+  h->path = ((h->path << 1) | (pc & 1)) & ((1u << TAGE_PATH_BITS) - 1);
+  // The registers of a table share a window and so the leaving
+  // outcome, as an all-ones or zero mask per table
+  uint32_t out[TAGE_TABLES];
+  for (int i = 0; i < TAGE_TABLES; i++)
+    out[i] = -(uint32_t)h->buffer[(h->head + tage_history_length[i]) & (TAGE_HIST_BUFFER - 1)];
+#ifdef PERCEPTRON_X86
+  // Four registers at a time. Each group of four lies within one of
+  // the index, first tag or second tag rows
+  const __m128i in = _mm_set1_epi32(taken);
+  const __m128i one = _mm_set1_epi32(1);
+  for (int j = 0; j < TAGE_FOLDS; j += 4)
+  {
+    __m128i v = _mm_loadu_si128((__m128i *)&h->fold[j]);
+    __m128i top = _mm_loadu_si128((const __m128i *)&t->foldTop[j]);
+    __m128i o = _mm_and_si128(_mm_loadu_si128((const __m128i *)&out[j % TAGE_TABLES]),
+                              _mm_loadu_si128((const __m128i *)&t->foldOut[j]));
+    v = _mm_xor_si128(_mm_or_si128(_mm_slli_epi32(v, 1), in), o);
+    __m128i wrap = _mm_cmpeq_epi32(_mm_and_si128(v, top), top);
+    v = _mm_xor_si128(v, _mm_and_si128(wrap, one));
+    v = _mm_and_si128(v, _mm_sub_epi32(top, one));
+    _mm_storeu_si128((__m128i *)&h->fold[j], v);
+  }
+#else
+  for (int j = 0; j < TAGE_FOLDS; j++)
+    h->fold[j] = tage_fold(h->fold[j], taken, out[j % TAGE_TABLES] & t->foldOut[j], t->foldTop[j]);
+#endif
+}
+
+static inline int8_t tage_ctr_update(int8_t ctr, bool taken)
+{
+  const int8_t max = (1 << (TAGE_CTR_BITS - 1)) - 1;
+  if (taken)
+    return ctr < max ? ctr + 1 : ctr;
+  return ctr > -max - 1 ? ctr - 1 : ctr;
+}
+
+// After a misprediction give the branch an entry in a table with a
+// longer history than the provider, taking one that is not useful.
+// When every candidate is useful they all age instead
+//
+static void tage_allocate(Tage *t, Lookup *l, bool taken)
+{
+  TageHistory *h = t->hist;
+  int start = l->provider + 1;
+  // Occasionally skip a table so that new entries spread out
+  h->seed = h->seed * 1103515245 + 12345;
+  if ((h->seed >> 16) & 1 && start < TAGE_TABLES - 1)
+    start++;
+  for (int i = start; i < TAGE_TABLES; i++)
+  {
+    TageEntry *e = tage_entry(t, i, l->tageIdx[i]);
+    if (e->u == 0)
+    {
+      e->tag = l->tageTag[i];
+      e->ctr = taken ? 0 : -1;
+      return;
+    }
+  }
+  for (int i = start; i < TAGE_TABLES; i++)
+    tage_entry(t, i, l->tageIdx[i])->u--;
+}
+
+void tage_apply(Tage *t, Lookup *l, uint8_t outcome)
+{
+  TageHistory *h = t->hist;
+  bool taken = outcome == TAKEN;
+
+  if (l->prediction != outcome && l->provider < TAGE_TABLES - 1)
+    tage_allocate(t, l, taken);
+
+  if (l->provider >= 0)
+  {
+    TageEntry *e = tage_entry(t, l->provider, l->tageIdx[l->provider]);
+    if (e->u == 0 && (e->ctr == 0 || e->ctr == -1) && l->lpred != l->altpred)
+    {
+      const int32_t max = (1 << (TAGE_USE_ALT_BITS - 1)) - 1;
+      if (l->altpred == outcome && h->useAlt < max)
+        h->useAlt++;
+      else if (l->altpred != outcome && h->useAlt > -max - 1)
+        h->useAlt--;
+    }
+    e->ctr = tage_ctr_update(e->ctr, taken);
+    if (l->lpred != l->altpred)
+    {
+      if (l->lpred == outcome && e->u < (1 << TAGE_U_BITS) - 1)
+        e->u++;
+      else if (l->lpred != outcome && e->u > 0)
+        e->u--;
+    }
+  }
+  else if (taken)
+  {
+    increment(t->base->counter, l->gidx);
+  }
+  else
+  {
+    decrement(t->base->counter, l->gidx);
+  }
+
+  // Usefulness decays over time so that stale entries can be replaced
+  if (++h->tick == (1u << TAGE_TICK_BITS))
+  {
+    h->tick = 0;
+    size_t n = (size_t)TAGE_TABLES << t->tableBits;
+    for (size_t i = 0; i < n; i++)
+      t->entries[i].u >>= 1;
+  }
+
+  tage_add_history(t, l->pc, taken);
+}
+
+// Look up every component the predictor needs for the branch at
+// 'pc', filling 'l' with the prediction and the indices its update
+// will use
+//
+static inline void lookup(predictor_t *p, Lookup *l, uint32_t pc)
+{
+  l->pc = pc;
+  l->valid = true;
+  switch (p->config.bpType)
+  {
+  case STATIC:
+    l->prediction = TAKEN;
+    break;
   case GSHARE:
-    gshare = gshare_init(ghistoryBits);
+    gshare_lookup(p->gshare, pc, l);
+    l->prediction = l->gpred;
     break;
   case TOURNAMENT:
-    choice = choice_init(ghistoryBits, pcIndexBits, lhistoryBits);
+    choice_lookup(p->choice, pc, l);
+    l->component = !l->chooseGlobal;
     break;
   case CUSTOM:
-    pshare = pshare_init(4, 13, 32); //(pcIndexBits,ghistoryBits, phistoryBits)
+    pshare_lookup(p->pshare, pc, l);
+    l->component = !l->chooseGlobal;
+    break;
+  case TAGE:
+    tage_lookup(p->tage, pc, l);
     break;
   default:
+    // If there is not a compatable bpType then return NOTTAKEN
+    l->prediction = NOTTAKEN;
     break;
   }
 }
 
-// Make a prediction for conditional branch instruction at PC 'pc'
-// Returning TAKEN indicates a prediction of taken; returning NOTTAKEN
-// indicates a prediction of not taken
+// Train the predictor with the outcome of the branch 'l' was looked
+// up for
 //
-uint8_t
-make_prediction(uint32_t pc)
+static inline void count_component(predictor_t *p, const Lookup *l, uint8_t outcome)
 {
+  p->components.picks[l->component]++;
+  p->components.mispredictions[l->component] += l->prediction != outcome;
+}
 
-  // Make a prediction based on the bpType
-  switch (bpType)
+static inline void apply(predictor_t *p, Lookup *l, uint8_t outcome)
+{
+  switch (p->config.bpType)
   {
-  case STATIC:
-    return TAKEN;
   case GSHARE:
-    return gshare_predict(gshare, pc);
+    gshare_apply(p->gshare, l, outcome);
+    break;
   case TOURNAMENT:
-    return choice_predict(choice, pc);
+    count_component(p, l, outcome);
+    choice_apply(p->choice, l, outcome);
+    break;
   case CUSTOM:
-    return pshare_predict(pshare, pc);
+    count_component(p, l, outcome);
+    pshare_apply(p->pshare, l, outcome);
+    break;
+  case TAGE:
+    count_component(p, l, outcome);
+    tage_apply(p->tage, l, outcome);
+    break;
   default:
     break;
   }
+}
+
+//------------------------------------//
+//        Specialized Kernels         //
+//------------------------------------//
+// Batch loops with the table sizes fixed at compile time. The masks
+// become constants, the counter words are read straight from the
+// tables and the history registers stay in locals for the whole
+// batch. Each loop makes exactly the predictions and updates of the
+// lookup/apply path above. Sizes missing from the lists below run the
+// same loops with runtime sizes
+
+#define GSHARE_SIZES(X) \
+  X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(20)
 
-  // If there is not a compatable bpType then return NOTTAKEN
-  return NOTTAKEN;
+// ghistoryBits, lhistoryBits, pcIndexBits
+#define TOURNAMENT_SIZES(X) \
+  X(9, 10, 10) X(10, 10, 10) X(11, 11, 10) X(12, 11, 11) X(13, 11, 11)
+
+static inline uint8_t counter_word_get(const uint64_t *words, uint32_t index)
+{
+  return (words[index >> COUNTER_SHIFT] >> counter_offset(index)) & COUNTER_MASK;
 }
 
-// Train the predictor the last executed branch at PC 'pc' and with
-// outcome 'outcome' (true indicates that the branch was taken, false
-// indicates that the branch was not taken)
+// Saturating update of a full-width counter: up when 'up', else down
+static inline void counter_word_update(uint64_t *words, uint32_t index, bool up)
+{
+  uint64_t *w = &words[index >> COUNTER_SHIFT];
+  int off = counter_offset(index);
+  uint64_t val = (*w >> off) & COUNTER_MASK;
+  *w += ((uint64_t)(up && val < COUNTER_MASK) << off) - ((uint64_t)(!up && val != 0) << off);
+}
+
+// Account for a batch of 'n' branches of which 'picks' were predicted
+// by component 0
+static inline void components_add(PredictorComponents *c, uint64_t n, uint64_t mispredictions,
+                                  uint64_t picks, uint64_t picksMissed)
+{
+  c->picks[0] += picks;
+  c->picks[1] += n - picks;
+  c->mispredictions[0] += picksMissed;
+  c->mispredictions[1] += mispredictions - picksMissed;
+}
+
+// Reference loop for every configuration
+static uint64_t predictor_run_generic(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                                      uint8_t *predictions, size_t n)
+{
+  uint64_t mispredictions = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    Lookup l;
+    lookup(p, &l, pc[i]);
+    apply(p, &l, outcome[i]);
+    if (predictions != NULL)
+      predictions[i] = l.prediction;
+    mispredictions += l.prediction != outcome[i];
+  }
+  return mispredictions;
+}
+
+// Branches between prefetching a table line and using it
+#define PREFETCH_DISTANCE 16
+// Tables that fit in L2 gain nothing from prefetching
+#define PREFETCH_MIN_BYTES (1 << 20)
+
+// Shift outcome 'o' into history 'h'
+static inline uint32_t history_push(uint32_t h, uint8_t o, uint32_t mask)
+{
+  return ((h << 1) | (o == 1)) & mask;
+}
+
+// The global history of a branch depends only on the outcomes before
+// it, which the batch already holds, so the loops below track the
+// history PREFETCH_DISTANCE branches ahead and prefetch exactly the
+// lines those branches will use. Tables are still read and updated
+// strictly in trace order
 //
-void train_predictor(uint32_t pc, uint8_t outcome)
+static inline __attribute__((always_inline)) uint64_t
+gshare_loop(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+            uint8_t *predictions, size_t n, const int H)
+{
+  const uint32_t mask = getLowerNBits(~0u, H);
+  const bool prefetch = ((size_t)1 << H) / 4 >= PREFETCH_MIN_BYTES;
+  uint64_t *words = p->gshare->bc->counter->words;
+  uint32_t ghistory = p->gshare->ghistory;
+  uint32_t ahead = ghistory; // history of branch i + PREFETCH_DISTANCE
+  if (prefetch)
+  {
+    for (size_t j = 0; j < n && j < PREFETCH_DISTANCE; j++)
+      ahead = history_push(ahead, outcome[j], mask);
+  }
+
+  uint64_t mispredictions = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (prefetch && i + PREFETCH_DISTANCE < n)
+    {
+      size_t j = i + PREFETCH_DISTANCE;
+      __builtin_prefetch(&words[((pc[j] & mask) ^ ahead) >> COUNTER_SHIFT], 1);
+      ahead = history_push(ahead, outcome[j], mask);
+    }
+    uint32_t idx = (pc[i] & mask) ^ ghistory;
+    uint8_t pred = counter_word_get(words, idx) >= 2;
+    counter_word_update(words, idx, outcome[i] != 0);
+    ghistory = history_push(ghistory, outcome[i], mask);
+    if (predictions != NULL)
+      predictions[i] = pred;
+    mispredictions += pred != outcome[i];
+  }
+  p->gshare->ghistory = ghistory;
+  return mispredictions;
+}
+
+static inline __attribute__((always_inline)) uint64_t
+tournament_loop(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                uint8_t *predictions, size_t n, const int G, const int L, const int P)
 {
-  switch (bpType)
+  const uint32_t gmask = getLowerNBits(~0u, G);
+  const uint32_t lmask = getLowerNBits(~0u, L);
+  const uint32_t pmask = getLowerNBits(~0u, P);
+  const bool prefetch = ((size_t)1 << G) / 2 + ((size_t)1 << L) / 4 +
+                            ((size_t)sizeof(int) << P) >= PREFETCH_MIN_BYTES;
+  Choice *cp = p->choice;
+  uint64_t *choice_words = cp->choice_bc->counter->words;
+  uint64_t *global_words = cp->global_bc->counter->words;
+  uint64_t *local_words = cp->lhist->bc->counter->words;
+  int *hist_table = cp->lhist->hist_table;
+  uint32_t ghistory = cp->ghistory;
+  uint32_t ahead = ghistory; // history of branch i + PREFETCH_DISTANCE
+  if (prefetch)
+  {
+    for (size_t j = 0; j < n && j < PREFETCH_DISTANCE; j++)
+      ahead = history_push(ahead, outcome[j], gmask);
+  }
+
+  uint64_t mispredictions = 0;
+  uint64_t globalPicks = 0, globalMisses = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (prefetch && i + PREFETCH_DISTANCE < n)
+    {
+      size_t j = i + PREFETCH_DISTANCE;
+      __builtin_prefetch(&hist_table[pc[j] & pmask], 1);
+      __builtin_prefetch(&global_words[ahead >> COUNTER_SHIFT], 1);
+      __builtin_prefetch(&choice_words[ahead >> COUNTER_SHIFT], 1);
+      ahead = history_push(ahead, outcome[j], gmask);
+      // The local counter index is only known once the history entry
+      // is loaded, so use the entry prefetched half the distance ago.
+      // A branch to the same entry in between can still change it
+      uint32_t k = pc[i + PREFETCH_DISTANCE / 2] & pmask;
+      __builtin_prefetch(&local_words[(uint32_t)hist_table[k] >> COUNTER_SHIFT], 1);
+    }
+    uint8_t o = outcome[i];
+    uint32_t tidx = pc[i] & pmask;
+    uint32_t cidx = hist_table[tidx];
+    uint8_t gpred = counter_word_get(global_words, ghistory) >= 2;
+    uint8_t lpred = counter_word_get(local_words, cidx) >= 2;
+    bool chooseGlobal = counter_word_get(choice_words, ghistory) >= 2;
+    uint8_t pred = chooseGlobal ? gpred : lpred;
+    if ((gpred == o) != (lpred == o))
+      counter_word_update(choice_words, ghistory, gpred == o);
+    counter_word_update(local_words, cidx, o == 1);
+    hist_table[tidx] = history_push(cidx, o, lmask);
+    counter_word_update(global_words, ghistory, o != 0);
+    ghistory = history_push(ghistory, o, gmask);
+    if (predictions != NULL)
+      predictions[i] = pred;
+    mispredictions += pred != o;
+    globalPicks += chooseGlobal;
+    globalMisses += chooseGlobal & (pred != o);
+  }
+  cp->ghistory = ghistory;
+  components_add(&p->components, n, mispredictions, globalPicks, globalMisses);
+  return mispredictions;
+}
+
+#define GSHARE_KERNEL(H)                                                                     \
+  static uint64_t gshare_run_##H(predictor_t *p, const uint32_t *pc, const uint8_t *outcome, \
+                                 uint8_t *predictions, size_t n)                             \
+  {                                                                                          \
+    return gshare_loop(p, pc, outcome, predictions, n, H);                                   \
+  }
+GSHARE_SIZES(GSHARE_KERNEL)
+
+#define TOURNAMENT_KERNEL(G, L, P)                                                  \
+  static uint64_t tournament_run_##G##_##L##_##P(predictor_t *p, const uint32_t *pc, \
+                                                 const uint8_t *outcome,            \
+                                                 uint8_t *predictions, size_t n)    \
+  {                                                                                 \
+    return tournament_loop(p, pc, outcome, predictions, n, G, L, P);                \
+  }
+TOURNAMENT_SIZES(TOURNAMENT_KERNEL)
+
+// The same loops with the sizes read at run time
+static uint64_t gshare_run_any(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                               uint8_t *predictions, size_t n)
+{
+  return gshare_loop(p, pc, outcome, predictions, n, p->config.ghistoryBits);
+}
+
+static uint64_t tournament_run_any(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                                   uint8_t *predictions, size_t n)
+{
+  PredictorConfig *c = &p->config;
+  return tournament_loop(p, pc, outcome, predictions, n, c->ghistoryBits, c->lhistoryBits,
+                         c->pcIndexBits);
+}
+
+// The custom predictor has a single size
+static uint64_t custom_run(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                           uint8_t *predictions, size_t n)
+{
+  const uint32_t gmask = (1u << CUSTOM_GHIST_BITS) - 1;
+  const uint32_t rows = 1u << CUSTOM_PC_BITS;
+  const uint64_t pmask = CUSTOM_PHIST_BITS >= 64 ? ~0ULL : (1ULL << CUSTOM_PHIST_BITS) - 1;
+  PShare *ps = p->pshare;
+  PerceptronTable *pt = ps->ptable;
+  uint64_t *choice_words = ps->bc->counter->words;
+  uint64_t *gshare_words = ps->gshare->bc->counter->words;
+  int16_t *weights = pt->weights;
+  int16_t *bias = pt->bias;
+  const int stride = pt->stride;
+  PerceptronDot dot = perceptron_dot;
+  PerceptronTrain train = perceptron_train_kernel;
+  uint32_t ghistory = ps->ghistory;
+  uint32_t gshare_history = ps->gshare->ghistory;
+  uint64_t phistory = pt->ghistory;
+  uint64_t mispredictions = 0;
+  uint64_t gsharePicks = 0, gshareMisses = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    uint8_t o = outcome[i];
+    uint32_t gidx = (pc[i] & gmask) ^ gshare_history;
+    uint32_t row = ((uint64_t)pc[i]) * (pc[i] + 7) % rows;
+    int16_t *w = weights + (size_t)row * stride;
+    int32_t y = dot(w, bias[row], phistory, CUSTOM_PHIST_BITS);
+    uint8_t gpred = counter_word_get(gshare_words, gidx) >= 2;
+    uint8_t ppred = y >= 0;
+    bool chooseGshare = counter_word_get(choice_words, ghistory) >= 2;
+    uint8_t pred = chooseGshare ? gpred : ppred;
+
+    if ((gpred == o) != (ppred == o))
+      counter_word_update(choice_words, ghistory, gpred == o);
+    int8_t br_outcome = o == 1 ? 1 : -1;
+    if (getSign(y) != br_outcome || abs(y) <= perceptron_threshold)
+    {
+      bias[row] += getSign(y);
+      train(w, phistory, CUSTOM_PHIST_BITS, getSign(y));
+    }
+    phistory = ((phistory << 1) | (o == 1)) & pmask;
+    counter_word_update(gshare_words, gidx, o != 0);
+    gshare_history = ((gshare_history << 1) | (o == 1)) & gmask;
+    ghistory = ((ghistory << 1) | (o == 1)) & gmask;
+
+    if (predictions != NULL)
+      predictions[i] = pred;
+    mispredictions += pred != o;
+    gsharePicks += chooseGshare;
+    gshareMisses += chooseGshare & (pred != o);
+  }
+  components_add(&p->components, n, mispredictions, gsharePicks, gshareMisses);
+  ps->ghistory = ghistory;
+  ps->gshare->ghistory = gshare_history;
+  pt->ghistory = phistory;
+  return mispredictions;
+}
+
+// Pick the batch loop for configuration 'c'
+//
+static PredictorKernel predictor_select_kernel(const PredictorConfig *c)
+{
+#define GSHARE_MATCH(H)         \
+  if (c->ghistoryBits == H)     \
+    return gshare_run_##H;
+#define TOURNAMENT_MATCH(G, L, P)                                                     \
+  if (c->ghistoryBits == G && c->lhistoryBits == L && c->pcIndexBits == P)            \
+    return tournament_run_##G##_##L##_##P;
+
+  switch (c->bpType)
+  {
+  case GSHARE:
+    GSHARE_SIZES(GSHARE_MATCH)
+    return gshare_run_any;
+  case TOURNAMENT:
+    TOURNAMENT_SIZES(TOURNAMENT_MATCH)
+    return tournament_run_any;
+  case CUSTOM:
+    return custom_run;
+  default:
+    break;
+  }
+  return predictor_run_generic;
+#undef GSHARE_MATCH
+#undef TOURNAMENT_MATCH
+}
+
+// Allocate the tables for the configuration of 'p'
+//
+static void predictor_tables_init(predictor_t *p)
+{
+  PredictorConfig *c = &p->config;
+  switch (c->bpType)
+  {
+  case GSHARE:
+    p->gshare = gshare_init(c->ghistoryBits);
+    break;
+  case TOURNAMENT:
+    p->choice = choice_init(c->ghistoryBits, c->pcIndexBits, c->lhistoryBits);
+    break;
+  case CUSTOM:
+    p->pshare = pshare_init(CUSTOM_PC_BITS, CUSTOM_GHIST_BITS, CUSTOM_PHIST_BITS);
+    break;
+  case TAGE:
+    p->tage = tage_init(c->ghistoryBits);
+    break;
+  default:
+    break;
+  }
+  p->pending.valid = false;
+  p->run = predictor_select_kernel(c);
+}
+
+static void predictor_tables_free(predictor_t *p)
+{
+  if (p->gshare != NULL)
+    gshare_destroy(p->gshare);
+  if (p->choice != NULL)
+    choice_destroy(p->choice);
+  if (p->pshare != NULL)
+    pshare_destroy(p->pshare);
+  if (p->tage != NULL)
+    tage_destroy(p->tage);
+  p->gshare = NULL;
+  p->choice = NULL;
+  p->pshare = NULL;
+  p->tage = NULL;
+}
+
+//------------------------------------//
+//         Storage Accounting         //
+//------------------------------------//
+
+// Bits of a table of 2^bits entries of 'width' bits each
+static uint64_t table_bits(int bits, int width)
+{
+  return ((uint64_t)1 << bits) * width;
+}
+
+int predictor_config_valid(const PredictorConfig *c)
+{
+#define BITS_OK(b) ((b) >= 1 && (b) <= PREDICTOR_MAX_BITS)
+  switch (c->bpType)
   {
   case STATIC:
+  case CUSTOM:
+    return 1;
+  case GSHARE:
+    return BITS_OK(c->ghistoryBits);
+  case TOURNAMENT:
+    return BITS_OK(c->ghistoryBits) && BITS_OK(c->lhistoryBits) && BITS_OK(c->pcIndexBits);
+  case TAGE:
+    return c->ghistoryBits >= PREDICTOR_MIN_TAGE_KBITS && c->ghistoryBits <= PREDICTOR_MAX_TAGE_KBITS;
+  default:
+    return 0;
+  }
+#undef BITS_OK
+}
+
+uint64_t predictor_storage_bits(const PredictorConfig *c)
+{
+  switch (c->bpType)
+  {
+  case GSHARE:
+    // counters and the history register
+    return table_bits(c->ghistoryBits, COUNTER_BITS) + c->ghistoryBits;
+  case TOURNAMENT:
+    // choice and global counters, the global history register, the
+    // local history table and local counters
+    return 2 * table_bits(c->ghistoryBits, COUNTER_BITS) + c->ghistoryBits +
+           table_bits(c->pcIndexBits, c->lhistoryBits) +
+           table_bits(c->lhistoryBits, COUNTER_BITS);
+  case CUSTOM:
+    // chooser and gshare counters with a history register each, and
+    // the perceptron weights, biases and history register
+    return 2 * (table_bits(CUSTOM_GHIST_BITS, COUNTER_BITS) + CUSTOM_GHIST_BITS) +
+           table_bits(CUSTOM_PC_BITS, (CUSTOM_PHIST_BITS + 1) * 8 * sizeof(int16_t)) + CUSTOM_PHIST_BITS;
+  case TAGE:
+    return tage_storage_bits(tage_table_bits(c->ghistoryBits));
+  default:
+    return 0;
+  }
+}
+
+int predictor_config_capped(const PredictorConfig *c)
+{
+  return c->bpType == TAGE && tage_table_bits(c->ghistoryBits) == TAGE_MAX_TABLE_BITS &&
+         tage_storage_bits(TAGE_MAX_TABLE_BITS + 1) <= (uint64_t)c->ghistoryBits * 1024;
+}
+
+//------------------------------------//
+//        Predictor Instances         //
+//------------------------------------//
+
+predictor_t *predictor_create(const PredictorConfig *c)
+{
+  predictor_t *p = (predictor_t *)calloc(1, sizeof(predictor_t));
+  checkMem(p);
+  p->config = *c;
+  predictor_tables_init(p);
+  return p;
+}
+
+void predictor_destroy(predictor_t *p)
+{
+  if (p == NULL)
     return;
+  predictor_tables_free(p);
+  free(p);
+}
+
+void predictor_reset(predictor_t *p)
+{
+  predictor_tables_free(p);
+  predictor_tables_init(p);
+  memset(&p->components, 0, sizeof(p->components));
+}
+
+const PredictorConfig *predictor_config(const predictor_t *p)
+{
+  return &p->config;
+}
+
+void predictor_components(const predictor_t *p, PredictorComponents *c)
+{
+  *c = p->components;
+}
+
+const char *predictor_component_name(const PredictorConfig *c, int component)
+{
+  static const char *names[][2] = {
+      [TOURNAMENT] = {"global", "local"},
+      [CUSTOM] = {"gshare", "perceptron"},
+      [TAGE] = {"tagged", "base"},
+  };
+  if (c->bpType < 0 || c->bpType > TAGE || names[c->bpType][0] == NULL)
+    return NULL;
+  return names[c->bpType][component];
+}
+
+uint8_t predictor_predict(predictor_t *p, uint32_t pc)
+{
+  lookup(p, &p->pending, pc);
+  return p->pending.prediction;
+}
+
+void predictor_update(predictor_t *p, uint32_t pc, uint8_t outcome)
+{
+  // Reuse the lookup from predictor_predict when it was for this branch
+  if (!p->pending.valid || p->pending.pc != pc)
+  {
+    lookup(p, &p->pending, pc);
+  }
+  apply(p, &p->pending, outcome);
+  p->pending.valid = false;
+}
+
+uint8_t predictor_predict_and_update(predictor_t *p, uint32_t pc, uint8_t outcome)
+{
+  Lookup l;
+  lookup(p, &l, pc);
+  apply(p, &l, outcome);
+  return l.prediction;
+}
+
+uint64_t predictor_run(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                       uint8_t *predictions, size_t n)
+{
+  return p->run(p, pc, outcome, predictions, n);
+}
+
+void predictor_advance(predictor_t *p, const uint32_t *pc, const uint8_t *outcome, size_t n)
+{
+  // Global registers hold at most 64 outcomes, so only the end of the
+  // region can reach them. Local histories need every branch
+  size_t tail = n > 64 ? n - 64 : 0;
+  switch (p->config.bpType)
+  {
   case GSHARE:
-    gshare_update(gshare, pc, outcome);
+    for (size_t i = tail; i < n; i++)
+      gshare_add_history(p->gshare, outcome[i] == 1);
     break;
   case TOURNAMENT:
-    choice_update(choice, pc, outcome);
+    for (size_t i = 0; i < n; i++)
+    {
+      Lhist *lh = p->choice->lhist;
+      lhist_add_history(lh, lhist_get_hist_index(lh, pc[i]), outcome[i] == 1);
+    }
+    for (size_t i = tail; i < n; i++)
+      choice_add_history(p->choice, outcome[i] == 1);
     break;
   case CUSTOM:
-    pshare_update(pshare, pc, outcome);
+    for (size_t i = tail; i < n; i++)
+    {
+      pshare_add_history(p->pshare, outcome[i] == 1);
+      gshare_add_history(p->pshare->gshare, outcome[i] == 1);
+      perceptronTable_addHistory(p->pshare->ptable, outcome[i] == 1);
+    }
+    break;
+  case TAGE:
+    // Every register depends only on the last TAGE_HIST_BUFFER outcomes
+    for (size_t i = n > TAGE_HIST_BUFFER ? n - TAGE_HIST_BUFFER : 0; i < n; i++)
+      tage_add_history(p->tage, pc[i], outcome[i] == 1);
     break;
   default:
     break;
   }
+  p->pending.valid = false;
+}
+
+//------------------------------------//
+//             Snapshots              //
+//------------------------------------//
+
+// A table of a predictor as it is laid out in a snapshot
+struct StateSection
+{
+  void *data;
+  uint64_t bytes;
+};
+typedef struct StateSection StateSection;
+
+#define STATE_MAX_SECTIONS 4
+#define STATE_ALIGN 64
+
+static uint64_t counter_bytes(Counter *c)
+{
+  return (uint64_t)((c->table_size + (1 << COUNTER_SHIFT) - 1) >> COUNTER_SHIFT) * sizeof(uint64_t);
+}
+
+// List the tables of 'p' in snapshot order
+//
+// Returns the number of sections
+//
+static int predictor_sections(predictor_t *p, StateSection *sec)
+{
+  switch (p->config.bpType)
+  {
+  case GSHARE:
+    sec[0].data = p->gshare->bc->counter->words;
+    sec[0].bytes = counter_bytes(p->gshare->bc->counter);
+    return 1;
+  case TOURNAMENT:
+    sec[0].data = p->choice->choice_bc->counter->words;
+    sec[0].bytes = counter_bytes(p->choice->choice_bc->counter);
+    sec[1].data = p->choice->global_bc->counter->words;
+    sec[1].bytes = counter_bytes(p->choice->global_bc->counter);
+    sec[2].data = p->choice->lhist->hist_table;
+    sec[2].bytes = (uint64_t)getTableSize(p->choice->lhist->pc_bits) * sizeof(int);
+    sec[3].data = p->choice->lhist->bc->counter->words;
+    sec[3].bytes = counter_bytes(p->choice->lhist->bc->counter);
+    return 4;
+  case CUSTOM:
+    sec[0].data = p->pshare->bc->counter->words;
+    sec[0].bytes = counter_bytes(p->pshare->bc->counter);
+    sec[1].data = p->pshare->gshare->bc->counter->words;
+    sec[1].bytes = counter_bytes(p->pshare->gshare->bc->counter);
+    sec[2].data = p->pshare->ptable->bias;
+    sec[2].bytes = (uint64_t)p->pshare->ptable->table_size * sizeof(int16_t);
+    sec[3].data = p->pshare->ptable->weights;
+    sec[3].bytes = (uint64_t)p->pshare->ptable->table_size * p->pshare->ptable->stride * sizeof(int16_t);
+    return 4;
+  case TAGE:
+    sec[0].data = p->tage->base->counter->words;
+    sec[0].bytes = counter_bytes(p->tage->base->counter);
+    sec[1].data = p->tage->entries;
+    sec[1].bytes = ((uint64_t)TAGE_TABLES << p->tage->tableBits) * sizeof(TageEntry);
+    sec[2].data = p->tage->hist;
+    sec[2].bytes = sizeof(TageHistory);
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+// Copy the history registers of 'p' to or from 'hist'. Loaded
+// registers are masked to their width, as they index the tables
+static void predictor_registers(predictor_t *p, uint64_t *hist, bool store)
+{
+  uint32_t *r32[2] = {NULL, NULL};
+  uint32_t mask32[2] = {0, 0};
+  uint64_t *r64 = NULL;
+  uint64_t mask64 = 0;
+  switch (p->config.bpType)
+  {
+  case GSHARE:
+    r32[0] = &p->gshare->ghistory;
+    mask32[0] = p->gshare->ghistoryMask;
+    break;
+  case TOURNAMENT:
+    r32[0] = &p->choice->ghistory;
+    mask32[0] = p->choice->ghistoryMask;
+    break;
+  case CUSTOM:
+    r32[0] = &p->pshare->ghistory;
+    mask32[0] = p->pshare->ghistoryMask;
+    r32[1] = &p->pshare->gshare->ghistory;
+    mask32[1] = p->pshare->gshare->ghistoryMask;
+    r64 = &p->pshare->ptable->ghistory;
+    mask64 = p->pshare->ptable->ghistoryMask;
+    break;
+  default:
+    break;
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    if (r32[i] != NULL && store)
+      hist[i] = *r32[i];
+    else if (r32[i] != NULL)
+      *r32[i] = (uint32_t)hist[i] & mask32[i];
+  }
+  if (r64 != NULL && store)
+    hist[2] = *r64;
+  else if (r64 != NULL)
+    *r64 = hist[2] & mask64;
+}
+
+int predictor_save(predictor_t *p, const char *path, uint64_t position)
+{
+  StateSection sec[STATE_MAX_SECTIONS];
+  PredictorStateHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, PREDICTOR_STATE_MAGIC, sizeof(h.magic));
+  h.version = PREDICTOR_STATE_VERSION;
+  h.sections = predictor_sections(p, sec);
+  h.bpType = p->config.bpType;
+  h.ghistoryBits = p->config.ghistoryBits;
+  h.lhistoryBits = p->config.lhistoryBits;
+  h.pcIndexBits = p->config.pcIndexBits;
+  h.position = position;
+  predictor_registers(p, h.history, true);
+
+  // Section table, then every section on its own aligned offset
+  PredictorStateSection table[STATE_MAX_SECTIONS];
+  uint64_t offset = sizeof(h) + h.sections * sizeof(PredictorStateSection);
+  for (uint32_t i = 0; i < h.sections; i++)
+  {
+    offset = (offset + STATE_ALIGN - 1) / STATE_ALIGN * STATE_ALIGN;
+    table[i].offset = offset;
+    table[i].bytes = sec[i].bytes;
+    offset += sec[i].bytes;
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return 0;
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+           fwrite(table, sizeof(PredictorStateSection), h.sections, f) == h.sections;
+  static const char zeros[STATE_ALIGN];
+  for (uint32_t i = 0; ok && i < h.sections; i++)
+  {
+    long pad = (long)table[i].offset - ftell(f);
+    ok = fwrite(zeros, 1, pad, f) == (size_t)pad &&
+         fwrite(sec[i].data, 1, sec[i].bytes, f) == sec[i].bytes;
+  }
+  return fclose(f) == 0 && ok;
+}
+
+// Build a predictor from the snapshot mapped at 'map'
+static predictor_t *predictor_from_state(const char *map, uint64_t size, uint64_t *position)
+{
+  const PredictorStateHeader *h = (const PredictorStateHeader *)map;
+  const PredictorStateSection *table = (const PredictorStateSection *)(h + 1);
+  if (memcmp(h->magic, PREDICTOR_STATE_MAGIC, sizeof(h->magic)) ||
+      h->version != PREDICTOR_STATE_VERSION || h->sections > STATE_MAX_SECTIONS ||
+      sizeof(*h) + h->sections * sizeof(PredictorStateSection) > size)
+    return NULL;
+
+  // Check the sizes before they are used to allocate the tables
+  PredictorConfig c = {h->bpType, h->ghistoryBits, h->lhistoryBits, h->pcIndexBits};
+  if (!predictor_config_valid(&c))
+    return NULL;
+  predictor_t *p = predictor_create(&c);
+  StateSection sec[STATE_MAX_SECTIONS];
+  uint32_t n = predictor_sections(p, sec);
+  bool ok = n == h->sections;
+  for (uint32_t i = 0; ok && i < n; i++)
+  {
+    ok = table[i].bytes == sec[i].bytes && table[i].offset <= size &&
+         table[i].bytes <= size - table[i].offset;
+  }
+  if (!ok)
+  {
+    predictor_destroy(p);
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < n; i++)
+    memcpy(sec[i].data, map + table[i].offset, sec[i].bytes);
+  if (c.bpType == TOURNAMENT)
+  {
+    // Local histories index the counters, so keep them in range
+    Lhist *lh = p->choice->lhist;
+    for (int i = 0; i < getTableSize(lh->pc_bits); i++)
+      lh->hist_table[i] = getLowerNBits(lh->hist_table[i], lh->hist_bits);
+  }
+  uint64_t hist[3];
+  memcpy(hist, h->history, sizeof(hist));
+  predictor_registers(p, hist, false);
+  if (position != NULL)
+    *position = h->position;
+  return p;
+}
+
+predictor_t *predictor_load(const char *path, uint64_t *position)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(PredictorStateHeader))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  predictor_t *p = predictor_from_state((const char *)map, st.st_size, position);
+  munmap(map, st.st_size);
+  return p;
+}
+
+//------------------------------------//
+//     Default Instance Interface     //
+//------------------------------------//
+
+// Initialize the predictor
+//
+void init_predictor()
+{
+  PredictorConfig c = {bpType, ghistoryBits, lhistoryBits, pcIndexBits};
+  predictor_destroy(defaultPredictor);
+  defaultPredictor = predictor_create(&c);
+}
+
+// Release the tables allocated by init_predictor so that it can be
+// called again with a different configuration
+//
+void free_predictor()
+{
+  predictor_destroy(defaultPredictor);
+  defaultPredictor = NULL;
+}
+
+// Make a prediction for conditional branch instruction at PC 'pc'
+// Returning TAKEN indicates a prediction of taken; returning NOTTAKEN
+// indicates a prediction of not taken
+//
+uint8_t
+make_prediction(uint32_t pc)
+{
+  return predictor_predict(defaultPredictor, pc);
+}
+
+// Train the predictor the last executed branch at PC 'pc' and with
+// outcome 'outcome' (true indicates that the branch was taken, false
+// indicates that the branch was not taken)
+//
+void train_predictor(uint32_t pc, uint8_t outcome)
+{
+  predictor_update(defaultPredictor, pc, outcome);
+}
+
+// Predict the branch at 'pc' and train with its outcome in one step
+//
+uint8_t predict_and_update(uint32_t pc, uint8_t outcome)
+{
+  return predictor_predict_and_update(defaultPredictor, pc, outcome);
+}
+
+// Save or replace the default predictor, see predictor_save and
+// predictor_load. Loading also sets the configuration globals
+//
+int save_predictor(const char *path, uint64_t position)
+{
+  return predictor_save(defaultPredictor, path, position);
+}
+
+int load_predictor(const char *path, uint64_t *position)
+{
+  predictor_t *p = predictor_load(path, position);
+  if (p == NULL)
+    return 0;
+  predictor_destroy(defaultPredictor);
+  defaultPredictor = p;
+  bpType = p->config.bpType;
+  ghistoryBits = p->config.ghistoryBits;
+  lhistoryBits = p->config.lhistoryBits;
+  pcIndexBits = p->config.pcIndexBits;
+  return 1;
+}
+
+// The instance behind this interface, for code that mixes it with
+// the instance functions
+//
+predictor_t *default_predictor()
+{
+  return defaultPredictor;
+}
+
+// Predict and train 'n' consecutive branches
+//
+uint64_t run_predictor(const uint32_t *pc, const uint8_t *outcome, uint8_t *predictions, size_t n)
+{
+  return predictor_run(defaultPredictor, pc, outcome, predictions, n);
 }
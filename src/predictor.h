@@ -30,6 +30,7 @@ extern const char *email;
 #define GSHARE      1
 #define TOURNAMENT  2
 #define CUSTOM      3
+#define TAGE        4
 extern const char *bpName[];
 
 // Definitions for 2-bit counters
@@ -41,20 +42,195 @@ extern const char *bpName[];
 //------------------------------------//
 //      Predictor Configuration       //
 //------------------------------------//
+// Configuration of the default predictor, read by init_predictor
 extern int ghistoryBits; // Number of bits used for Global History
 extern int lhistoryBits; // Number of bits used for Local History
 extern int pcIndexBits;  // Number of bits used for PC index
 extern int bpType;       // Branch Prediction Type
 extern int verbose;
 
+// A complete predictor configuration, used to describe the runs
+// of a sweep. TAGE is sized by its storage budget in Kbits, which
+// it keeps in ghistoryBits
+struct PredictorConfig
+{
+  int bpType;
+  int ghistoryBits;
+  int lhistoryBits;
+  int pcIndexBits;
+};
+typedef struct PredictorConfig PredictorConfig;
+
+// Limits on the fields of a configuration. Wider tables would need
+// gigabytes, and history and index widths past them shift out of
+// range
+#define PREDICTOR_MAX_BITS 26
+#define PREDICTOR_MAX_TAGE_KBITS (1 << 20)
+// The storage of TAGE's smallest tables, rounded up to a Kbit
+#define PREDICTOR_MIN_TAGE_KBITS 9
+
+// Check that the fields 'c' uses are within the limits above
+//
+// Returns True if 'c' can be built
+//
+int predictor_config_valid(const PredictorConfig *c);
+
+// Exact storage of the predictor described by 'c' in bits, counting
+// every counter, history table, perceptron weight and bias and
+// history register it keeps
+//
+uint64_t predictor_storage_bits(const PredictorConfig *c);
+
+// Check whether the budget of 'c' would fit tables larger than the
+// largest it builds, leaving the rest of the budget unused
+//
+// Returns True if the tables are capped
+//
+int predictor_config_capped(const PredictorConfig *c);
+
+//------------------------------------//
+//        Predictor Instances         //
+//------------------------------------//
+// Each instance owns its configuration and tables, so any number of
+// them can run in one process, one per thread or interleaved on the
+// same thread
+
+typedef struct predictor predictor_t;
+
+// Build a predictor for configuration 'c', initialized the same way
+// as init_predictor
+//
+predictor_t *predictor_create(const PredictorConfig *c);
+
+void predictor_destroy(predictor_t *p);
+
+// Return 'p' to its freshly created state
+//
+void predictor_reset(predictor_t *p);
+
+const PredictorConfig *predictor_config(const predictor_t *p);
+
+// Which of its two components supplied each prediction of a
+// predictor that chooses between two, since it was created or
+// reset: the global (0) or local (1) predictor of tournament, the
+// gshare or perceptron side of custom, and a tagged table or the base
+// table of TAGE. Other types count nothing
+//
+struct PredictorComponents
+{
+  uint64_t picks[2];
+  uint64_t mispredictions[2];
+};
+typedef struct PredictorComponents PredictorComponents;
+
+void predictor_components(const predictor_t *p, PredictorComponents *c);
+
+// Name of component 0 or 1 of configuration 'c', NULL for types
+// with a single component
+//
+const char *predictor_component_name(const PredictorConfig *c, int component);
+
+// Instance counterparts of make_prediction, train_predictor and
+// predict_and_update below
+//
+uint8_t predictor_predict(predictor_t *p, uint32_t pc);
+void predictor_update(predictor_t *p, uint32_t pc, uint8_t outcome);
+uint8_t predictor_predict_and_update(predictor_t *p, uint32_t pc, uint8_t outcome);
+
+// Predict and train the 'n' consecutive branches in 'pc' and
+// 'outcome', storing each prediction in 'predictions' unless it is
+// NULL. Common table sizes run a loop specialized for them
+//
+// Returns the number of mispredictions
+//
+uint64_t predictor_run(predictor_t *p, const uint32_t *pc, const uint8_t *outcome,
+                       uint8_t *predictions, size_t n);
+
+// Shift the outcomes of 'n' branches into the global and local
+// history registers without training or reading any table, for
+// fast-forwarding through a trace
+//
+void predictor_advance(predictor_t *p, const uint32_t *pc, const uint8_t *outcome, size_t n);
+
+//------------------------------------//
+//             Snapshots              //
+//------------------------------------//
+//
+// A snapshot holds every table and history register of a predictor.
+// All fields are little-endian.
+//
+//   offset 0   char     magic[8]     "BPSTATE\0"
+//   offset 8   uint32_t version      PREDICTOR_STATE_VERSION
+//   offset 12  uint32_t sections     number of tables
+//   offset 16  int32_t  bpType, ghistoryBits, lhistoryBits, pcIndexBits
+//   offset 32  uint64_t position     branches simulated before the snapshot
+//   offset 40  uint64_t history[3]   history registers
+//   offset 64  PredictorStateSection section[sections]
+//
+// Each table starts on a 64-byte boundary and is stored exactly as it
+// is in memory, so a snapshot can be mapped and copied in directly.
+// The tables, in order, are
+//
+//   gshare      counters
+//   tournament  choice counters, global counters, local history
+//               table, local counters
+//   custom      choice counters, gshare counters, perceptron biases,
+//               perceptron weights
+//   tage        base counters, tagged tables, history registers
+//
+#define PREDICTOR_STATE_MAGIC   "BPSTATE"
+#define PREDICTOR_STATE_VERSION 1
+
+struct PredictorStateHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t sections;
+  int32_t bpType;
+  int32_t ghistoryBits;
+  int32_t lhistoryBits;
+  int32_t pcIndexBits;
+  uint64_t position;
+  uint64_t history[3];
+};
+typedef struct PredictorStateHeader PredictorStateHeader;
+
+struct PredictorStateSection
+{
+  uint64_t offset; // from the start of the file
+  uint64_t bytes;
+};
+typedef struct PredictorStateSection PredictorStateSection;
+
+// Write a snapshot of 'p' to 'path', recording that 'position'
+// branches had been simulated
+//
+// Returns True if Successful
+//
+int predictor_save(predictor_t *p, const char *path, uint64_t position);
+
+// Create a predictor from the snapshot at 'path' and store the
+// branch position it was taken at in '*position' unless it is NULL
+//
+// Returns NULL if the file cannot be read or is not a valid snapshot
+//
+predictor_t *predictor_load(const char *path, uint64_t *position);
+
 //------------------------------------//
 //    Predictor Function Prototypes   //
 //------------------------------------//
+// These drive a single default instance configured from the globals
+// above
 
 // Initialize the predictor
 //
 void init_predictor();
 
+// Release the tables of the current predictor. init_predictor may
+// be called again afterwards
+//
+void free_predictor();
+
 // Make a prediction for conditional branch instruction at PC 'pc'
 // Returning TAKEN indicates a prediction of taken; returning NOTTAKEN
 // indicates a prediction of not taken
@@ -67,4 +243,26 @@ uint8_t make_prediction(uint32_t pc);
 //
 void train_predictor(uint32_t pc, uint8_t outcome);
 
+// Predict the branch at PC 'pc' and train with 'outcome' in one call,
+// sharing the table lookups between the two. Returns the prediction
+// make_prediction would have made
+//
+uint8_t predict_and_update(uint32_t pc, uint8_t outcome);
+
+// Snapshot the default predictor, or replace it and its configuration
+// globals with a snapshot, see predictor_save and predictor_load
+//
+// Returns True if Successful
+//
+int save_predictor(const char *path, uint64_t position);
+int load_predictor(const char *path, uint64_t *position);
+
+// The instance driven by the functions above
+//
+predictor_t *default_predictor();
+
+// Predict and train 'n' consecutive branches, see predictor_run
+//
+uint64_t run_predictor(const uint32_t *pc, const uint8_t *outcome, uint8_t *predictions, size_t n);
+
 #endif
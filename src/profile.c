@@ -0,0 +1,307 @@
+//========================================================//
+//  profile.c                                             //
+//  Source file for the per-branch misprediction profile  //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <string.h>
+#include "profile.h"
+
+// Slots in a new table. The table doubles whenever it is half full,
+// so probe sequences stay short even with millions of branches
+#define PROFILE_INITIAL_BITS 10
+
+// Recent counts are packed into one word so that a branch costs a
+// single add: executions, taken and mispredictions in consecutive
+// PROFILE_FIELD_BITS bit fields. They are folded into the 64-bit
+// totals before any field can overflow
+#define PROFILE_FIELD_BITS 21
+#define PROFILE_FIELD_MAX ((1u << PROFILE_FIELD_BITS) - 1)
+#define PROFILE_TAKEN (1ULL << PROFILE_FIELD_BITS)
+#define PROFILE_MISS (1ULL << (2 * PROFILE_FIELD_BITS))
+
+// Entries in the direct-mapped front cache. Hashing scatters even a
+// small loop over the whole table, which outgrows L1 once a trace has
+// a thousand branches; the front cache is indexed by the low PC bits
+// instead, so a loop's branches share a few lines, and only conflicts
+// reach the table
+#define PROFILE_FRONT_BITS 10
+#define PROFILE_FRONT_SIZE (1u << PROFILE_FRONT_BITS)
+
+// The probed part of an entry, kept apart from the totals so that the
+// table the hot loop walks stays small
+struct ProfileSlot
+{
+  uint32_t pc;
+  uint32_t used;
+  uint64_t recent;
+};
+typedef struct ProfileSlot ProfileSlot;
+
+// A branch's recent counts while it is cached in front of its slot
+struct ProfileFront
+{
+  uint32_t pc;
+  uint32_t slot;
+  uint64_t recent;
+};
+typedef struct ProfileFront ProfileFront;
+
+struct Profile
+{
+  ProfileSlot *slots;
+  ProfileEntry *totals; // parallel to 'slots'
+  int bits;             // log2 of the number of slots
+  size_t used;          // occupied slots
+  uint32_t pending;     // branches counted in 'recent' fields
+  uint64_t branches;
+  uint64_t mispredictions;
+  ProfileFront front[PROFILE_FRONT_SIZE];
+};
+
+static inline uint32_t
+profile_hash(uint32_t pc, int bits)
+{
+  // Fibonacci hashing spreads the low-entropy, aligned PCs over the
+  // top bits of the product
+  return (uint32_t)(pc * 2654435769u) >> (32 - bits);
+}
+
+// Find the slot of 'pc' or the empty slot where it belongs
+static inline uint32_t
+profile_find(const ProfileSlot *slots, int bits, uint32_t pc)
+{
+  uint32_t mask = (1u << bits) - 1;
+  uint32_t i = profile_hash(pc, bits);
+  while (slots[i].used && slots[i].pc != pc) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+// Point every front entry at a PC that cannot map to it
+static void
+profile_front_clear(Profile *p)
+{
+  for (uint32_t i = 0; i < PROFILE_FRONT_SIZE; i++) {
+    p->front[i].pc = i + 1;
+    p->front[i].slot = 0;
+    p->front[i].recent = 0;
+  }
+}
+
+// Add the packed recent counts into the totals
+static void
+profile_flush(Profile *p)
+{
+  for (uint32_t i = 0; i < PROFILE_FRONT_SIZE; i++) {
+    p->slots[p->front[i].slot].recent += p->front[i].recent;
+    p->front[i].recent = 0;
+  }
+  for (size_t i = 0; i < ((size_t)1 << p->bits); i++) {
+    uint64_t r = p->slots[i].recent;
+    p->totals[i].executions += r & PROFILE_FIELD_MAX;
+    p->totals[i].taken += (r >> PROFILE_FIELD_BITS) & PROFILE_FIELD_MAX;
+    p->totals[i].mispredictions += (r >> (2 * PROFILE_FIELD_BITS)) & PROFILE_FIELD_MAX;
+    p->slots[i].recent = 0;
+  }
+  p->pending = 0;
+}
+
+static int
+profile_alloc(Profile *p, int bits)
+{
+  p->slots = (ProfileSlot *)calloc((size_t)1 << bits, sizeof(ProfileSlot));
+  p->totals = (ProfileEntry *)calloc((size_t)1 << bits, sizeof(ProfileEntry));
+  p->bits = bits;
+  return p->slots != NULL && p->totals != NULL;
+}
+
+static void
+profile_grow(Profile *p)
+{
+  profile_flush(p);
+  ProfileSlot *slots = p->slots;
+  ProfileEntry *totals = p->totals;
+  size_t size = (size_t)1 << p->bits;
+  if (!profile_alloc(p, p->bits + 1)) {
+    fprintf(stderr, "Unable to grow the branch profile\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (slots[i].used) {
+      uint32_t j = profile_find(p->slots, p->bits, slots[i].pc);
+      p->slots[j] = slots[i];
+      p->totals[j] = totals[i];
+    }
+  }
+  free(slots);
+  free(totals);
+  profile_front_clear(p);
+}
+
+Profile *
+profile_create()
+{
+  Profile *p = (Profile *)calloc(1, sizeof(Profile));
+  if (p == NULL) {
+    return NULL;
+  }
+  if (!profile_alloc(p, PROFILE_INITIAL_BITS)) {
+    profile_destroy(p);
+    return NULL;
+  }
+  profile_front_clear(p);
+  return p;
+}
+
+void
+profile_destroy(Profile *p)
+{
+  free(p->slots);
+  free(p->totals);
+  free(p);
+}
+
+void
+profile_add(Profile *p, const uint32_t *pc, const uint8_t *outcome,
+            const uint8_t *predictions, size_t n)
+{
+  while (n > 0) {
+    // No field may pass PROFILE_FIELD_MAX before the next flush
+    size_t m = PROFILE_FIELD_MAX - p->pending;
+    if (m > n) {
+      m = n;
+    }
+
+    uint64_t mispredictions = 0;
+    for (size_t i = 0; i < m; i++) {
+      ProfileFront *f = &p->front[pc[i] & (PROFILE_FRONT_SIZE - 1)];
+      if (f->pc != pc[i]) {
+        // Evict the cached branch to its slot and look this one up
+        p->slots[f->slot].recent += f->recent;
+        f->recent = 0;
+        uint32_t j = profile_find(p->slots, p->bits, pc[i]);
+        if (!p->slots[j].used) {
+          p->slots[j].pc = pc[i];
+          p->slots[j].used = 1;
+          p->totals[j].pc = pc[i];
+          if (++p->used * 2 > ((size_t)1 << p->bits)) {
+            p->pending += i;
+            profile_grow(p);
+            j = profile_find(p->slots, p->bits, pc[i]);
+            p->pending -= i;
+          }
+        }
+        f->pc = pc[i];
+        f->slot = j;
+      }
+      uint64_t miss = predictions[i] != outcome[i];
+      f->recent += 1 + (outcome[i] != 0) * PROFILE_TAKEN + miss * PROFILE_MISS;
+      mispredictions += miss;
+    }
+
+    p->pending += m;
+    p->branches += m;
+    p->mispredictions += mispredictions;
+    if (p->pending == PROFILE_FIELD_MAX) {
+      profile_flush(p);
+    }
+    pc += m;
+    outcome += m;
+    predictions += m;
+    n -= m;
+  }
+}
+
+size_t
+profile_branches(Profile *p)
+{
+  return p->used;
+}
+
+static int
+profile_compare(const void *a, const void *b)
+{
+  const ProfileEntry *x = (const ProfileEntry *)a;
+  const ProfileEntry *y = (const ProfileEntry *)b;
+  if (x->mispredictions != y->mispredictions) {
+    return x->mispredictions < y->mispredictions ? 1 : -1;
+  }
+  if (x->executions != y->executions) {
+    return x->executions < y->executions ? 1 : -1;
+  }
+  return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+size_t
+profile_top(Profile *p, ProfileEntry *top, size_t n)
+{
+  profile_flush(p);
+  ProfileEntry *all = (ProfileEntry *)malloc((p->used + 1) * sizeof(ProfileEntry));
+  if (all == NULL) {
+    return 0;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < ((size_t)1 << p->bits); i++) {
+    if (p->slots[i].used) {
+      all[count++] = p->totals[i];
+    }
+  }
+  qsort(all, count, sizeof(ProfileEntry), profile_compare);
+  if (n > count) {
+    n = count;
+  }
+  memcpy(top, all, n * sizeof(ProfileEntry));
+  free(all);
+  return n;
+}
+
+// Fraction of executions that went the majority direction
+static double
+profile_bias(const ProfileEntry *e)
+{
+  uint64_t majority = e->taken * 2 >= e->executions ? e->taken : e->executions - e->taken;
+  return (double)majority / e->executions;
+}
+
+void
+profile_report(Profile *p, size_t n, FILE *text, FILE *csv)
+{
+  ProfileEntry *top = (ProfileEntry *)malloc((n + 1) * sizeof(ProfileEntry));
+  if (top == NULL) {
+    return;
+  }
+  n = profile_top(p, top, n);
+  double total = p->mispredictions ? (double)p->mispredictions : 1.0;
+
+  if (text != NULL) {
+    fprintf(text, "Static branches: %10zu\n", p->used);
+    fprintf(text, "%4s %-10s %10s %10s %6s %8s %6s %6s\n", "Rank", "PC",
+            "Executed", "Incorrect", "Rate", "Bias", "Share", "Cumul");
+    double cumulative = 0;
+    for (size_t i = 0; i < n; i++) {
+      ProfileEntry *e = &top[i];
+      double share = 100.0 * e->mispredictions / total;
+      cumulative += share;
+      fprintf(text, "%4zu 0x%-8x %10llu %10llu %6.2f %7.2f%c %6.2f %6.2f\n",
+              i + 1, e->pc, (unsigned long long)e->executions,
+              (unsigned long long)e->mispredictions,
+              100.0 * e->mispredictions / e->executions, 100.0 * profile_bias(e),
+              e->taken * 2 >= e->executions ? 'T' : 'N', share, cumulative);
+    }
+  }
+
+  if (csv != NULL) {
+    fprintf(csv, "rank,pc,executions,taken,mispredictions,rate,bias,share\n");
+    for (size_t i = 0; i < n; i++) {
+      ProfileEntry *e = &top[i];
+      fprintf(csv, "%zu,0x%x,%llu,%llu,%llu,%.4f,%.4f,%.4f\n", i + 1, e->pc,
+              (unsigned long long)e->executions, (unsigned long long)e->taken,
+              (unsigned long long)e->mispredictions,
+              (double)e->mispredictions / e->executions, profile_bias(e),
+              e->mispredictions / total);
+    }
+  }
+  free(top);
+}
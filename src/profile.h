@@ -0,0 +1,53 @@
+//========================================================//
+//  profile.h                                             //
+//  Header file for the per-branch misprediction profile  //
+//                                                        //
+//  Counts executions, taken outcomes and mispredictions  //
+//  of every static branch and reports the branches that  //
+//  mispredict most                                       //
+//========================================================//
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct Profile Profile;
+
+// Per-branch totals
+struct ProfileEntry
+{
+  uint32_t pc;
+  uint64_t executions;
+  uint64_t taken;
+  uint64_t mispredictions;
+};
+typedef struct ProfileEntry ProfileEntry;
+
+Profile *profile_create();
+
+void profile_destroy(Profile *p);
+
+// Account for 'n' branches and the predictions made for them
+//
+void profile_add(Profile *p, const uint32_t *pc, const uint8_t *outcome,
+                 const uint8_t *predictions, size_t n);
+
+// Number of distinct branches seen
+//
+size_t profile_branches(Profile *p);
+
+// Fill 'top' with up to 'n' branches, most mispredictions first
+//
+// Returns the number of entries filled
+//
+size_t profile_top(Profile *p, ProfileEntry *top, size_t n);
+
+// Print the 'n' most mispredicted branches as a table to 'text' and
+// as CSV to 'csv'. Either may be NULL
+//
+void profile_report(Profile *p, size_t n, FILE *text, FILE *csv);
+
+#endif
@@ -0,0 +1,330 @@
+//========================================================//
+//  server.c                                              //
+//  Source file for the prediction server                 //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+#include "config.h"
+
+struct ServerInstance
+{
+  predictor_t *p;       // NULL once destroyed
+  uint64_t position;    // branches run, recorded in snapshots
+  ServerStats stats;
+};
+typedef struct ServerInstance ServerInstance;
+
+struct Server
+{
+  ServerInstance *instances;
+  uint32_t ninstances;
+
+  // Request and reply buffers, grown to the largest batch seen
+  uint8_t *payload;
+  uint8_t *reply;
+  uint8_t *outcome;
+  uint8_t *predictions;
+  size_t cap;
+};
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Returns True if all 'len' bytes were transferred
+static int
+read_full(int fd, void *buf, size_t len)
+{
+  uint8_t *p = (uint8_t *)buf;
+  while (len > 0) {
+    ssize_t r = read(fd, p, len);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return 0;
+    }
+    p += r;
+    len -= r;
+  }
+  return 1;
+}
+
+static int
+write_full(int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)buf;
+  while (len > 0) {
+    ssize_t r = write(fd, p, len);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return 0;
+    }
+    p += r;
+    len -= r;
+  }
+  return 1;
+}
+
+static uint32_t
+server_add(Server *s, predictor_t *p, uint64_t position)
+{
+  s->instances = (ServerInstance *)realloc(s->instances,
+                   (s->ninstances + 1) * sizeof(ServerInstance));
+  ServerInstance *in = &s->instances[s->ninstances];
+  memset(in, 0, sizeof(*in));
+  in->p = p;
+  in->position = position;
+  return s->ninstances++;
+}
+
+void
+server_destroy(Server *s)
+{
+  for (uint32_t i = 0; i < s->ninstances; i++) {
+    if (s->instances[i].p != NULL) {
+      predictor_destroy(s->instances[i].p);
+    }
+  }
+  free(s->instances);
+  free(s->payload);
+  free(s->reply);
+  free(s->outcome);
+  free(s->predictions);
+  free(s);
+}
+
+// Make room for a payload of 'len' bytes and a batch of as many
+// branches as it can hold
+static void
+server_reserve(Server *s, size_t len)
+{
+  if (len <= s->cap) {
+    return;
+  }
+  s->cap = len;
+  s->payload = (uint8_t *)realloc(s->payload, len + 1);
+  s->reply = (uint8_t *)realloc(s->reply, len + sizeof(ServerStats));
+  s->outcome = (uint8_t *)realloc(s->outcome, len / 4 + 1);
+  s->predictions = (uint8_t *)realloc(s->predictions, len / 4 + 1);
+}
+
+Server *
+server_create(const PredictorConfig *c)
+{
+  Server *s = (Server *)calloc(1, sizeof(Server));
+  server_add(s, predictor_create(c), 0);
+  server_reserve(s, 4096);
+  return s;
+}
+
+// Run the batch in the payload on 'in', leaving the reply in
+// s->reply
+//
+// Returns the reply status
+//
+static uint32_t
+server_predict(Server *s, ServerInstance *in, uint32_t len, uint32_t *replyLen)
+{
+  uint32_t n;
+  if (len < sizeof(n)) {
+    return SERVER_BAD_PAYLOAD;
+  }
+  memcpy(&n, s->payload, sizeof(n));
+  size_t bytes = ((size_t)n + 7) / 8;
+  if ((uint64_t)len != sizeof(n) + (uint64_t)n * sizeof(uint32_t) + bytes) {
+    return SERVER_BAD_PAYLOAD;
+  }
+  const uint32_t *pc = (const uint32_t *)(s->payload + sizeof(n));
+  const uint8_t *bits = s->payload + sizeof(n) + (size_t)n * sizeof(uint32_t);
+  for (uint32_t i = 0; i < n; i++) {
+    s->outcome[i] = (bits[i / 8] >> (i % 8)) & 1;
+  }
+
+  uint64_t start = now_ns();
+  uint32_t mispredictions = predictor_run(in->p, pc, s->outcome, s->predictions, n);
+  uint64_t elapsed = now_ns() - start;
+
+  ServerStats *st = &in->stats;
+  st->batches++;
+  st->branches += n;
+  st->mispredictions += mispredictions;
+  st->busyNs += elapsed;
+  st->lastBatchNs = elapsed;
+  if (elapsed > st->maxBatchNs) {
+    st->maxBatchNs = elapsed;
+  }
+  in->position += n;
+
+  memcpy(s->reply, &mispredictions, sizeof(mispredictions));
+  uint8_t *packed = s->reply + sizeof(mispredictions);
+  memset(packed, 0, bytes);
+  for (uint32_t i = 0; i < n; i++) {
+    packed[i / 8] |= s->predictions[i] << (i % 8);
+  }
+  *replyLen = sizeof(mispredictions) + bytes;
+  return SERVER_OK;
+}
+
+// Carry out one request whose payload is in s->payload
+//
+// Returns the reply status
+//
+static uint32_t
+server_handle(Server *s, const ServerHeader *req, uint32_t *replyLen)
+{
+  *replyLen = 0;
+  char *text = (char *)s->payload;
+  text[req->length] = '\0';
+
+  if (req->command == SERVER_CREATE) {
+    PredictorConfig c;
+    if (!config_parse(text, &c)) {
+      return SERVER_FAILED;
+    }
+    predictor_t *p = predictor_create(&c);
+    if (p == NULL) {
+      return SERVER_FAILED;
+    }
+    uint32_t id = server_add(s, p, 0);
+    memcpy(s->reply, &id, sizeof(id));
+    *replyLen = sizeof(id);
+    return SERVER_OK;
+  }
+  if (req->command == SERVER_SHUTDOWN) {
+    return SERVER_OK;
+  }
+
+  if (req->id >= s->ninstances || s->instances[req->id].p == NULL) {
+    return SERVER_BAD_ID;
+  }
+  ServerInstance *in = &s->instances[req->id];
+  switch (req->command) {
+    case SERVER_DESTROY:
+      predictor_destroy(in->p);
+      in->p = NULL;
+      return SERVER_OK;
+    case SERVER_PREDICT:
+      return server_predict(s, in, req->length, replyLen);
+    case SERVER_RESET:
+      predictor_reset(in->p);
+      in->position = 0;
+      memset(&in->stats, 0, sizeof(in->stats));
+      return SERVER_OK;
+    case SERVER_SAVE:
+      return predictor_save(in->p, text, in->position) ? SERVER_OK : SERVER_FAILED;
+    case SERVER_LOAD: {
+      uint64_t position;
+      predictor_t *p = predictor_load(text, &position);
+      if (p == NULL) {
+        return SERVER_FAILED;
+      }
+      predictor_destroy(in->p);
+      in->p = p;
+      in->position = position;
+      memset(&in->stats, 0, sizeof(in->stats));
+      return SERVER_OK;
+    }
+    case SERVER_STATS:
+      memcpy(s->reply, &in->stats, sizeof(in->stats));
+      *replyLen = sizeof(in->stats);
+      return SERVER_OK;
+    default:
+      return SERVER_BAD_COMMAND;
+  }
+}
+
+int
+server_serve(Server *s, int in, int out)
+{
+  ServerHeader req;
+  while (read_full(in, &req, sizeof(req))) {
+    ServerHeader rep = {SERVER_OK, req.id, 0};
+    if (req.length > SERVER_MAX_PAYLOAD) {
+      // The stream cannot be resynchronized after an oversized request
+      rep.command = SERVER_BAD_PAYLOAD;
+      write_full(out, &rep, sizeof(rep));
+      return 0;
+    }
+    server_reserve(s, req.length);
+    if (!read_full(in, s->payload, req.length)) {
+      return 0;
+    }
+
+    rep.command = server_handle(s, &req, &rep.length);
+    if (!write_full(out, &rep, sizeof(rep)) ||
+        !write_full(out, s->reply, rep.length)) {
+      return 0;
+    }
+    if (req.command == SERVER_SHUTDOWN) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int
+server_listen(Server *s, const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return 0;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Only a stale socket is replaced, never a file given by mistake
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode) || unlink(path) != 0) {
+      return 0;
+    }
+  } else if (errno != ENOENT) {
+    return 0;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return 0;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8)) {
+    close(fd);
+    return 0;
+  }
+
+  // A client that disconnects mid-reply must not end the server
+  signal(SIGPIPE, SIG_IGN);
+  int stop = 0;
+  while (!stop) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    stop = server_serve(s, conn, conn);
+    close(conn);
+  }
+  close(fd);
+  unlink(path);
+  return stop;
+}
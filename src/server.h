@@ -0,0 +1,108 @@
+//========================================================//
+//  server.h                                              //
+//  Header file for the prediction server                 //
+//                                                        //
+//  Keeps predictors resident and runs batches of         //
+//  branches sent over a Unix socket or stdin/stdout      //
+//========================================================//
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include "predictor.h"
+
+//------------------------------------//
+//             Protocol               //
+//------------------------------------//
+//
+// All fields are little-endian. Every request is a ServerHeader
+// followed by 'length' bytes of payload, and is answered by a
+// ServerHeader carrying a status in place of the command and its own
+// payload. Requests name the instance they apply to.
+//
+//   SERVER_CREATE   payload: configuration string, e.g. "tage:64"
+//                   reply:   uint32_t id of the new instance
+//   SERVER_DESTROY  release the instance
+//   SERVER_PREDICT  payload: uint32_t n
+//                            uint32_t pc[n]
+//                            uint8_t  outcome[(n + 7) / 8]
+//                   reply:   uint32_t mispredictions
+//                            uint8_t  prediction[(n + 7) / 8]
+//                   Predicts and trains the branches in order.
+//                   Branch i is bit (i % 8) of byte i / 8
+//   SERVER_RESET    return the instance to its created state
+//   SERVER_SAVE     payload: path to write a snapshot to
+//   SERVER_LOAD     payload: path of a snapshot to replace the
+//                   instance with, configuration included
+//   SERVER_STATS    reply:   ServerStats of the instance
+//   SERVER_SHUTDOWN stop serving once this request is answered
+//
+#define SERVER_CREATE   1
+#define SERVER_DESTROY  2
+#define SERVER_PREDICT  3
+#define SERVER_RESET    4
+#define SERVER_SAVE     5
+#define SERVER_LOAD     6
+#define SERVER_STATS    7
+#define SERVER_SHUTDOWN 8
+
+// Reply status
+#define SERVER_OK          0
+#define SERVER_BAD_COMMAND 1
+#define SERVER_BAD_ID      2  // no such instance
+#define SERVER_BAD_PAYLOAD 3  // malformed or too long
+#define SERVER_FAILED      4  // configuration or file rejected
+
+// Longest payload accepted, enough for a batch of a million branches
+#define SERVER_MAX_PAYLOAD (8 << 20)
+
+struct ServerHeader
+{
+  uint32_t command;   // status in replies
+  uint32_t id;        // instance
+  uint32_t length;    // of the payload that follows
+};
+typedef struct ServerHeader ServerHeader;
+
+// Per-instance counters since it was created or loaded
+struct ServerStats
+{
+  uint64_t batches;
+  uint64_t branches;
+  uint64_t mispredictions;
+  uint64_t busyNs;       // spent running batches
+  uint64_t maxBatchNs;   // slowest batch
+  uint64_t lastBatchNs;
+};
+typedef struct ServerStats ServerStats;
+
+//------------------------------------//
+//              Server                //
+//------------------------------------//
+
+typedef struct Server Server;
+
+// Create a server whose instance 0 runs configuration 'c'
+//
+Server *server_create(const PredictorConfig *c);
+
+void server_destroy(Server *s);
+
+// Answer requests read from 'in' on 'out' until end of input, an
+// I/O error or SERVER_SHUTDOWN
+//
+// Returns True if SERVER_SHUTDOWN was received
+//
+int server_serve(Server *s, int in, int out);
+
+// Listen on the Unix socket 'path', replacing a socket already
+// there, and serve one connection after another until one of them
+// sends SERVER_SHUTDOWN. Instances outlive connections
+//
+// Returns True if Successful, False without touching 'path' if
+// something other than a socket is there
+//
+int server_listen(Server *s, const char *path);
+
+#endif
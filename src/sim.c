@@ -0,0 +1,381 @@
+//========================================================//
+//  sim.c                                                 //
+//  Source file for replaying decoded traces              //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+#include "pool.h"
+
+uint64_t
+sim_run(const PredictorConfig *c, const TraceData *data)
+{
+  predictor_t *p = predictor_create(c);
+
+  uint64_t mispredictions = predictor_run(p, data->pc, data->outcome, NULL, data->n);
+
+  predictor_destroy(p);
+  return mispredictions;
+}
+
+struct SimChunk
+{
+  const PredictorConfig *config;
+  const TraceData *data;
+  uint64_t warmupStart; // first branch trained on
+  uint64_t start;       // first branch counted
+  uint64_t end;
+  uint64_t mispredictions;
+};
+typedef struct SimChunk SimChunk;
+
+static void
+sim_chunk_task(Pool *pool, void *arg)
+{
+  (void)pool; // a chunk submits no further work
+  SimChunk *ch = (SimChunk *)arg;
+  const TraceData *d = ch->data;
+  predictor_t *p = predictor_create(ch->config);
+
+  predictor_run(p, d->pc + ch->warmupStart, d->outcome + ch->warmupStart,
+                NULL, ch->start - ch->warmupStart);
+  ch->mispredictions = predictor_run(p, d->pc + ch->start,
+                                     d->outcome + ch->start, NULL,
+                                     ch->end - ch->start);
+  predictor_destroy(p);
+}
+
+uint64_t
+sim_run_chunks(const PredictorConfig *c, const TraceData *data,
+               int chunks, uint64_t warmup, int jobs)
+{
+  if (chunks < 1) {
+    chunks = 1;
+  }
+  SimChunk *ch = (SimChunk *)calloc(chunks, sizeof(SimChunk));
+
+  Pool *pool = pool_create(jobs);
+  for (int i = 0; i < chunks; i++) {
+    ch[i].config = c;
+    ch[i].data = data;
+    ch[i].start = data->n * i / chunks;
+    ch[i].end = data->n * (i + 1) / chunks;
+    ch[i].warmupStart = ch[i].start > warmup ? ch[i].start - warmup : 0;
+    pool_submit(pool, sim_chunk_task, &ch[i]);
+  }
+  pool_wait(pool);
+  pool_destroy(pool);
+
+  uint64_t mispredictions = 0;
+  for (int i = 0; i < chunks; i++) {
+    mispredictions += ch[i].mispredictions;
+  }
+  free(ch);
+  return mispredictions;
+}
+
+struct SimMatrix
+{
+  const char **paths;
+  const PredictorConfig *configs;
+  int nconfigs;
+  SimResult *results;
+  TraceData **data;
+  int *remaining;   // runs still using each trace
+};
+typedef struct SimMatrix SimMatrix;
+
+// Tasks need both the matrix and their own index
+struct SimMatrixTask
+{
+  SimMatrix *m;
+  int index;
+};
+typedef struct SimMatrixTask SimMatrixTask;
+
+static double
+sim_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sim_matrix_run_task(Pool *pool, void *arg)
+{
+  (void)pool; // a run submits no further work
+  SimMatrixTask *task = (SimMatrixTask *)arg;
+  SimMatrix *m = task->m;
+  int t = task->index / m->nconfigs;
+  SimResult *r = &m->results[task->index];
+
+  if (m->data[t] == NULL) {
+    r->failed = 1;
+  } else {
+    double start = sim_now();
+    r->branches = m->data[t]->n;
+    r->mispredictions = sim_run(&m->configs[task->index % m->nconfigs],
+                                m->data[t]);
+    r->seconds = sim_now() - start;
+  }
+
+  // The last run of a trace releases it
+  if (__atomic_sub_fetch(&m->remaining[t], 1, __ATOMIC_ACQ_REL) == 0 &&
+      m->data[t] != NULL) {
+    traceData_destroy(m->data[t]);
+    m->data[t] = NULL;
+  }
+}
+
+// Decode a trace once, then fan its runs out onto this worker's
+// deque for idle workers to steal
+//
+static void
+sim_matrix_load_task(Pool *pool, void *arg)
+{
+  SimMatrixTask *task = (SimMatrixTask *)arg;
+  SimMatrix *m = task->m;
+  int t = task->index;
+  m->data[t] = traceData_load(m->paths[t]);
+  if (m->data[t] == NULL) {
+    fprintf(stderr, "Unable to open trace %s\n", m->paths[t]);
+  }
+  SimMatrixTask *runs = task + 1;
+  for (int c = 0; c < m->nconfigs; c++) {
+    runs[c].m = m;
+    runs[c].index = t * m->nconfigs + c;
+    pool_submit(pool, sim_matrix_run_task, &runs[c]);
+  }
+}
+
+void
+sim_run_matrix(const char **paths, int npaths, const PredictorConfig *configs,
+               int nconfigs, int jobs, SimResult *results)
+{
+  SimMatrix m;
+  m.paths = paths;
+  m.configs = configs;
+  m.nconfigs = nconfigs;
+  m.results = results;
+  m.data = (TraceData **)calloc(npaths, sizeof(TraceData *));
+  m.remaining = (int *)calloc(npaths, sizeof(int));
+  memset(results, 0, npaths * nconfigs * sizeof(SimResult));
+
+  // Each trace has a load task followed by its runs
+  int stride = nconfigs + 1;
+  SimMatrixTask *tasks = (SimMatrixTask *)calloc(npaths * stride,
+                                                 sizeof(SimMatrixTask));
+  Pool *pool = pool_create(jobs);
+  for (int t = 0; t < npaths; t++) {
+    m.remaining[t] = nconfigs;
+    tasks[t * stride].m = &m;
+    tasks[t * stride].index = t;
+    pool_submit(pool, sim_matrix_load_task, &tasks[t * stride]);
+  }
+  pool_wait(pool);
+  pool_destroy(pool);
+
+  free(tasks);
+  free(m.data);
+  free(m.remaining);
+}
+
+int
+sampleSpec_parse(const char *s, SampleSpec *spec)
+{
+  unsigned long long ff, warmup, measure;
+  char tail;
+  if (sscanf(s, "%llu:%llu:%llu%c", &ff, &warmup, &measure, &tail) != 3 ||
+      measure == 0) {
+    return 0;
+  }
+  spec->fastforward = ff;
+  spec->warmup = warmup;
+  spec->measure = measure;
+  return 1;
+}
+
+enum { SAMPLE_FASTFORWARD, SAMPLE_WARMUP, SAMPLE_MEASURE };
+
+static uint64_t
+sampler_length(const Sampler *s, int phase)
+{
+  switch (phase) {
+    case SAMPLE_FASTFORWARD: return s->spec.fastforward;
+    case SAMPLE_WARMUP:      return s->spec.warmup;
+    default:                 return s->spec.measure;
+  }
+}
+
+void
+sampler_init(Sampler *s, const SampleSpec *spec)
+{
+  memset(s, 0, sizeof(*s));
+  s->spec = *spec;
+  s->phase = SAMPLE_FASTFORWARD;
+  s->remaining = spec->fastforward;
+}
+
+void
+sampler_run(Sampler *s, predictor_t *p, const uint32_t *pc,
+            const uint8_t *outcome, size_t n)
+{
+  while (n > 0) {
+    // Empty regions are skipped over
+    while (s->remaining == 0) {
+      s->phase = (s->phase + 1) % 3;
+      s->remaining = sampler_length(s, s->phase);
+    }
+
+    size_t len = s->remaining < n ? s->remaining : n;
+    if (s->phase == SAMPLE_FASTFORWARD) {
+      predictor_advance(p, pc, outcome, len);
+    } else {
+      uint64_t misses = predictor_run(p, pc, outcome, NULL, len);
+      if (s->phase == SAMPLE_MEASURE) {
+        s->sampleMisses += misses;
+      }
+    }
+
+    s->remaining -= len;
+    if (s->phase == SAMPLE_MEASURE) {
+      s->measured += len;
+      if (s->remaining == 0) {
+        double rate = (double)s->sampleMisses / s->spec.measure;
+        s->rateSum += rate;
+        s->rateSumSq += rate * rate;
+        s->samples++;
+        s->mispredictions += s->sampleMisses;
+        s->sampleMisses = 0;
+      }
+    }
+    pc += len;
+    outcome += len;
+    n -= len;
+  }
+}
+
+double
+sampler_rate(const Sampler *s, double *interval)
+{
+  // A measure region cut short by the end of the trace still counts
+  // towards the rate, but not towards the interval
+  uint64_t misses = s->mispredictions + s->sampleMisses;
+  double rate = s->measured ? 100.0 * misses / s->measured : 0;
+
+  *interval = 0;
+  if (s->samples > 1) {
+    double k = s->samples;
+    double mean = s->rateSum / k;
+    double var = (s->rateSumSq - k * mean * mean) / (k - 1);
+    *interval = 100.0 * 1.96 * sqrt(var > 0 ? var : 0) / sqrt(k);
+  }
+  return rate;
+}
+
+void
+series_init(Series *s, predictor_t *p, uint64_t window, uint64_t first,
+            FILE *out, int binary)
+{
+  memset(s, 0, sizeof(*s));
+  s->out = out;
+  s->binary = binary;
+  s->window = window;
+  s->current.start = first;
+  predictor_components(p, &s->before);
+  const PredictorConfig *c = predictor_config(p);
+  s->names[0] = predictor_component_name(c, 0);
+  s->names[1] = predictor_component_name(c, 1);
+
+  if (binary) {
+    char header[40];
+    uint32_t version = SERIES_VERSION;
+    int32_t config[4] = {c->bpType, c->ghistoryBits, c->lhistoryBits, c->pcIndexBits};
+    memset(header, 0, sizeof(header));
+    memcpy(header, SERIES_MAGIC, sizeof(SERIES_MAGIC));
+    memcpy(header + 8, &version, sizeof(version));
+    memcpy(header + 16, config, sizeof(config));
+    memcpy(header + 32, &window, sizeof(window));
+    fwrite(header, sizeof(header), 1, out);
+    return;
+  }
+  fprintf(out, "start,branches,mispredictions,rate,mpkb");
+  for (int k = 0; k < 2 && s->names[0] != NULL; k++) {
+    fprintf(out, ",%s_picks,%s_mispredictions", s->names[k], s->names[k]);
+  }
+  fprintf(out, "\n");
+}
+
+// Write out the window being filled and start the next one
+static void
+series_emit(Series *s, predictor_t *p)
+{
+  SeriesRecord *r = &s->current;
+  PredictorComponents now;
+  predictor_components(p, &now);
+  for (int k = 0; k < 2; k++) {
+    r->picks[k] = now.picks[k] - s->before.picks[k];
+    r->componentMispredictions[k] = now.mispredictions[k] - s->before.mispredictions[k];
+  }
+  s->before = now;
+
+  if (s->binary) {
+    fwrite(r, sizeof(*r), 1, s->out);
+  } else {
+    double rate = r->branches ? (double)r->mispredictions / r->branches : 0;
+    fprintf(s->out, "%llu,%u,%u,%.3f,%.3f", (unsigned long long)r->start,
+            r->branches, r->mispredictions, 100 * rate, 1000 * rate);
+    for (int k = 0; k < 2 && s->names[0] != NULL; k++) {
+      fprintf(s->out, ",%u,%u", r->picks[k], r->componentMispredictions[k]);
+    }
+    fprintf(s->out, "\n");
+  }
+
+  uint64_t next = r->start + r->branches;
+  memset(r, 0, sizeof(*r));
+  r->start = next;
+}
+
+uint64_t
+series_run(Series *s, predictor_t *p, const uint32_t *pc,
+           const uint8_t *outcome, uint8_t *predictions, size_t n)
+{
+  // Batches are cut at window boundaries, so the counts only need
+  // reading there and the batch loops run unchanged
+  uint64_t mispredictions = 0;
+  while (n > 0) {
+    size_t len = s->window - s->current.branches;
+    if (len > n) {
+      len = n;
+    }
+    uint64_t misses = predictor_run(p, pc, outcome, predictions, len);
+    s->current.branches += len;
+    s->current.mispredictions += misses;
+    mispredictions += misses;
+    if (s->current.branches == s->window) {
+      series_emit(s, p);
+    }
+    pc += len;
+    outcome += len;
+    if (predictions != NULL) {
+      predictions += len;
+    }
+    n -= len;
+  }
+  return mispredictions;
+}
+
+void
+series_finish(Series *s, predictor_t *p)
+{
+  if (s->current.branches > 0) {
+    series_emit(s, p);
+  }
+  fflush(s->out);
+}
@@ -0,0 +1,167 @@
+//========================================================//
+//  sim.h                                                 //
+//  Header file for replaying decoded traces              //
+//========================================================//
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "predictor.h"
+#include "trace.h"
+
+// Build the predictor described by 'c', replay every branch of
+// 'data' through it and release it again. Every run has its own
+// predictor instance, so simulations may run concurrently
+//
+// Returns the number of mispredictions
+//
+uint64_t sim_run(const PredictorConfig *c, const TraceData *data);
+
+//------------------------------------//
+//      Chunk-Parallel Simulation     //
+//------------------------------------//
+
+// Split 'data' into 'chunks' runs of consecutive branches and
+// simulate them concurrently on 'jobs' threads (one per core if
+// not positive). Each chunk has its own predictor, trained without
+// counting on up to 'warmup' branches before the chunk, so the sum
+// differs from sim_run by the cold-start error of every chunk
+//
+// Returns the number of mispredictions summed over the chunks
+//
+uint64_t sim_run_chunks(const PredictorConfig *c, const TraceData *data,
+                        int chunks, uint64_t warmup, int jobs);
+
+//------------------------------------//
+//     Trace by Configuration Runs    //
+//------------------------------------//
+
+struct SimResult
+{
+  uint64_t branches;
+  uint64_t mispredictions;
+  double seconds;  // simulation only, excluding decoding
+  int failed;      // the trace could not be opened
+};
+typedef struct SimResult SimResult;
+
+// Run every configuration in 'configs' over every trace in 'paths'
+// on 'jobs' threads (one per core if not positive). Traces are
+// decoded concurrently, once each, and released after their last
+// run. Result t * nconfigs + c is for trace t and configuration c
+//
+void sim_run_matrix(const char **paths, int npaths,
+                    const PredictorConfig *configs, int nconfigs, int jobs,
+                    SimResult *results);
+
+//------------------------------------//
+//         Sampled Simulation         //
+//------------------------------------//
+
+// Lengths in branches of the three regions of every sampling
+// period: fast-forward only shifts history registers, warmup
+// trains the tables without counting and measure is counted
+struct SampleSpec
+{
+  uint64_t fastforward;
+  uint64_t warmup;
+  uint64_t measure;
+};
+typedef struct SampleSpec SampleSpec;
+
+struct Sampler
+{
+  SampleSpec spec;
+  int phase;          // region the next branch falls in
+  uint64_t remaining; // branches left in that region
+  uint64_t sampleMisses;
+  uint64_t samples;   // completed measure regions
+  double rateSum;     // of the per-sample misprediction rates
+  double rateSumSq;
+  uint64_t measured;
+  uint64_t mispredictions;
+};
+typedef struct Sampler Sampler;
+
+// Parse "<fastforward>:<warmup>:<measure>"
+//
+// Returns True if Successful
+//
+int sampleSpec_parse(const char *s, SampleSpec *spec);
+
+void sampler_init(Sampler *s, const SampleSpec *spec);
+
+// Feed the next 'n' branches of a trace through 'p', splitting
+// them into regions. Regions may span calls
+//
+void sampler_run(Sampler *s, predictor_t *p, const uint32_t *pc,
+                 const uint8_t *outcome, size_t n);
+
+// Misprediction rate over every measured branch, in percent, and
+// the half-width of its 95% confidence interval from the spread
+// of the per-sample rates. The interval is 0 with fewer than two
+// samples
+//
+double sampler_rate(const Sampler *s, double *interval);
+
+//------------------------------------//
+//       Windowed Time Series         //
+//------------------------------------//
+//
+// Misprediction counts for every window of a fixed number of
+// branches, written as CSV or in this binary form. All fields are
+// little-endian.
+//
+//   offset 0   char     magic[8]   "BPSERIE\0"
+//   offset 8   uint32_t version    SERIES_VERSION
+//   offset 12  uint32_t flags      reserved, 0
+//   offset 16  int32_t  bpType, ghistoryBits, lhistoryBits, pcIndexBits
+//   offset 32  uint64_t window     branches per window
+//   offset 40  SeriesRecord record[] to the end of the file
+//
+#define SERIES_MAGIC   "BPSERIE"
+#define SERIES_VERSION 1
+
+struct SeriesRecord
+{
+  uint64_t start;          // trace position of the first branch
+  uint32_t branches;       // the window, or less for the last one
+  uint32_t mispredictions;
+  uint32_t picks[2];       // by component, see PredictorComponents
+  uint32_t componentMispredictions[2];
+};
+typedef struct SeriesRecord SeriesRecord;
+
+struct Series
+{
+  FILE *out;
+  int binary;
+  uint64_t window;
+  const char *names[2];       // components, NULL for none
+  SeriesRecord current;       // window being filled
+  PredictorComponents before; // counts when it started
+};
+typedef struct Series Series;
+
+// Start a series of windows of 'window' branches for predictor 'p',
+// whose next branch is at trace position 'first', and write its CSV
+// or binary header to 'out'
+//
+void series_init(Series *s, predictor_t *p, uint64_t window, uint64_t first,
+                 FILE *out, int binary);
+
+// Run the next 'n' branches through 'p' as predictor_run does,
+// writing out every window completed. Windows may span calls
+//
+// Returns the number of mispredictions
+//
+uint64_t series_run(Series *s, predictor_t *p, const uint32_t *pc,
+                    const uint8_t *outcome, uint8_t *predictions, size_t n);
+
+// Write out the last window if it holds any branches
+//
+void series_finish(Series *s, predictor_t *p);
+
+#endif
@@ -1,11 +1,21 @@
 #include "predictor.c"
+#include <dirent.h>
+#include <bzlib.h>
+#include "trace.h"
+#include "pool.h"
+#include "profile.h"
+#include "sim.h"
+#include "tune.h"
+#include "server.h"
+#include "config.h"
+#include "predictions.h"
 
 void test_getLowerNBits()
 {
     const int size = 2;
-    int vals[size] = {72, 1365};
-    int ans[size] = {8, 21};
-    int q[size] = {4, 5};
+    int vals[] = {72, 1365};
+    int ans[] = {8, 21};
+    int q[] = {4, 5};
     for (int i = 0; i < size; i++)
     {
         if (ans[i] != getLowerNBits(vals[i], q[i]))
@@ -26,16 +36,16 @@ void test_Counter()
     increment(c, 0);
     increment(c, 0);
 
-    if (c->counts[0] != 3)
+    if (counter_get(c, 0) != 3)
     {
-        printf("FAIL: Count should be 3, is %d\n", c->counts[0]);
+        printf("FAIL: Count should be 3, is %d\n", counter_get(c, 0));
         return;
     }
 
     increment(c, 0);
-    if (c->counts[0] != 3)
+    if (counter_get(c, 0) != 3)
     {
-        printf("FAIL: Count should be 3, after increasing 4 times, is %d\n", c->counts[0]);
+        printf("FAIL: Count should be 3, after increasing 4 times, is %d\n", counter_get(c, 0));
         return;
     }
 
@@ -43,12 +53,61 @@ void test_Counter()
     decrement(c, 0);
     decrement(c, 0);
     decrement(c, 0);
-    if (c->counts[0] != 0)
+    if (counter_get(c, 0) != 0)
         printf("FAIL: Count should be 0");
 
     printf("PASS: test_Counter()\n");
 }
 
+void test_packedCounter()
+{
+    // Saturating one counter must never disturb its neighbours
+    int table_size = 100;
+    Counter *c = counter_init(table_size, 3);
+    int model[100];
+    srand(2);
+    for (int i = 0; i < table_size; i++)
+    {
+        model[i] = rand() % 4;
+        counter_set(c, i, model[i]);
+    }
+    for (int i = 0; i < 100000; i++)
+    {
+        int idx = rand() % table_size;
+        if (rand() % 2)
+        {
+            increment(c, idx);
+            model[idx] += model[idx] < 3;
+        }
+        else
+        {
+            decrement(c, idx);
+            model[idx] -= model[idx] > 0;
+        }
+    }
+    for (int i = 0; i < table_size; i++)
+    {
+        if (counter_get(c, i) != model[i])
+        {
+            printf("FAIL: Counter %d is %d, expected %d\n", i, counter_get(c, i), model[i]);
+            counter_destroy(c);
+            return;
+        }
+    }
+    counter_destroy(c);
+
+    c = counter_init(table_size, 3);
+    counter_fill(c, 2);
+    if (counter_get(c, 0) != 2 || counter_get(c, 99) != 2)
+    {
+        printf("FAIL: Counters should be filled with 2\n");
+        counter_destroy(c);
+        return;
+    }
+    counter_destroy(c);
+    printf("PASS: test_packedCounter()\n");
+}
+
 void test_Bimodal()
 {
     int table_size = getTableSize(10);
@@ -57,14 +116,14 @@ void test_Bimodal()
     srand(0);
     for (int i = 0; i < table_size; i++)
     {
-        bc->counter->counts[i] = rand() % 4;
+        counter_set(bc->counter, i, rand() % 4);
     }
 
     for (int i = 0; i < 100; i++)
     {
         int idx = rand() % table_size;
         uint8_t o = getOutcome(bc, idx);
-        uint8_t e = bc->counter->counts[idx] >= 2;
+        uint8_t e = counter_get(bc->counter, idx) >= 2;
         if (o != e)
         {
             printf("FAIL: Counts unequal, expected %d, got %d\n", e, o);
@@ -96,10 +155,1319 @@ void test_gshare()
     printf("PASS: test_gshare()\n");
 }
 
+void test_binaryTrace()
+{
+    const char *path = "test_trace.bpt";
+    const int n = 100000; // spans more than one batch
+    uint32_t *pc = malloc(n * sizeof(uint32_t));
+    uint8_t *outcome = malloc(n);
+    srand(1);
+    for (int i = 0; i < n; i++)
+    {
+        pc[i] = rand();
+        outcome[i] = rand() % 2;
+    }
+
+    TraceWriter *w = traceWriter_open(path);
+    traceWriter_append(w, pc, outcome, 70001);
+    traceWriter_append(w, pc + 70001, outcome + 70001, n - 70001);
+    traceWriter_close(w);
+
+    Trace *t = trace_open(path);
+    TraceBatch b;
+    int pos = 0;
+    while (trace_next(t, &b))
+    {
+        for (size_t i = 0; i < b.n; i++, pos++)
+        {
+            if (pos >= n || b.pc[i] != pc[pos] || b.outcome[i] != outcome[pos])
+            {
+                printf("FAIL: Binary trace differs at branch %d\n", pos);
+                trace_close(t);
+                remove(path);
+                return;
+            }
+        }
+    }
+    trace_close(t);
+    remove(path);
+    free(pc);
+    free(outcome);
+
+    if (pos != n)
+    {
+        printf("FAIL: Read %d branches from binary trace, expected %d\n", pos, n);
+        return;
+    }
+    printf("PASS: test_binaryTrace()\n");
+}
+
+long pool_sum;
+
+void pool_leaf(Pool *pool, void *arg)
+{
+    __atomic_add_fetch(&pool_sum, (long)(intptr_t)arg, __ATOMIC_RELAXED);
+}
+
+void pool_fanout(Pool *pool, void *arg)
+{
+    for (int i = 1; i <= 100; i++)
+    {
+        pool_submit(pool, pool_leaf, (void *)(intptr_t)i);
+    }
+}
+
+void test_pool()
+{
+    Pool *pool = pool_create(4);
+    pool_sum = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        pool_submit(pool, pool_fanout, NULL);
+    }
+    pool_wait(pool);
+    if (pool_sum != 10 * 5050)
+    {
+        printf("FAIL: Pool ran tasks summing to %ld, expected %d\n", pool_sum, 10 * 5050);
+        pool_destroy(pool);
+        return;
+    }
+    pool_destroy(pool);
+    printf("PASS: test_pool()\n");
+}
+
+void test_perceptronKernels()
+{
+    // The selected SIMD kernels must match the scalar ones bit for bit,
+    // including 16-bit wraparound and widths that end mid-vector
+    perceptron_select_kernels();
+    int16_t a[64], b[64];
+    srand(3);
+    for (int iter = 0; iter < 10000; iter++)
+    {
+        int width = 1 + rand() % 64;
+        uint64_t history = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ rand();
+        int16_t bias = rand();
+        int sign = rand() % 2 ? 1 : -1;
+        for (int i = 0; i < 64; i++)
+        {
+            a[i] = b[i] = i < width ? (int16_t)rand() : 0;
+        }
+
+        int32_t expected = perceptron_dot_scalar(a, bias, history, width);
+        int32_t got = perceptron_dot(b, bias, history, width);
+        if (expected != got)
+        {
+            printf("FAIL: Perceptron output %d, expected %d (width %d)\n", got, expected, width);
+            return;
+        }
+
+        perceptron_train_scalar(a, history, width, sign);
+        perceptron_train_kernel(b, history, width, sign);
+        if (memcmp(a, b, sizeof(a)) != 0)
+        {
+            printf("FAIL: Perceptron weights differ after training (width %d)\n", width);
+            return;
+        }
+    }
+    printf("PASS: test_perceptronKernels()\n");
+}
+
+void test_fusedUpdate()
+{
+    int types[] = {STATIC, GSHARE, TOURNAMENT, CUSTOM, TAGE};
+    enum { N = 20000 };
+    static uint8_t expected[N];
+    ghistoryBits = 9;
+    lhistoryBits = 10;
+    pcIndexBits = 10;
+    for (int t = 0; t < 5; t++)
+    {
+        bpType = types[t];
+        uint32_t seed = 1;
+        init_predictor();
+        for (int i = 0; i < N; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint32_t pc = 0x400000 + ((seed >> 16) & 0x3f) * 4;
+            uint8_t outcome = (seed >> 8) % 3 != 0;
+            expected[i] = make_prediction(pc);
+            train_predictor(pc, outcome);
+        }
+        free_predictor();
+
+        seed = 1;
+        init_predictor();
+        for (int i = 0; i < N; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint32_t pc = 0x400000 + ((seed >> 16) & 0x3f) * 4;
+            uint8_t outcome = (seed >> 8) % 3 != 0;
+            if (predict_and_update(pc, outcome) != expected[i])
+            {
+                printf("FAIL: predictor %d differs from make_prediction at branch %d\n", bpType, i);
+                free_predictor();
+                return;
+            }
+        }
+        free_predictor();
+    }
+    printf("PASS: test_fusedUpdate()\n");
+}
+
+void test_predictorInstances()
+{
+    PredictorConfig configs[] = {
+        {GSHARE, 10, 0, 0}, {TOURNAMENT, 9, 10, 10}, {CUSTOM, 0, 0, 0}};
+    enum { N = 20000, K = 3 };
+    static uint8_t expected[K][N];
+
+    // Reference: each configuration on its own through the default instance
+    for (int k = 0; k < K; k++)
+    {
+        bpType = configs[k].bpType;
+        ghistoryBits = configs[k].ghistoryBits;
+        lhistoryBits = configs[k].lhistoryBits;
+        pcIndexBits = configs[k].pcIndexBits;
+        init_predictor();
+        uint32_t seed = 7;
+        for (int i = 0; i < N; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint32_t pc = 0x400000 + ((seed >> 16) & 0xff) * 4;
+            uint8_t outcome = (seed >> 8) % 3 != 0;
+            expected[k][i] = make_prediction(pc);
+            train_predictor(pc, outcome);
+        }
+        free_predictor();
+    }
+
+    // All instances interleaved branch by branch, twice with a reset
+    predictor_t *p[K];
+    for (int k = 0; k < K; k++)
+        p[k] = predictor_create(&configs[k]);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t seed = 7;
+        for (int i = 0; i < N; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint32_t pc = 0x400000 + ((seed >> 16) & 0xff) * 4;
+            uint8_t outcome = (seed >> 8) % 3 != 0;
+            for (int k = 0; k < K; k++)
+            {
+                uint8_t pred = predictor_predict(p[k], pc);
+                predictor_update(p[k], pc, outcome);
+                if (pred != expected[k][i])
+                {
+                    printf("FAIL: instance %d pass %d differs at branch %d\n", k, pass, i);
+                    return;
+                }
+            }
+        }
+        for (int k = 0; k < K; k++)
+            predictor_reset(p[k]);
+    }
+    for (int k = 0; k < K; k++)
+        predictor_destroy(p[k]);
+    printf("PASS: test_predictorInstances()\n");
+}
+
+void test_specializedKernels()
+{
+    PredictorConfig configs[] = {
+        {GSHARE, 10, 0, 0}, {GSHARE, 13, 0, 0}, {GSHARE, 20, 0, 0}, {GSHARE, 22, 0, 0},
+        {TOURNAMENT, 9, 10, 10}, {TOURNAMENT, 13, 11, 11}, {TOURNAMENT, 8, 9, 9},
+        {TOURNAMENT, 18, 16, 16}, {CUSTOM, 0, 0, 0}};
+    enum { N = 50000 };
+    static uint32_t pc[N];
+    static uint8_t outcome[N], expected[N], got[N];
+    uint32_t seed = 3;
+    for (int i = 0; i < N; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        pc[i] = 0x400000 + ((seed >> 16) & 0x3ff) * 4;
+        outcome[i] = (seed >> 8) % 4 != 0;
+    }
+
+    for (size_t k = 0; k < sizeof(configs) / sizeof(*configs); k++)
+    {
+        predictor_t *generic = predictor_create(&configs[k]);
+        predictor_t *special = predictor_create(&configs[k]);
+        if (special->run == predictor_run_generic)
+        {
+            printf("FAIL: no specialized kernel for config %d\n", (int)k);
+            return;
+        }
+        generic->run = predictor_run_generic;
+        // Two uneven batches, so state must carry across calls
+        uint64_t a = predictor_run(generic, pc, outcome, expected, N);
+        uint64_t b = predictor_run(special, pc, outcome, got, 1000);
+        b += predictor_run(special, pc + 1000, outcome + 1000, got + 1000, N - 1000);
+        if (a != b || memcmp(expected, got, N) != 0)
+        {
+            printf("FAIL: specialized kernel for config %d differs from generic\n", (int)k);
+            return;
+        }
+        predictor_destroy(generic);
+        predictor_destroy(special);
+    }
+    printf("PASS: test_specializedKernels()\n");
+}
+
+void test_profile()
+{
+    // Enough branches to fold the packed counts, over enough PCs to
+    // grow the table several times
+    enum { PCS = 5000, N = 3000000 };
+    static uint32_t pc[N];
+    static uint8_t outcome[N], prediction[N];
+    static uint64_t execs[PCS], taken[PCS], misses[PCS];
+    uint32_t seed = 11;
+    for (int i = 0; i < N; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t k = (seed >> 8) % PCS;
+        k = k * k / PCS; // skew towards low k
+        pc[i] = 0x400000 + k * 6;
+        outcome[i] = (seed >> 4) & 1;
+        prediction[i] = k % 3 == 0 ? outcome[i] : (seed >> 5) & 1;
+        execs[k]++;
+        taken[k] += outcome[i];
+        misses[k] += prediction[i] != outcome[i];
+    }
+
+    Profile *p = profile_create();
+    for (int i = 0; i < N; i += 65536)
+        profile_add(p, pc + i, outcome + i, prediction + i, N - i < 65536 ? N - i : 65536);
+
+    size_t distinct = 0;
+    for (int k = 0; k < PCS; k++)
+        distinct += execs[k] != 0;
+    if (profile_branches(p) != distinct)
+    {
+        printf("FAIL: profile has %zu branches, expected %zu\n", profile_branches(p), distinct);
+        return;
+    }
+
+    static ProfileEntry top[PCS];
+    size_t n = profile_top(p, top, PCS);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t k = (top[i].pc - 0x400000) / 6;
+        if (top[i].executions != execs[k] || top[i].taken != taken[k] ||
+            top[i].mispredictions != misses[k])
+        {
+            printf("FAIL: profile counts for 0x%x are wrong\n", top[i].pc);
+            return;
+        }
+        if (i > 0 && top[i].mispredictions > top[i - 1].mispredictions)
+        {
+            printf("FAIL: profile is not sorted by mispredictions\n");
+            return;
+        }
+    }
+    profile_destroy(p);
+    printf("PASS: test_profile()\n");
+}
+
+// Read 'path' after skipping 'skip' branches and compare with 'pc'
+// and 'outcome'
+//
+static int check_skip(const char *path, uint64_t skip, const uint32_t *pc,
+                      const uint8_t *outcome, int n)
+{
+    Trace *t = trace_open(path);
+    trace_skip(t, skip);
+    TraceBatch b;
+    int pos = skip < (uint64_t)n ? (int)skip : n;
+    while (trace_next(t, &b))
+    {
+        for (size_t i = 0; i < b.n; i++, pos++)
+        {
+            if (pos >= n || b.pc[i] != pc[pos] || b.outcome[i] != outcome[pos])
+            {
+                trace_close(t);
+                return 0;
+            }
+        }
+    }
+    trace_close(t);
+    return pos == n;
+}
+
+void test_textTrace()
+{
+    const char *path = "test_trace.txt";
+    // CRLF and LF endings mixed, upper case hex and no newline at the end
+    const char text[] = "0x40d7f9 1\r\n0x40D7FA 0\n0xa 1\r\n0x40d7fb 0";
+    uint32_t pc[] = {0x40d7f9, 0x40d7fa, 0xa, 0x40d7fb};
+    uint8_t outcome[] = {1, 0, 1, 0};
+    FILE *f = fopen(path, "wb");
+    fwrite(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+
+    int ok = check_skip(path, 0, pc, outcome, 4) && check_skip(path, 3, pc, outcome, 4);
+    remove(path);
+    if (!ok)
+    {
+        printf("FAIL: text trace with CRLF and an unterminated last line\n");
+        return;
+    }
+    printf("PASS: test_textTrace()\n");
+}
+
+// Write 'n' branches as a bzip2 compressed text trace
+static void write_bz2(const char *path, const uint32_t *pc, const uint8_t *outcome, int n)
+{
+    FILE *f = fopen(path, "wb");
+    int err;
+    BZFILE *bz = BZ2_bzWriteOpen(&err, f, 1, 0, 0);
+    char line[32];
+    for (int i = 0; i < n; i++)
+    {
+        int len = sprintf(line, "0x%x %d\n", pc[i], outcome[i]);
+        BZ2_bzWrite(&err, bz, line, len);
+    }
+    BZ2_bzWriteClose(&err, bz, 0, NULL, NULL);
+    fclose(f);
+}
+
+void test_bz2Trace()
+{
+    const char *path = "test_trace.bz2";
+    // More batches than the 8 of the ring in trace.c, so slots are reused
+    enum { N = 9 * TRACE_BATCH + 77 };
+    uint32_t *pc = malloc(N * sizeof(uint32_t));
+    uint8_t *outcome = malloc(N);
+    srand(17);
+    for (int i = 0; i < N; i++)
+    {
+        pc[i] = 0x400000 + (rand() % 512) * 4;
+        outcome[i] = rand() % 2;
+    }
+    write_bz2(path, pc, outcome, N);
+    int ok = check_skip(path, 0, pc, outcome, N) &&
+             check_skip(path, 2 * TRACE_BATCH + 5, pc, outcome, N);
+
+    // Closing early stops a producer that is decoding or asleep on a
+    // full ring
+    for (int k = 0; ok && k < 2; k++)
+    {
+        Trace *t = trace_open(path);
+        TraceBatch b;
+        ok = t != NULL && trace_next(t, &b) && b.n == TRACE_BATCH && b.pc[0] == pc[0];
+        if (k == 1)
+            usleep(200000);
+        if (t != NULL)
+            trace_close(t);
+    }
+    remove(path);
+    free(pc);
+    free(outcome);
+    if (!ok)
+    {
+        printf("FAIL: bzip2 trace\n");
+        return;
+    }
+    printf("PASS: test_bz2Trace()\n");
+}
+
+void test_traceSkip()
+{
+    const char *bin = "test_skip.bpt";
+    const char *text = "test_skip.txt";
+    const int n = 150000;
+    uint32_t *pc = malloc(n * sizeof(uint32_t));
+    uint8_t *outcome = malloc(n);
+    FILE *f = fopen(text, "w");
+    srand(2);
+    for (int i = 0; i < n; i++)
+    {
+        pc[i] = rand();
+        outcome[i] = rand() % 2;
+        fprintf(f, "0x%x %d\n", pc[i], outcome[i]);
+    }
+    fclose(f);
+    TraceWriter *w = traceWriter_open(bin);
+    traceWriter_append(w, pc, outcome, n);
+    traceWriter_close(w);
+
+    // Inside a word, on a batch boundary, past one, and past the end
+    uint64_t skips[] = {0, 1, 63, 65536, 100001, n, n + 5};
+    int ok = 1;
+    for (size_t k = 0; ok && k < sizeof(skips) / sizeof(*skips); k++)
+    {
+        if (!check_skip(bin, skips[k], pc, outcome, n) ||
+            !check_skip(text, skips[k], pc, outcome, n))
+        {
+            printf("FAIL: trace skip of %llu\n", (unsigned long long)skips[k]);
+            ok = 0;
+        }
+    }
+    if (ok)
+        printf("PASS: test_traceSkip()\n");
+    remove(bin);
+    remove(text);
+    free(pc);
+    free(outcome);
+}
+
+// Write a delta trace of one block of 'n' repeats of a single branch,
+// declaring 'n' branches per block
+//
+static void write_one_block(const char *path, uint32_t n)
+{
+    uint8_t tokens[8] = {0}; // delta 0, then repeat it n - 1 times
+    size_t len = 1;
+    for (uint64_t v = ((uint64_t)(n - 2) << 1) | 1; ; v >>= 7)
+    {
+        tokens[len++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        if (v < 0x80)
+            break;
+    }
+    size_t words = (n + 63) / 64;
+    uint64_t blockEnd = 48 + 8 * words + len;
+    uint64_t dictOffset = (blockEnd + 7) & ~7ull;
+    TraceDeltaHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_DELTA_MAGIC, sizeof(TRACE_DELTA_MAGIC));
+    h.version = TRACE_DELTA_VERSION;
+    h.block = n;
+    h.count = n;
+    h.dictOffset = dictOffset;
+    h.dictSize = 1;
+    h.blocks = 1;
+    h.indexOffset = dictOffset + 8;
+    uint64_t *bits = calloc(words, 8);
+    uint32_t dict[2] = {0x40d7f9, 0};
+    uint64_t index[2] = {48, blockEnd};
+    static const uint8_t pad[8];
+
+    FILE *f = fopen(path, "wb");
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(bits, 8, words, f);
+    fwrite(tokens, 1, len, f);
+    fwrite(pad, 1, dictOffset - blockEnd, f);
+    fwrite(dict, 4, 2, f);
+    fwrite(index, 8, 2, f);
+    fclose(f);
+    free(bits);
+}
+
+void test_deltaTrace()
+{
+    const char *path = "test_trace.bpd";
+    const int n = 200000; // spans several blocks
+    uint32_t *pc = malloc(n * sizeof(uint32_t));
+    uint8_t *outcome = malloc(n);
+    srand(3);
+    // Loops of a few branches, repeated branches and random ones,
+    // starting with repeats of the first dictionary entry
+    for (int i = 0; i < n; i++)
+    {
+        int phase = (i / 5000) % 3;
+        if (i < 10 || phase == 0)
+            pc[i] = 0x40d7f9;
+        else if (phase == 1)
+            pc[i] = 0x40d7f9 + (i % 4) * 0x25;
+        else
+            pc[i] = rand();
+        outcome[i] = rand() % 2;
+    }
+
+    TraceDeltaWriter *w = traceDeltaWriter_open(path);
+    traceDeltaWriter_append(w, pc, outcome, 70001);
+    traceDeltaWriter_append(w, pc + 70001, outcome + 70001, n - 70001);
+    int ok = traceDeltaWriter_close(w);
+
+    // Read back whole and from within and across blocks
+    uint64_t skips[] = {0, 1, 63, 65536, 100001, n, n + 5};
+    for (size_t k = 0; ok && k < sizeof(skips) / sizeof(*skips); k++)
+    {
+        if (!check_skip(path, skips[k], pc, outcome, n))
+        {
+            printf("FAIL: delta trace read after skipping %llu\n",
+                   (unsigned long long)skips[k]);
+            ok = 0;
+        }
+    }
+
+    // A truncated file is rejected
+    if (ok && truncate(path, 100) == 0 && trace_open(path) != NULL)
+    {
+        printf("FAIL: opened a truncated delta trace\n");
+        ok = 0;
+    }
+    // Blocks larger than a batch are rejected, as trace_next hands
+    // out a whole block at once
+    for (int k = 0; ok && k < 2; k++)
+    {
+        uint32_t block = k ? 2 * TRACE_BATCH : TRACE_BATCH;
+        write_one_block(path, block);
+        Trace *t = trace_open(path);
+        TraceBatch b;
+        if (k == 0 && (t == NULL || !trace_next(t, &b) || b.n != block))
+        {
+            printf("FAIL: delta trace of a single full block not read\n");
+            ok = 0;
+        }
+        else if (k == 1 && t != NULL)
+        {
+            printf("FAIL: opened a delta trace with %u branches per block\n", block);
+            ok = 0;
+        }
+        if (t != NULL)
+            trace_close(t);
+    }
+    remove(path);
+    free(pc);
+    free(outcome);
+    if (ok)
+        printf("PASS: test_deltaTrace()\n");
+}
+
+static int count_cached(const char *dir)
+{
+    int n = 0;
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL)
+        n += strstr(e->d_name, ".bpt") != NULL;
+    if (d != NULL)
+        closedir(d);
+    return n;
+}
+
+void test_traceCache()
+{
+    enum { N = 5000 };
+    const char *texts[] = {"test_cache_a.txt", "test_cache_b.txt"};
+    char dir[] = "/tmp/test_cacheXXXXXX";
+    static uint32_t pc[N];
+    static uint8_t outcome[N];
+    srand(13);
+    for (int i = 0; i < N; i++)
+    {
+        pc[i] = 0x400000 + (rand() % 256) * 4;
+        outcome[i] = rand() % 2;
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        FILE *f = fopen(texts[k], "w");
+        for (int i = 0; i < N; i++)
+            fprintf(f, "0x%x %d\n", pc[i] + k, outcome[i]);
+        fclose(f);
+    }
+    for (int i = 0; i < N; i++)
+        pc[i] += 1;
+
+    // The first open decodes into the cache, the second maps the copy
+    int ok = mkdtemp(dir) != NULL;
+    trace_cache_configure(dir, 1 << 20);
+    ok = ok && check_skip(texts[1], 0, pc, outcome, N) && count_cached(dir) == 1;
+    ok = ok && check_skip(texts[1], 17, pc, outcome, N) && count_cached(dir) == 1;
+
+    // Only the copy just added survives a limit too small for both
+    trace_cache_configure(dir, 1);
+    Trace *t = trace_open(texts[0]);
+    ok = ok && t != NULL && count_cached(dir) == 1;
+    if (t != NULL)
+        trace_close(t);
+    ok = ok && check_skip(texts[1], 0, pc, outcome, N);
+
+    trace_cache_configure(NULL, 0);
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL)
+        unlinkat(dirfd(d), e->d_name, 0);
+    if (d != NULL)
+        closedir(d);
+    rmdir(dir);
+    remove(texts[0]);
+    remove(texts[1]);
+    if (!ok)
+    {
+        printf("FAIL: trace cache\n");
+        return;
+    }
+    printf("PASS: test_traceCache()\n");
+}
+
+void test_predictorState()
+{
+    PredictorConfig configs[] = {
+        {GSHARE, 12, 0, 0}, {TOURNAMENT, 9, 10, 10}, {CUSTOM, 0, 0, 0}, {TAGE, 32, 0, 0}};
+    const char *path = "test_state.bps";
+    enum { N = 40000, HALF = 17777 };
+    static uint32_t pc[N];
+    static uint8_t outcome[N], expected[N], got[N];
+    uint32_t seed = 5;
+    for (int i = 0; i < N; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        pc[i] = 0x400000 + ((seed >> 16) & 0x3ff) * 4;
+        outcome[i] = (seed >> 8) % 4 != 0;
+    }
+
+    for (size_t k = 0; k < sizeof(configs) / sizeof(*configs); k++)
+    {
+        predictor_t *p = predictor_create(&configs[k]);
+        predictor_run(p, pc, outcome, expected, N);
+        predictor_destroy(p);
+
+        p = predictor_create(&configs[k]);
+        predictor_run(p, pc, outcome, got, HALF);
+        uint64_t position = 0;
+        if (!predictor_save(p, path, HALF))
+        {
+            printf("FAIL: unable to save predictor state\n");
+            return;
+        }
+        predictor_destroy(p);
+        p = predictor_load(path, &position);
+        if (p == NULL || position != HALF ||
+            predictor_config(p)->bpType != configs[k].bpType)
+        {
+            printf("FAIL: unable to load predictor state\n");
+            return;
+        }
+        predictor_run(p, pc + HALF, outcome + HALF, got + HALF, N - HALF);
+        predictor_destroy(p);
+        if (memcmp(expected, got, N) != 0)
+        {
+            printf("FAIL: restored predictor %d differs from the original\n", (int)k);
+            return;
+        }
+    }
+
+    // Registers out of range for the configuration are masked on load,
+    // as they index the tables
+    PredictorConfig tournament = {TOURNAMENT, 9, 10, 10};
+    predictor_t *bad = predictor_create(&tournament);
+    bad->choice->ghistory = 0xffffffff;
+    for (int i = 0; i < getTableSize(tournament.pcIndexBits); i++)
+        bad->choice->lhist->hist_table[i] = -1;
+    bool saved = predictor_save(bad, path, 0);
+    predictor_destroy(bad);
+    bad = saved ? predictor_load(path, NULL) : NULL;
+    bool masked = bad != NULL && bad->choice->ghistory == getLowerNBits(~0u, 9);
+    for (int i = 0; masked && i < getTableSize(tournament.pcIndexBits); i++)
+        masked = bad->choice->lhist->hist_table[i] == (int)getLowerNBits(~0u, 10);
+    if (!masked)
+    {
+        printf("FAIL: loaded history registers out of range\n");
+        return;
+    }
+    predictor_run(bad, pc, outcome, NULL, N);
+    predictor_destroy(bad);
+
+    // So is one whose sizes are out of range, before anything is
+    // allocated for them, as is the same size on the command line
+    PredictorStateHeader h;
+    FILE *f = fopen(path, "r+b");
+    int ok = f != NULL && fread(&h, sizeof(h), 1, f) == 1;
+    h.bpType = GSHARE;
+    h.ghistoryBits = 60;
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    if (f != NULL)
+        fclose(f);
+    PredictorConfig parsed;
+    if (!ok || predictor_load(path, NULL) != NULL || config_parse("gshare:60", &parsed) ||
+        config_parse("tournament:9:10:0", &parsed))
+    {
+        printf("FAIL: accepted a predictor with 60 bits of history\n");
+        return;
+    }
+
+    // A truncated snapshot is rejected
+    truncate(path, 100);
+    if (predictor_load(path, NULL) != NULL)
+    {
+        printf("FAIL: loaded a truncated snapshot\n");
+        return;
+    }
+    remove(path);
+    printf("PASS: test_predictorState()\n");
+}
+
+void test_sampling()
+{
+    enum { N = 30000 };
+    static uint32_t pc[N];
+    static uint8_t outcome[N];
+    uint32_t seed = 5;
+    for (int i = 0; i < N; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        pc[i] = 0x400000 + ((seed >> 16) & 0x3f) * 4;
+        outcome[i] = (seed >> 8) % 3 != 0;
+    }
+
+    PredictorConfig configs[] = {
+        {GSHARE, 13, 0, 0},
+        {TOURNAMENT, 9, 10, 10},
+        {CUSTOM, 0, 0, 0},
+    };
+    for (int c = 0; c < 3; c++)
+    {
+        // Fast-forwarding leaves the same history registers as a full run
+        predictor_t *full = predictor_create(&configs[c]);
+        predictor_t *ff = predictor_create(&configs[c]);
+        predictor_run(full, pc, outcome, NULL, N);
+        predictor_advance(ff, pc, outcome, 1000);
+        predictor_advance(ff, pc + 1000, outcome + 1000, N - 1000);
+        uint64_t hfull[3] = {0}, hff[3] = {0};
+        predictor_registers(full, hfull, true);
+        predictor_registers(ff, hff, true);
+        bool same = memcmp(hfull, hff, sizeof(hfull)) == 0;
+        if (configs[c].bpType == TOURNAMENT)
+        {
+            Lhist *a = full->choice->lhist, *b = ff->choice->lhist;
+            same = same && memcmp(a->hist_table, b->hist_table,
+                                  getTableSize(a->pc_bits) * sizeof(int)) == 0;
+        }
+        predictor_destroy(full);
+        predictor_destroy(ff);
+        if (!same)
+        {
+            printf("FAIL: predictor_advance history differs for predictor %d\n", configs[c].bpType);
+            return;
+        }
+
+        // Without fast-forward or warmup every branch is measured
+        SampleSpec all = {0, 0, 1000};
+        Sampler s;
+        sampler_init(&s, &all);
+        predictor_t *p = predictor_create(&configs[c]);
+        for (int i = 0; i < N; i += 777)
+            sampler_run(&s, p, pc + i, outcome + i, i + 777 < N ? 777 : N - i);
+        predictor_destroy(p);
+        p = predictor_create(&configs[c]);
+        uint64_t expected = predictor_run(p, pc, outcome, NULL, N);
+        predictor_destroy(p);
+        if (s.samples != N / 1000 || s.measured != N || s.mispredictions != expected)
+        {
+            printf("FAIL: sampler measured %llu mispredictions, expected %llu\n",
+                   (unsigned long long)s.mispredictions, (unsigned long long)expected);
+            return;
+        }
+    }
+
+    // Regions split across calls count the same as one call
+    SampleSpec spec = {3000, 500, 1500};
+    PredictorConfig *c = &configs[1];
+    Sampler one, split;
+    sampler_init(&one, &spec);
+    sampler_init(&split, &spec);
+    predictor_t *p = predictor_create(c);
+    sampler_run(&one, p, pc, outcome, N);
+    predictor_destroy(p);
+    p = predictor_create(c);
+    for (int i = 0; i < N; i += 1234)
+        sampler_run(&split, p, pc + i, outcome + i, i + 1234 < N ? 1234 : N - i);
+    predictor_destroy(p);
+    double interval;
+    if (one.samples != N / 5000 || one.measured != split.measured ||
+        one.mispredictions != split.mispredictions ||
+        sampler_rate(&one, &interval) <= 0 || interval <= 0)
+    {
+        printf("FAIL: sampler results depend on batch boundaries\n");
+        return;
+    }
+    printf("PASS: test_sampling()\n");
+}
+
+void test_series()
+{
+    enum { N = 50000, WINDOW = 3000 };
+    uint32_t *pc = malloc(N * sizeof(uint32_t));
+    uint8_t *outcome = malloc(N);
+    srand(5);
+    for (int i = 0; i < N; i++)
+    {
+        pc[i] = 0x400000 + (rand() % 64) * 4;
+        outcome[i] = (pc[i] >> 2) % 3 ? rand() % 8 != 0 : rand() % 2;
+    }
+
+    // The batch loops count components exactly as lookup/apply does
+    PredictorConfig configs[] = {{TOURNAMENT, 9, 10, 10}, {TOURNAMENT, 7, 6, 5}, {CUSTOM, 0, 0, 0}};
+    for (int k = 0; k < 3; k++)
+    {
+        predictor_t *batch = predictor_create(&configs[k]);
+        predictor_t *single = predictor_create(&configs[k]);
+        predictor_run(batch, pc, outcome, NULL, N);
+        for (int i = 0; i < N; i++)
+            predictor_predict_and_update(single, pc[i], outcome[i]);
+        PredictorComponents a, b;
+        predictor_components(batch, &a);
+        predictor_components(single, &b);
+        predictor_destroy(batch);
+        predictor_destroy(single);
+        if (memcmp(&a, &b, sizeof(a)) || a.picks[0] + a.picks[1] != N)
+        {
+            printf("FAIL: components of config %d differ: %llu/%llu picks vs %llu/%llu\n", k,
+                   (unsigned long long)a.picks[0], (unsigned long long)a.picks[1],
+                   (unsigned long long)b.picks[0], (unsigned long long)b.picks[1]);
+            free(pc);
+            free(outcome);
+            return;
+        }
+    }
+
+    // Windows add up to the whole run however the batches fall
+    FILE *f = tmpfile();
+    predictor_t *p = predictor_create(&configs[0]);
+    Series series;
+    series_init(&series, p, WINDOW, 7, f, 1);
+    uint64_t total = 0;
+    for (int i = 0; i < N; i += 4999)
+        total += series_run(&series, p, pc + i, outcome + i, NULL, N - i < 4999 ? N - i : 4999);
+    series_finish(&series, p);
+    PredictorComponents all;
+    predictor_components(p, &all);
+    predictor_destroy(p);
+    free(pc);
+    free(outcome);
+
+    rewind(f);
+    char header[40];
+    SeriesRecord r;
+    uint64_t branches = 0, misses = 0, picks = 0, windows = 0, next = 7;
+    int ok = fread(header, sizeof(header), 1, f) == 1 && !memcmp(header, SERIES_MAGIC, 8);
+    while (ok && fread(&r, sizeof(r), 1, f) == 1)
+    {
+        ok = r.start == next && (r.branches == WINDOW || next + r.branches == 7 + N);
+        next += r.branches;
+        branches += r.branches;
+        misses += r.mispredictions;
+        picks += r.picks[0];
+        windows++;
+    }
+    fclose(f);
+    if (!ok || branches != N || misses != total || picks != all.picks[0] ||
+        windows != (N + WINDOW - 1) / WINDOW)
+    {
+        printf("FAIL: series of %llu windows holds %llu branches and %llu mispredictions\n",
+               (unsigned long long)windows, (unsigned long long)branches,
+               (unsigned long long)misses);
+        return;
+    }
+    printf("PASS: test_series()\n");
+}
+
+void test_chunks()
+{
+    enum { N = 40000 };
+    static uint32_t pc[N];
+    static uint8_t outcome[N];
+    uint32_t seed = 9;
+    for (int i = 0; i < N; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        pc[i] = 0x400000 + ((seed >> 16) & 0xff) * 4;
+        outcome[i] = (seed >> 8) % 3 != 0;
+    }
+    TraceData data = {pc, outcome, N};
+
+    PredictorConfig configs[] = {
+        {GSHARE, 13, 0, 0},
+        {TOURNAMENT, 9, 10, 10},
+        {CUSTOM, 0, 0, 0},
+    };
+    for (int c = 0; c < 3; c++)
+    {
+        uint64_t sequential = sim_run(&configs[c], &data);
+        // Warming every chunk on the whole prefix reproduces the
+        // sequential run exactly, as does a single chunk
+        uint64_t full = sim_run_chunks(&configs[c], &data, 7, N, 3);
+        uint64_t one = sim_run_chunks(&configs[c], &data, 1, 0, 2);
+        if (full != sequential || one != sequential)
+        {
+            printf("FAIL: chunked predictor %d gave %llu/%llu, sequential %llu\n",
+                   configs[c].bpType, (unsigned long long)full, (unsigned long long)one,
+                   (unsigned long long)sequential);
+            return;
+        }
+    }
+    printf("PASS: test_chunks()\n");
+}
+
+void test_simMatrix()
+{
+    enum { N = 30000 };
+    const char *paths[] = {"test_matrix_a.bpt", "test_matrix_missing.bpt", "test_matrix_b.bpt"};
+    static uint32_t pc[N];
+    static uint8_t outcome[N];
+    srand(11);
+    for (int i = 0; i < N; i++)
+    {
+        pc[i] = 0x400000 + (rand() % 128) * 4;
+        outcome[i] = (pc[i] >> 2) % 5 ? rand() % 6 != 0 : rand() % 2;
+    }
+    // The second trace is the second half of the first
+    TraceWriter *w = traceWriter_open(paths[0]);
+    traceWriter_append(w, pc, outcome, N);
+    traceWriter_close(w);
+    w = traceWriter_open(paths[2]);
+    traceWriter_append(w, pc + N / 2, outcome + N / 2, N - N / 2);
+    traceWriter_close(w);
+
+    PredictorConfig configs[] = {{GSHARE, 13, 0, 0}, {TOURNAMENT, 9, 10, 10}, {CUSTOM, 0, 0, 0}};
+    SimResult results[3 * 3];
+    sim_run_matrix(paths, 3, configs, 3, 2, results);
+    remove(paths[0]);
+    remove(paths[2]);
+
+    TraceData halves[] = {{pc, outcome, N}, {pc + N / 2, outcome + N / 2, N - N / 2}};
+    for (int c = 0; c < 3; c++)
+    {
+        SimResult *a = &results[c], *missing = &results[3 + c], *b = &results[6 + c];
+        if (a->failed || b->failed || !missing->failed || a->branches != N ||
+            b->branches != N - N / 2 || a->mispredictions != sim_run(&configs[c], &halves[0]) ||
+            b->mispredictions != sim_run(&configs[c], &halves[1]))
+        {
+            printf("FAIL: matrix run of config %d gave %llu and %llu mispredictions\n", c,
+                   (unsigned long long)a->mispredictions, (unsigned long long)b->mispredictions);
+            return;
+        }
+    }
+    printf("PASS: test_simMatrix()\n");
+}
+
+void test_tage()
+{
+    // The budget picks the largest tables that fit, from the smallest
+    // budget up to the one that fills the largest tables
+    int largest = (int)(tage_storage_bits(TAGE_MAX_TABLE_BITS + 1) / 1024);
+    int budgets[] = {PREDICTOR_MIN_TAGE_KBITS, 16, 64, 256, largest};
+    for (int b = 0; b < 5; b++)
+    {
+        PredictorConfig c = {TAGE, budgets[b], 0, 0};
+        int bits = tage_table_bits(budgets[b]);
+        if (!predictor_config_valid(&c) || predictor_config_capped(&c) ||
+            tage_storage_bits(bits) > (uint64_t)budgets[b] * 1024 ||
+            tage_storage_bits(bits + 1) <= (uint64_t)budgets[b] * 1024)
+        {
+            printf("FAIL: tage:%d uses %d table bits\n", budgets[b], bits);
+            return;
+        }
+    }
+
+    // Budgets below the smallest tables are rejected, and those past
+    // the largest are reported as capped
+    PredictorConfig small = {TAGE, PREDICTOR_MIN_TAGE_KBITS - 1, 0, 0};
+    PredictorConfig large = {TAGE, largest + 1, 0, 0};
+    PredictorConfig most = {TAGE, PREDICTOR_MAX_TAGE_KBITS, 0, 0};
+    if (predictor_config_valid(&small) || !predictor_config_capped(&large) ||
+        !predictor_config_capped(&most) ||
+        predictor_storage_bits(&most) != tage_storage_bits(TAGE_MAX_TABLE_BITS))
+    {
+        printf("FAIL: TAGE budgets out of range are not caught\n");
+        return;
+    }
+
+    // Every folded register matches folding its window directly
+    PredictorConfig c = {TAGE, 64, 0, 0};
+    predictor_t *p = predictor_create(&c);
+    Tage *t = p->tage;
+    uint32_t seed = 3;
+    for (int n = 0; n < 5000; n++)
+    {
+        seed = seed * 1103515245 + 12345;
+        tage_add_history(t, seed >> 10, (seed >> 8) % 3 != 0);
+    }
+    TageHistory *h = t->hist;
+    for (int i = 0; i < TAGE_TABLES; i++)
+    {
+        int width[3] = {t->tableBits, tage_tag_bits[i], tage_tag_bits[i] - 1};
+        for (int k = 0; k < 3; k++)
+        {
+            uint32_t expected = 0;
+            for (int age = 0; age < tage_history_length[i]; age++)
+            {
+                uint32_t bit = h->buffer[(h->head + age) & (TAGE_HIST_BUFFER - 1)];
+                expected ^= bit << (age % width[k]);
+            }
+            uint32_t value = h->fold[k * TAGE_TABLES + i];
+            if (value != expected)
+            {
+                printf("FAIL: folded history %d of table %d is %x, expected %x\n",
+                       k, i, value, expected);
+                predictor_destroy(p);
+                return;
+            }
+        }
+    }
+    predictor_destroy(p);
+
+    // A loop too long for a 64-bit history is learnt
+    enum { N = 200000 };
+    p = predictor_create(&c);
+    uint64_t late = 0;
+    for (int i = 0; i < N; i++)
+    {
+        uint8_t outcome = i % 200 != 199;
+        uint8_t pred = predictor_predict_and_update(p, 0x400100, outcome);
+        late += i >= N / 2 && pred != outcome;
+    }
+    predictor_destroy(p);
+    if (late != 0)
+    {
+        printf("FAIL: tage mispredicted a 200 iteration loop %llu times\n",
+               (unsigned long long)late);
+        return;
+    }
+    printf("PASS: test_tage()\n");
+}
+
+void test_storage()
+{
+    PredictorConfig gshare = {GSHARE, 13, 0, 0};
+    PredictorConfig tournament = {TOURNAMENT, 9, 10, 10};
+    PredictorConfig custom = {CUSTOM, 0, 0, 0};
+    PredictorConfig tage = {TAGE, 64, 0, 0};
+    // 2^13 counters and 13 history bits
+    if (predictor_storage_bits(&gshare) != 16384 + 13)
+    {
+        printf("FAIL: gshare:13 counted as %llu bits\n",
+               (unsigned long long)predictor_storage_bits(&gshare));
+        return;
+    }
+    // choice and global counters, history, 1024 10-bit local histories
+    // and 1024 local counters
+    if (predictor_storage_bits(&tournament) != 1024 + 1024 + 9 + 10240 + 2048)
+    {
+        printf("FAIL: tournament:9:10:10 counted as %llu bits\n",
+               (unsigned long long)predictor_storage_bits(&tournament));
+        return;
+    }
+    // The course limit for the custom predictor
+    if (predictor_storage_bits(&custom) > 64 * 1024 + 256 ||
+        predictor_storage_bits(&tage) > 64 * 1024)
+    {
+        printf("FAIL: custom or tage:64 exceeds its budget\n");
+        return;
+    }
+
+    const char *budgets[] = {"64Kbit", "64K", "65536", "8KB", "8Kbytes", "65536bits"};
+    for (int i = 0; i < 6; i++)
+    {
+        if (tune_parse_budget(budgets[i]) != 65536)
+        {
+            printf("FAIL: budget %s parsed as %llu\n", budgets[i],
+                   (unsigned long long)tune_parse_budget(budgets[i]));
+            return;
+        }
+    }
+    if (tune_parse_budget("64Kfoo") != 0 || tune_parse_budget("") != 0)
+    {
+        printf("FAIL: accepted a malformed budget\n");
+        return;
+    }
+
+    PredictorConfig *list = NULL;
+    int n = 0;
+    tune_candidates(65536, &list, &n);
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t bits = predictor_storage_bits(&list[i]);
+        if (bits > 65536 || bits < 65536 / 4)
+        {
+            printf("FAIL: candidate of %llu bits for a 64Kbit budget\n", (unsigned long long)bits);
+            free(list);
+            return;
+        }
+    }
+    free(list);
+    if (n == 0)
+    {
+        printf("FAIL: no candidates for a 64Kbit budget\n");
+        return;
+    }
+    printf("PASS: test_storage()\n");
+}
+
+// Append a request to 'f'
+static void server_request(FILE *f, uint32_t command, uint32_t id,
+                           const void *payload, uint32_t length)
+{
+    ServerHeader h = {command, id, length};
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(payload, 1, length, f);
+}
+
+void test_server()
+{
+    enum { N = 1000 };
+    uint8_t batch[4 + N * 4 + (N + 7) / 8];
+    uint32_t n = N;
+    uint32_t *pc = (uint32_t *)(batch + 4);
+    uint8_t *bits = batch + 4 + N * 4;
+    uint8_t outcome[N];
+    memcpy(batch, &n, 4);
+    memset(bits, 0, (N + 7) / 8);
+    for (int i = 0; i < N; i++)
+    {
+        pc[i] = 0x400000 + (i % 7) * 4;
+        outcome[i] = (i % 7) < 3 || (i % 5) == 0;
+        bits[i / 8] |= outcome[i] << (i % 8);
+    }
+
+    // Requests are read from one file and replies written to another
+    FILE *in = tmpfile();
+    FILE *out = tmpfile();
+    server_request(in, SERVER_CREATE, 0, "gshare:13", 9);
+    server_request(in, SERVER_PREDICT, 1, batch, sizeof(batch));
+    server_request(in, SERVER_STATS, 1, NULL, 0);
+    server_request(in, SERVER_RESET, 1, NULL, 0);
+    server_request(in, SERVER_STATS, 1, NULL, 0);
+    server_request(in, SERVER_PREDICT, 7, batch, sizeof(batch));
+    server_request(in, SERVER_SHUTDOWN, 0, NULL, 0);
+    fflush(in);
+    rewind(in);
+
+    PredictorConfig c = {STATIC, 0, 0, 0};
+    Server *server = server_create(&c);
+    int stopped = server_serve(server, fileno(in), fileno(out));
+    server_destroy(server);
+    fflush(out);
+    rewind(out);
+
+    uint32_t expected[] = {SERVER_OK, SERVER_OK, SERVER_OK, SERVER_OK, SERVER_OK,
+                           SERVER_BAD_ID, SERVER_OK};
+    uint8_t reply[4 + (N + 7) / 8];
+    uint32_t id = 0;
+    uint32_t mispredictions = 0;
+    ServerStats before, after;
+    for (int r = 0; r < 7; r++)
+    {
+        ServerHeader h;
+        if (fread(&h, sizeof(h), 1, out) != 1 || h.command != expected[r] ||
+            h.length > sizeof(reply) || fread(reply, 1, h.length, out) != h.length)
+        {
+            printf("FAIL: server reply %d is malformed\n", r);
+            fclose(in);
+            fclose(out);
+            return;
+        }
+        if (r == 0)
+            memcpy(&id, reply, 4);
+        if (r == 1)
+            memcpy(&mispredictions, reply, 4);
+        if (r == 2)
+            memcpy(&before, reply, sizeof(before));
+        if (r == 4)
+            memcpy(&after, reply, sizeof(after));
+        if (r == 1)
+            memcpy(bits, reply + 4, (N + 7) / 8);
+    }
+    fclose(in);
+    fclose(out);
+
+    // The served predictions match a local predictor
+    PredictorConfig g = {GSHARE, 13, 0, 0};
+    predictor_t *p = predictor_create(&g);
+    uint8_t predictions[N];
+    uint64_t local = predictor_run(p, pc, outcome, predictions, N);
+    predictor_destroy(p);
+    for (int i = 0; i < N; i++)
+    {
+        if (((bits[i / 8] >> (i % 8)) & 1) != predictions[i])
+        {
+            printf("FAIL: served prediction %d differs\n", i);
+            return;
+        }
+    }
+    if (!stopped || id != 1 || mispredictions != local || before.batches != 1 ||
+        before.branches != N || before.mispredictions != local || after.branches != 0)
+    {
+        printf("FAIL: server returned id %u, %u mispredictions and %llu branches\n",
+               id, mispredictions, (unsigned long long)before.branches);
+        return;
+    }
+    printf("PASS: test_server()\n");
+}
+
+void test_packedPredictions()
+{
+    const char *path = "test_predictions.bpp";
+    enum { N = 100003 };
+    uint8_t *predictions = malloc(N);
+    uint8_t *outcome = malloc(N);
+    srand(9);
+    for (int i = 0; i < N; i++)
+    {
+        predictions[i] = rand() % 2;
+        outcome[i] = rand() % 2;
+    }
+
+    // Batches that do not end on a byte boundary
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    PredictionWriter *w = predictionWriter_open(fd, PREDICTIONS_CORRECT);
+    predictionWriter_append(w, predictions, outcome, 13);
+    predictionWriter_append(w, predictions + 13, outcome + 13, 65536);
+    predictionWriter_append(w, predictions + 65549, outcome + 65549, N - 65549);
+    int ok = predictionWriter_close(w);
+    close(fd);
+
+    PredictionReader *r = predictionReader_open(path);
+    const uint8_t *pred, *correct;
+    size_t n, total = 0;
+    ok = ok && r != NULL && predictionReader_flags(r) == PREDICTIONS_CORRECT;
+    while (ok && (n = predictionReader_next(r, &pred, &correct)) > 0)
+    {
+        for (size_t i = 0; ok && i < n && total + i < N; i++)
+            ok = pred[i] == predictions[total + i] &&
+                 correct[i] == (predictions[total + i] == outcome[total + i]);
+        total += n;
+    }
+    if (r != NULL)
+        predictionReader_close(r);
+    remove(path);
+
+    // The text matches the "%d\n" lines of --verbose
+    char text[2 * 16 + 1], expect[2 * 16 + 1];
+    size_t len = predictions_format_text(predictions, 16, text);
+    for (int i = 0; i < 16; i++)
+        sprintf(expect + 2 * i, "%d\n", predictions[i]);
+    free(predictions);
+    free(outcome);
+    if (!ok || total != N || len != 32 || memcmp(text, expect, len))
+    {
+        printf("FAIL: packed predictions read back %llu of %d branches\n",
+               (unsigned long long)total, N);
+        return;
+    }
+    printf("PASS: test_packedPredictions()\n");
+}
+
 int main()
 {
     test_getLowerNBits();
     test_Counter();
+    test_packedCounter();
     test_Bimodal();
     test_gshare();
+    test_fusedUpdate();
+    test_predictorInstances();
+    test_specializedKernels();
+    test_predictorState();
+    test_perceptronKernels();
+    test_binaryTrace();
+    test_textTrace();
+    test_bz2Trace();
+    test_traceSkip();
+    test_deltaTrace();
+    test_traceCache();
+    test_pool();
+    test_profile();
+    test_sampling();
+    test_series();
+    test_chunks();
+    test_simMatrix();
+    test_tage();
+    test_storage();
+    test_server();
+    test_packedPredictions();
 }
\ No newline at end of file
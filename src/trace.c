@@ -0,0 +1,1413 @@
+//========================================================//
+//  trace.c                                               //
+//  Source file for branch trace input                    //
+//                                                        //
+//  Text traces are read in large blocks and parsed with  //
+//  a branch-free hex decoder. bzip2 traces are inflated  //
+//  and parsed on a producer thread. Binary traces are    //
+//  mmap'd and handed out straight from the mapping, and  //
+//  delta traces are decoded from it a block at a time.   //
+//  Decoded text and bzip2 traces may be kept in a cache  //
+//  directory as binary traces                            //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <bzlib.h>
+#include "trace.h"
+
+enum { TRACE_TEXT, TRACE_BINARY, TRACE_BZ2, TRACE_DELTA };
+
+// Size of one read() from a text trace
+#define TRACE_CHUNK (1 << 20)
+
+// Slack kept in front of the text buffer so the decoder can load
+// a full 8 bytes ending at any digit
+#define TRACE_PAD 8
+
+// Parsed batches in flight between the bzip2 producer and the
+// simulator. Must be a power of two
+#define TRACE_RING 8
+
+struct TraceSlot
+{
+  uint32_t pc[TRACE_BATCH];
+  uint8_t outcome[TRACE_BATCH];
+  size_t n; // 0 marks the end of the trace
+};
+typedef struct TraceSlot TraceSlot;
+
+struct Trace
+{
+  int format;
+
+  // Text traces
+  int fd;
+  int eof;
+  char *buf;
+  size_t buf_cap;
+  char *head;        // first unparsed byte
+  char *tail;        // end of valid data
+  char *line;        // NUL terminated copy for the slow path
+  size_t line_cap;
+  uint32_t last_pc;  // values a failed parse leaves in place
+  uint32_t last_outcome;
+
+  // bzip2 traces. The ring is single-producer/single-consumer:
+  // only the producer advances ring_head and only the consumer
+  // advances ring_tail
+  FILE *bzfile;
+  BZFILE *bz;
+  pthread_t producer;
+  TraceSlot *ring;
+  uint64_t ring_head;
+  uint64_t ring_tail;
+  int ring_stop;
+  int holding; // consumer is reading slot ring_tail
+
+  // A side that finds the ring full or empty for long sleeps on
+  // ring_cond, and the other side wakes it when it moves
+  pthread_mutex_t ring_lock;
+  pthread_cond_t ring_cond;
+  int ring_waiters;
+
+  // Binary traces
+  void *map;
+  size_t map_len;
+  const uint32_t *pcs;
+  const uint64_t *bits;
+  uint64_t count;
+  uint64_t pos;
+
+  // Delta traces, which share the mapping, count and position
+  const uint32_t *dict;
+  uint32_t dict_size;
+  const uint64_t *offsets;
+  uint32_t block;
+
+  // Branches still to drop from the front of the next batches
+  uint64_t skip;
+
+  // Batch storage
+  uint32_t *pc_buf;
+  uint8_t *outcome_buf;
+
+  TraceStats stats;
+};
+
+// Nibble value of each character, 0xFF if it is not a hex digit.
+// Traces are opened on pool threads, so it is filled in once
+static uint8_t hexval[256];
+static pthread_once_t hexvalOnce = PTHREAD_ONCE_INIT;
+
+static void
+hexval_init()
+{
+  memset(hexval, 0xFF, sizeof(hexval));
+  for (int i = 0; i < 10; i++) {
+    hexval['0' + i] = i;
+  }
+  for (int i = 0; i < 6; i++) {
+    hexval['a' + i] = 10 + i;
+    hexval['A' + i] = 10 + i;
+  }
+}
+
+static uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+align8(size_t v)
+{
+  return (v + 7) & ~(size_t)7;
+}
+
+// Map a binary trace and validate its header
+//
+// Returns True if Successful
+//
+static int
+trace_map_binary(Trace *t, int fd, size_t size)
+{
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+
+  const TraceBinHeader *h = (const TraceBinHeader *)map;
+  size_t bits_off = align8(sizeof(TraceBinHeader) + 4 * h->count);
+  if (h->version != TRACE_BIN_VERSION ||
+      bits_off + 8 * ((h->count + 63) / 64) > size) {
+    fprintf(stderr, "Corrupt binary trace\n");
+    munmap(map, size);
+    return 0;
+  }
+
+  madvise(map, size, MADV_SEQUENTIAL);
+  t->map = map;
+  t->map_len = size;
+  t->count = h->count;
+  t->pcs = (const uint32_t *)((const char *)map + sizeof(TraceBinHeader));
+  t->bits = (const uint64_t *)((const char *)map + bits_off);
+  return 1;
+}
+
+// Map a delta trace and validate its header, dictionary and index
+//
+// Returns True if Successful
+//
+static int
+trace_map_delta(Trace *t, int fd, size_t size)
+{
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+
+  const TraceDeltaHeader *h = (const TraceDeltaHeader *)map;
+  // A block is handed out by a single trace_next, so it may not hold
+  // more than a batch
+  int ok = h->version == TRACE_DELTA_VERSION && h->block > 0 &&
+           h->block <= TRACE_BATCH && (h->dictSize > 0 || h->count == 0) &&
+           h->blocks == (h->count + h->block - 1) / h->block &&
+           h->dictOffset % 4 == 0 && h->dictOffset <= size &&
+           (size - h->dictOffset) / 4 >= h->dictSize &&
+           h->indexOffset % 8 == 0 && h->indexOffset <= size &&
+           (size - h->indexOffset) / 8 > h->blocks;
+  const uint64_t *offsets = (const uint64_t *)((const char *)map + h->indexOffset);
+  for (uint32_t b = 0; ok && b < h->blocks; b++) {
+    uint64_t n = b + 1 < h->blocks ? h->block : h->count - (uint64_t)b * h->block;
+    ok = offsets[b] % 8 == 0 && offsets[b] <= offsets[b + 1] &&
+         offsets[b + 1] <= size &&
+         offsets[b + 1] - offsets[b] >= 8 * ((n + 63) / 64);
+  }
+  if (!ok) {
+    fprintf(stderr, "Corrupt delta trace\n");
+    munmap(map, size);
+    return 0;
+  }
+
+  madvise(map, size, MADV_SEQUENTIAL);
+  t->map = map;
+  t->map_len = size;
+  t->count = h->count;
+  t->dict = (const uint32_t *)((const char *)map + h->dictOffset);
+  t->dict_size = h->dictSize;
+  t->offsets = offsets;
+  t->block = h->block;
+  return 1;
+}
+
+//------------------------------------//
+//         Text Trace Parsing         //
+//------------------------------------//
+
+// Read up to 'max' bytes of decompressed bzip2 data. Concatenated
+// streams, as written by parallel bzip2 tools, are followed
+//
+static ssize_t
+trace_read_bz2(Trace *t, char *dst, size_t max)
+{
+  while (t->bz != NULL) {
+    int err;
+    int got = BZ2_bzRead(&err, t->bz, dst, max);
+    if (err == BZ_OK && got > 0) {
+      return got;
+    }
+    if (err != BZ_STREAM_END) {
+      if (err != BZ_OK) {
+        fprintf(stderr, "Error decompressing trace (bzip2 error %d)\n", err);
+      }
+      BZ2_bzReadClose(&err, t->bz);
+      t->bz = NULL;
+      return -1;
+    }
+
+    // Restart on whatever followed the end of this stream
+    void *unused;
+    int nunused;
+    char rest[BZ_MAX_UNUSED];
+    BZ2_bzReadGetUnused(&err, t->bz, &unused, &nunused);
+    memcpy(rest, unused, nunused);
+    BZ2_bzReadClose(&err, t->bz);
+    t->bz = NULL;
+    if (nunused > 0 || !feof(t->bzfile)) {
+      t->bz = BZ2_bzReadOpen(&err, t->bzfile, 0, 0, rest, nunused);
+      if (err != BZ_OK) {
+        BZ2_bzReadClose(&err, t->bz);
+        t->bz = NULL;
+      }
+    }
+    if (got > 0) {
+      return got;
+    }
+  }
+  return 0;
+}
+
+static ssize_t
+trace_read_chunk(Trace *t, char *dst, size_t max)
+{
+  if (t->format == TRACE_BZ2) {
+    return trace_read_bz2(t, dst, max);
+  }
+
+  ssize_t got;
+  do {
+    got = read(t->fd, dst, max);
+  } while (got < 0 && errno == EINTR);
+  return got;
+}
+
+// Move the unparsed tail to the front of the buffer and read the
+// next chunk behind it
+//
+// Returns False at the end of input
+//
+static int
+trace_fill(Trace *t)
+{
+  size_t carry = t->tail - t->head;
+  if (TRACE_PAD + carry + TRACE_CHUNK > t->buf_cap) {
+    // A line longer than a chunk, only seen in malformed traces
+    t->buf_cap = TRACE_PAD + carry + TRACE_CHUNK;
+    char *buf = (char *)malloc(t->buf_cap);
+    memcpy(buf + TRACE_PAD, t->head, carry);
+    free(t->buf);
+    t->buf = buf;
+  } else {
+    memmove(t->buf + TRACE_PAD, t->head, carry);
+  }
+  t->head = t->buf + TRACE_PAD;
+  t->tail = t->head + carry;
+
+  ssize_t got = trace_read_chunk(t, t->tail, TRACE_CHUNK);
+  if (got <= 0) {
+    return 0;
+  }
+  t->tail += got;
+  t->stats.bytes += got;
+  return 1;
+}
+
+// Parse anything that is not a well formed "0x<1-8 hex> <digit>"
+// line with sscanf, exactly as the original reader did
+//
+static void
+trace_parse_slow(Trace *t, const char *line, size_t len)
+{
+  if (len + 1 > t->line_cap) {
+    t->line_cap = len + 1;
+    t->line = (char *)realloc(t->line, t->line_cap);
+  }
+  memcpy(t->line, line, len);
+  t->line[len] = '\0';
+  sscanf(t->line, "0x%x %d\n", &t->last_pc, &t->last_outcome);
+}
+
+// Parse one line, without its newline, into the PC and outcome
+//
+static void
+trace_parse_line(Trace *t, const char *line, size_t len, uint32_t *pc,
+                 uint8_t *outcome)
+{
+  size_t k = len - 4; // number of hex digits
+  if (len >= 5 && len <= 12 && line[0] == '0' && line[1] == 'x' &&
+      line[len - 2] == ' ' && line[len - 1] >= '0' && line[len - 1] <= '9') {
+    // Decode the 8 bytes ending at the last digit. Bytes in front of
+    // the digits are masked to zero, so there is no data dependent
+    // branch per character
+    const uint8_t *p = (const uint8_t *)line + 2 + k - 8;
+    uint32_t v = 0;
+    uint32_t bad = 0;
+    for (int j = 0; j < 8; j++) {
+      uint32_t m = -(uint32_t)(j >= (int)(8 - k));
+      uint32_t d = hexval[p[j]];
+      v = (v << 4) | (d & m & 0xF);
+      bad |= d & m & 0xF0;
+    }
+    if (!bad) {
+      t->last_pc = v;
+      t->last_outcome = line[len - 1] - '0';
+      *pc = t->last_pc;
+      *outcome = t->last_outcome;
+      return;
+    }
+  }
+
+  trace_parse_slow(t, line, len);
+  *pc = t->last_pc;
+  *outcome = t->last_outcome;
+}
+
+// Parse up to TRACE_BATCH lines into 'pc' and 'outcome'
+//
+// Returns the number of branches parsed, 0 at the end of input
+//
+static size_t
+trace_parse_batch(Trace *t, uint32_t *pc, uint8_t *outcome)
+{
+  size_t n = 0;
+
+  while (n < TRACE_BATCH) {
+    char *nl = memchr(t->head, '\n', t->tail - t->head);
+    if (nl == NULL) {
+      if (!t->eof && trace_fill(t)) {
+        continue;
+      }
+      t->eof = 1;
+      if (t->head == t->tail) {
+        break;
+      }
+      // Final line without a newline
+      nl = t->tail;
+    }
+    trace_parse_line(t, t->head, nl - t->head, &pc[n], &outcome[n]);
+    n++;
+    t->head = nl < t->tail ? nl + 1 : nl;
+  }
+  return n;
+}
+
+static int
+trace_next_text(Trace *t, TraceBatch *b)
+{
+  b->pc = t->pc_buf;
+  b->outcome = t->outcome_buf;
+  b->n = trace_parse_batch(t, t->pc_buf, t->outcome_buf);
+  return b->n != 0;
+}
+
+//------------------------------------//
+//      Pipelined bzip2 Parsing       //
+//------------------------------------//
+
+// Polls of the ring before a waiting side goes to sleep. The other
+// side usually moves within a few, and decoding a whole batch takes
+// far longer than a sleep and wakeup
+#define TRACE_SPINS 256
+
+// Wait until 'cond' holds on trace 't', spinning briefly and then
+// sleeping until the other side of the ring moves. Registering as a
+// waiter before the last check, and trace_ring_wake reading the
+// waiters after its update, both behind full fences, means at least
+// one side sees the other and no wakeup is lost
+#define TRACE_WAIT_UNTIL(t, cond) \
+  for (int spins = 0; !(cond); spins++) { \
+    if (spins >= TRACE_SPINS) { \
+      pthread_mutex_lock(&(t)->ring_lock); \
+      __atomic_add_fetch(&(t)->ring_waiters, 1, __ATOMIC_SEQ_CST); \
+      __atomic_thread_fence(__ATOMIC_SEQ_CST); \
+      while (!(cond)) { \
+        pthread_cond_wait(&(t)->ring_cond, &(t)->ring_lock); \
+      } \
+      __atomic_sub_fetch(&(t)->ring_waiters, 1, __ATOMIC_SEQ_CST); \
+      pthread_mutex_unlock(&(t)->ring_lock); \
+      break; \
+    } \
+  }
+
+// Wake the other side of the ring if it is asleep, after moving
+// ring_head, ring_tail or ring_stop
+//
+static void
+trace_ring_wake(Trace *t)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&t->ring_waiters, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&t->ring_lock);
+    pthread_cond_broadcast(&t->ring_cond);
+    pthread_mutex_unlock(&t->ring_lock);
+  }
+}
+
+static void *
+trace_produce(void *arg)
+{
+  Trace *t = (Trace *)arg;
+  for (;;) {
+    uint64_t head = t->ring_head;
+    TRACE_WAIT_UNTIL(t, head - __atomic_load_n(&t->ring_tail, __ATOMIC_ACQUIRE) <
+                        TRACE_RING || __atomic_load_n(&t->ring_stop, __ATOMIC_RELAXED));
+    if (__atomic_load_n(&t->ring_stop, __ATOMIC_RELAXED)) {
+      return NULL;
+    }
+
+    TraceSlot *slot = &t->ring[head & (TRACE_RING - 1)];
+    uint64_t start = now_ns();
+    slot->n = trace_parse_batch(t, slot->pc, slot->outcome);
+    t->stats.parse_ns += now_ns() - start;
+    __atomic_store_n(&t->ring_head, head + 1, __ATOMIC_RELEASE);
+    trace_ring_wake(t);
+
+    if (slot->n == 0) {
+      return NULL;
+    }
+  }
+}
+
+static int
+trace_next_bz2(Trace *t, TraceBatch *b)
+{
+  if (t->holding) {
+    __atomic_store_n(&t->ring_tail, t->ring_tail + 1, __ATOMIC_RELEASE);
+    t->holding = 0;
+    trace_ring_wake(t);
+  }
+
+  uint64_t tail = t->ring_tail;
+  TRACE_WAIT_UNTIL(t, __atomic_load_n(&t->ring_head, __ATOMIC_ACQUIRE) != tail);
+
+  TraceSlot *slot = &t->ring[tail & (TRACE_RING - 1)];
+  b->pc = slot->pc;
+  b->outcome = slot->outcome;
+  b->n = slot->n;
+  if (b->n == 0) {
+    // Leave the end marker in place for repeated calls
+    return 0;
+  }
+  t->holding = 1;
+  return 1;
+}
+
+// Start decompressing 'fd' on a producer thread
+//
+// Returns True if Successful
+//
+static int
+trace_open_bz2(Trace *t, int fd)
+{
+  int err;
+  t->bzfile = fdopen(fd, "rb");
+  if (t->bzfile == NULL) {
+    return 0;
+  }
+  t->bz = BZ2_bzReadOpen(&err, t->bzfile, 0, 0, NULL, 0);
+  if (err != BZ_OK) {
+    BZ2_bzReadClose(&err, t->bz);
+    t->bz = NULL;
+    return 0;
+  }
+
+  pthread_mutex_init(&t->ring_lock, NULL);
+  pthread_cond_init(&t->ring_cond, NULL);
+  t->ring = (TraceSlot *)malloc(TRACE_RING * sizeof(TraceSlot));
+  if (t->ring == NULL || pthread_create(&t->producer, NULL, trace_produce, t)) {
+    free(t->ring);
+    t->ring = NULL;
+    pthread_cond_destroy(&t->ring_cond);
+    pthread_mutex_destroy(&t->ring_lock);
+    return 0;
+  }
+  return 1;
+}
+
+static int trace_cache_map(Trace *t, const char *path, int fd, size_t size);
+
+// Open a trace, through the cache if 'cached' and one is configured
+//
+static Trace *
+trace_open_file(const char *path, int cached)
+{
+  pthread_once(&hexvalOnce, hexval_init);
+
+  Trace *t = (Trace *)calloc(1, sizeof(Trace));
+  if (t == NULL) {
+    return NULL;
+  }
+  t->outcome_buf = (uint8_t *)malloc(TRACE_BATCH);
+
+  int fd = STDIN_FILENO;
+  if (path != NULL && strcmp(path, "-")) {
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      trace_close(t);
+      return NULL;
+    }
+  }
+
+  // Only regular files can be probed without consuming input
+  struct stat st;
+  int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  char magic[sizeof(TRACE_BIN_MAGIC)];
+  if (regular &&
+      st.st_size >= (off_t)sizeof(TraceBinHeader) &&
+      pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      !memcmp(magic, TRACE_BIN_MAGIC, sizeof(magic))) {
+    t->format = TRACE_BINARY;
+    int ok = trace_map_binary(t, fd, st.st_size);
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    if (!ok) {
+      trace_close(t);
+      return NULL;
+    }
+    return t;
+  }
+
+  if (regular &&
+      st.st_size >= (off_t)sizeof(TraceDeltaHeader) &&
+      pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+      !memcmp(magic, TRACE_DELTA_MAGIC, sizeof(magic))) {
+    t->format = TRACE_DELTA;
+    int ok = trace_map_delta(t, fd, st.st_size);
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    if (!ok) {
+      trace_close(t);
+      return NULL;
+    }
+    // Blocks are decoded whole
+    t->pc_buf = (uint32_t *)malloc(t->block * sizeof(uint32_t));
+    t->outcome_buf = (uint8_t *)realloc(t->outcome_buf, t->block);
+    return t;
+  }
+
+  // Text and bzip2 files are decoded once into the cache and mapped
+  if (cached && regular && fd != STDIN_FILENO &&
+      trace_cache_map(t, path, fd, st.st_size)) {
+    close(fd);
+    return t;
+  }
+
+  t->format = TRACE_TEXT;
+  t->fd = fd;
+  t->buf_cap = TRACE_PAD + 2 * TRACE_CHUNK;
+  t->buf = (char *)malloc(t->buf_cap);
+  t->head = t->tail = t->buf + TRACE_PAD;
+
+  char bzmagic[3];
+  if (regular && pread(fd, bzmagic, 3, 0) == 3 &&
+      !memcmp(bzmagic, "BZh", 3)) {
+    t->format = TRACE_BZ2;
+    t->fd = -1; // owned by the bzip2 FILE
+    if (!trace_open_bz2(t, fd)) {
+      if (t->bzfile == NULL) {
+        close(fd);
+      }
+      trace_close(t);
+      return NULL;
+    }
+    return t;
+  }
+
+  t->pc_buf = (uint32_t *)malloc(TRACE_BATCH * sizeof(uint32_t));
+  return t;
+}
+
+Trace *
+trace_open(const char *path)
+{
+  return trace_open_file(path, 1);
+}
+
+static int
+trace_next_binary(Trace *t, TraceBatch *b)
+{
+  uint64_t left = t->count - t->pos;
+  size_t n = left < TRACE_BATCH ? left : TRACE_BATCH;
+
+  // Unpack a word at a time; only a batch after a skip starts inside
+  // a word
+  for (size_t i = 0; i < n;) {
+    uint64_t bit = t->pos + i;
+    uint64_t w = t->bits[bit / 64] >> (bit % 64);
+    size_t m = 64 - bit % 64;
+    if (m > n - i) {
+      m = n - i;
+    }
+    for (size_t j = 0; j < m; j++) {
+      t->outcome_buf[i + j] = (w >> j) & 1;
+    }
+    i += m;
+  }
+
+  b->pc = t->pcs + t->pos;
+  b->outcome = t->outcome_buf;
+  b->n = n;
+  t->pos += n;
+  return n != 0;
+}
+
+static inline uint64_t
+trace_varint(const uint8_t **p, const uint8_t *end)
+{
+  const uint8_t *q = *p;
+  uint64_t v = *q++;
+  if (v >= 0x80) {
+    v &= 0x7F;
+    for (int shift = 7; q < end && shift < 64; shift += 7) {
+      uint8_t byte = *q++;
+      v |= (uint64_t)(byte & 0x7F) << shift;
+      if (byte < 0x80) {
+        break;
+      }
+    }
+  }
+  *p = q;
+  return v;
+}
+
+// Decode the block starting at branch t->pos
+//
+// Returns False at the end of the trace or if the block is corrupt
+//
+static int
+trace_next_delta(Trace *t, TraceBatch *b)
+{
+  b->n = 0;
+  if (t->pos >= t->count) {
+    return 0;
+  }
+  uint64_t block = t->pos / t->block;
+  uint64_t left = t->count - block * t->block;
+  size_t n = left < t->block ? left : t->block;
+  const uint8_t *base = (const uint8_t *)t->map;
+  const uint64_t *bits = (const uint64_t *)(base + t->offsets[block]);
+  const uint8_t *p = base + t->offsets[block] + 8 * ((n + 63) / 64);
+  const uint8_t *end = base + t->offsets[block + 1];
+
+  // Spread each byte of outcome bits over 8 bytes: replicate it,
+  // keep bit k in byte k and carry that bit to the top of the byte
+  const uint8_t *outcomeBytes = (const uint8_t *)bits;
+  size_t whole = n / 8;
+  for (size_t k = 0; k < whole; k++) {
+    uint64_t x = outcomeBytes[k] * 0x0101010101010101ull;
+    x &= 0x8040201008040201ull;
+    x = ((x + 0x7F7F7F7F7F7F7F7Full) >> 7) & 0x0101010101010101ull;
+    memcpy(t->outcome_buf + 8 * k, &x, 8);
+  }
+  for (size_t j = 8 * whole; j < n; j++) {
+    t->outcome_buf[j] = (outcomeBytes[j / 8] >> (j % 8)) & 1;
+  }
+
+  // Indices are unsigned, so a negative delta wraps around and any
+  // index outside the dictionary fails the same single check. It is
+  // accumulated rather than branched on, and a bad index reads entry 0
+  uint32_t *pc = t->pc_buf;
+  const uint32_t *dict = t->dict;
+  uint32_t size = t->dict_size;
+  uint32_t id = 0;
+  uint32_t delta = 0;
+  uint32_t bad = 0;
+  size_t i = 0;
+  while (i < n && p < end) {
+    uint64_t token = trace_varint(&p, end);
+    if (!(token & 1)) {
+      uint64_t z = token >> 1;
+      delta = (uint32_t)(z >> 1) ^ -(uint32_t)(z & 1);
+      id += delta;
+      bad |= id >= size;
+      pc[i++] = dict[id < size ? id : 0];
+      continue;
+    }
+    uint64_t run = (token >> 1) + 1;
+    if (run > n - i) {
+      break;
+    }
+    if (delta == 0) {
+      // The same branch repeated
+      uint32_t v = dict[id < size ? id : 0];
+      for (uint64_t r = 0; r < run; r++) {
+        pc[i + r] = v;
+      }
+      i += run;
+      continue;
+    }
+    for (uint64_t r = 0; r < run; r++) {
+      id += delta;
+      bad |= id >= size;
+      pc[i++] = dict[id < size ? id : 0];
+    }
+  }
+  if (bad) {
+    i = 0;
+  }
+  if (i != n) {
+    fprintf(stderr, "Corrupt block %llu in delta trace\n", (unsigned long long)block);
+    t->pos = t->count;
+    return 0;
+  }
+
+  // A skip within the block drops its front
+  size_t offset = t->pos - block * t->block;
+  b->pc = pc + offset;
+  b->outcome = t->outcome_buf + offset;
+  b->n = n - offset;
+  t->pos = block * t->block + n;
+  return 1;
+}
+
+static int
+trace_fetch(Trace *t, TraceBatch *b)
+{
+  if (t->format == TRACE_BZ2) {
+    // The producer accounts for its own parse time
+    return trace_next_bz2(t, b);
+  }
+
+  uint64_t start = now_ns();
+  int more;
+  if (t->format == TRACE_BINARY) {
+    more = trace_next_binary(t, b);
+    t->stats.bytes += b->n * sizeof(uint32_t) + b->n / 8;
+  } else if (t->format == TRACE_DELTA) {
+    uint64_t start_pos = t->pos;
+    more = trace_next_delta(t, b);
+    if (more) {
+      uint64_t block = start_pos / t->block;
+      t->stats.bytes += t->offsets[block + 1] - t->offsets[block];
+    }
+  } else {
+    more = trace_next_text(t, b);
+  }
+  t->stats.parse_ns += now_ns() - start;
+  return more;
+}
+
+int
+trace_next(Trace *t, TraceBatch *b)
+{
+  int more = trace_fetch(t, b);
+  while (more && t->skip > 0) {
+    if (b->n <= t->skip) {
+      t->skip -= b->n;
+      more = trace_fetch(t, b);
+    } else {
+      b->pc += t->skip;
+      b->outcome += t->skip;
+      b->n -= t->skip;
+      t->skip = 0;
+    }
+  }
+  t->stats.branches += b->n;
+  return more;
+}
+
+void
+trace_skip(Trace *t, uint64_t n)
+{
+  if (t->format == TRACE_BINARY || t->format == TRACE_DELTA) {
+    // Delta traces find the block through the index
+    uint64_t left = t->count - t->pos;
+    t->pos += n < left ? n : left;
+  } else {
+    // Text has to be parsed to find line boundaries
+    t->skip += n;
+  }
+}
+
+// For bzip2 traces the byte and time counts are only final once
+// trace_next has returned False
+//
+void
+trace_stats(Trace *t, TraceStats *stats)
+{
+  *stats = t->stats;
+}
+
+int
+trace_threaded(const Trace *t)
+{
+  return t->ring != NULL;
+}
+
+void
+trace_close(Trace *t)
+{
+  if (t->ring != NULL) {
+    __atomic_store_n(&t->ring_stop, 1, __ATOMIC_RELAXED);
+    trace_ring_wake(t);
+    pthread_join(t->producer, NULL);
+    free(t->ring);
+    pthread_cond_destroy(&t->ring_cond);
+    pthread_mutex_destroy(&t->ring_lock);
+  }
+  if (t->bz != NULL) {
+    int err;
+    BZ2_bzReadClose(&err, t->bz);
+  }
+  if (t->bzfile != NULL) {
+    fclose(t->bzfile);
+  }
+  if (t->format == TRACE_TEXT && t->fd != STDIN_FILENO) {
+    close(t->fd);
+  }
+  free(t->buf);
+  if (t->map != NULL) {
+    munmap(t->map, t->map_len);
+  }
+  free(t->line);
+  free(t->pc_buf);
+  free(t->outcome_buf);
+  free(t);
+}
+
+TraceData *
+traceData_load(const char *path)
+{
+  Trace *t = trace_open(path);
+  if (t == NULL) {
+    return NULL;
+  }
+
+  TraceData *d = (TraceData *)calloc(1, sizeof(TraceData));
+  uint64_t cap = 0;
+  TraceBatch b;
+  while (trace_next(t, &b)) {
+    if (d->n + b.n > cap) {
+      cap = cap ? 2 * cap : 16 * TRACE_BATCH;
+      d->pc = (uint32_t *)realloc(d->pc, cap * sizeof(uint32_t));
+      d->outcome = (uint8_t *)realloc(d->outcome, cap);
+      if (d->pc == NULL || d->outcome == NULL) {
+        fprintf(stderr, "Out of memory loading trace %s\n", path);
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(d->pc + d->n, b.pc, b.n * sizeof(uint32_t));
+    memcpy(d->outcome + d->n, b.outcome, b.n);
+    d->n += b.n;
+  }
+  trace_close(t);
+  return d;
+}
+
+void
+traceData_destroy(TraceData *d)
+{
+  free(d->pc);
+  free(d->outcome);
+  free(d);
+}
+
+//------------------------------------//
+//        Decoded Trace Cache         //
+//------------------------------------//
+
+static char *cacheDir = NULL;
+static uint64_t cacheLimit = TRACE_CACHE_LIMIT;
+
+void
+trace_cache_configure(const char *dir, uint64_t limit)
+{
+  free(cacheDir);
+  cacheDir = dir != NULL ? strdup(dir) : NULL;
+  cacheLimit = limit ? limit : TRACE_CACHE_LIMIT;
+  if (cacheDir != NULL) {
+    mkdir(cacheDir, 0777);
+  }
+}
+
+// 64-bit hash of a file's contents, a word at a time
+//
+static uint64_t
+trace_content_hash(const uint8_t *p, size_t len)
+{
+  uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 32;
+  }
+  if (i < len) {
+    uint64_t w = 0;
+    memcpy(&w, p + i, len - i);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+  }
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  return h ^ (h >> 33);
+}
+
+struct TraceCacheEntry
+{
+  char name[64];
+  uint64_t size;
+  struct timespec used;
+};
+typedef struct TraceCacheEntry TraceCacheEntry;
+
+static int
+trace_cache_older(const void *a, const void *b)
+{
+  const struct timespec *x = &((const TraceCacheEntry *)a)->used;
+  const struct timespec *y = &((const TraceCacheEntry *)b)->used;
+  if (x->tv_sec != y->tv_sec) {
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  }
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Remove the least recently used copies until the cache fits its
+// limit, never removing 'keep'
+//
+static void
+trace_cache_evict(const char *keep)
+{
+  DIR *dir = opendir(cacheDir);
+  if (dir == NULL) {
+    return;
+  }
+  TraceCacheEntry *entries = NULL;
+  size_t n = 0, cap = 0;
+  uint64_t total = 0;
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    // Only names trace_cache_map would have chosen
+    unsigned long long hash, size;
+    char name[sizeof(entries->name)];
+    if (sscanf(e->d_name, "%16llx-%llu.bpt", &hash, &size) != 2 ||
+        snprintf(name, sizeof(name), "%016llx-%llu.bpt", hash, size) >=
+        (int)sizeof(name) || strcmp(name, e->d_name)) {
+      continue;
+    }
+    struct stat st;
+    if (fstatat(dirfd(dir), e->d_name, &st, 0) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (n == cap) {
+      cap = cap ? 2 * cap : 64;
+      entries = (TraceCacheEntry *)realloc(entries, cap * sizeof(TraceCacheEntry));
+    }
+    strcpy(entries[n].name, e->d_name);
+    entries[n].size = st.st_size;
+    entries[n].used = st.st_mtim;
+    total += st.st_size;
+    n++;
+  }
+
+  qsort(entries, n, sizeof(TraceCacheEntry), trace_cache_older);
+  for (size_t i = 0; i < n && total > cacheLimit; i++) {
+    if (strcmp(entries[i].name, keep) &&
+        unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+      total -= entries[i].size;
+    }
+  }
+  closedir(dir);
+  free(entries);
+}
+
+// Decode the trace at 'path' into a binary trace at 'dest'. It is
+// written under a temporary name and renamed, so readers never see
+// a partial copy
+//
+// Returns True if Successful
+//
+static int
+trace_cache_fill(const char *path, const char *dest)
+{
+  size_t len = strlen(cacheDir) + 32;
+  char *tmp = (char *)malloc(len);
+  snprintf(tmp, len, "%s/.fill-XXXXXX", cacheDir);
+  int fd = mkstemp(tmp);
+  if (fd >= 0) {
+    fchmod(fd, 0644);
+  }
+  Trace *src = fd >= 0 ? trace_open_file(path, 0) : NULL;
+  TraceWriter *w = src != NULL ? traceWriter_open(tmp) : NULL;
+  int ok = w != NULL;
+  if (w != NULL) {
+    TraceBatch b;
+    while (trace_next(src, &b)) {
+      traceWriter_append(w, b.pc, b.outcome, b.n);
+    }
+    ok = traceWriter_close(w) && rename(tmp, dest) == 0;
+  }
+  if (src != NULL) {
+    trace_close(src);
+  }
+  if (fd >= 0) {
+    close(fd);
+    if (!ok) {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  return ok;
+}
+
+// Map the cached copy of the source file 'fd' of 'size' bytes,
+// decoding it into the cache first if it is not there
+//
+// Returns True if Successful, leaving 'fd' open either way
+//
+static int
+trace_cache_map(Trace *t, const char *path, int fd, size_t size)
+{
+  if (cacheDir == NULL || size == 0) {
+    return 0;
+  }
+  void *src = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (src == MAP_FAILED) {
+    return 0;
+  }
+  uint64_t hash = trace_content_hash((const uint8_t *)src, size);
+  munmap(src, size);
+
+  char name[64];
+  snprintf(name, sizeof(name), "%016llx-%llu.bpt", (unsigned long long)hash,
+           (unsigned long long)size);
+  size_t len = strlen(cacheDir) + sizeof(name) + 1;
+  char *cached = (char *)malloc(len);
+  snprintf(cached, len, "%s/%s", cacheDir, name);
+
+  int cfd = open(cached, O_RDONLY);
+  if (cfd < 0) {
+    if (!trace_cache_fill(path, cached)) {
+      fprintf(stderr, "Unable to cache trace %s in %s\n", path, cacheDir);
+      free(cached);
+      return 0;
+    }
+    trace_cache_evict(name);
+    cfd = open(cached, O_RDONLY);
+  }
+
+  struct stat st;
+  int ok = cfd >= 0 && fstat(cfd, &st) == 0 &&
+           st.st_size >= (off_t)sizeof(TraceBinHeader) &&
+           trace_map_binary(t, cfd, st.st_size);
+  if (ok) {
+    // The modification time orders copies for eviction
+    futimens(cfd, NULL);
+    t->format = TRACE_BINARY;
+  } else if (cfd >= 0) {
+    // A copy from an older format is decoded again next time
+    unlink(cached);
+  }
+  if (cfd >= 0) {
+    close(cfd);
+  }
+  free(cached);
+  return ok;
+}
+
+//------------------------------------//
+//        Binary Trace Writing        //
+//------------------------------------//
+
+struct TraceWriter
+{
+  FILE *out;
+  uint64_t count;
+  uint64_t *bits;
+  size_t bits_cap; // in words
+};
+
+TraceWriter *
+traceWriter_open(const char *path)
+{
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    return NULL;
+  }
+
+  TraceWriter *w = (TraceWriter *)calloc(1, sizeof(TraceWriter));
+  w->out = out;
+
+  // Placeholder header, rewritten with the final count on close
+  TraceBinHeader h;
+  memset(&h, 0, sizeof(h));
+  fwrite(&h, sizeof(h), 1, out);
+  return w;
+}
+
+void
+traceWriter_append(TraceWriter *w, const uint32_t *pc,
+                   const uint8_t *outcome, size_t n)
+{
+  fwrite(pc, sizeof(uint32_t), n, w->out);
+
+  size_t need = (w->count + n + 63) / 64;
+  if (need > w->bits_cap) {
+    size_t cap = w->bits_cap ? w->bits_cap : 1024;
+    while (cap < need) {
+      cap *= 2;
+    }
+    w->bits = (uint64_t *)realloc(w->bits, cap * sizeof(uint64_t));
+    memset(w->bits + w->bits_cap, 0, (cap - w->bits_cap) * sizeof(uint64_t));
+    w->bits_cap = cap;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    uint64_t idx = w->count + i;
+    w->bits[idx / 64] |= (uint64_t)(outcome[i] & 1) << (idx % 64);
+  }
+  w->count += n;
+}
+
+int
+traceWriter_close(TraceWriter *w)
+{
+  size_t pc_end = sizeof(TraceBinHeader) + 4 * w->count;
+  static const char pad[8];
+  fwrite(pad, 1, align8(pc_end) - pc_end, w->out);
+  fwrite(w->bits, sizeof(uint64_t), (w->count + 63) / 64, w->out);
+
+  TraceBinHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_BIN_MAGIC, sizeof(TRACE_BIN_MAGIC));
+  h.version = TRACE_BIN_VERSION;
+  h.count = w->count;
+  int ok = fseek(w->out, 0, SEEK_SET) == 0 &&
+           fwrite(&h, sizeof(h), 1, w->out) == 1;
+  ok = (fclose(w->out) == 0) && ok;
+
+  free(w->bits);
+  free(w);
+  return ok;
+}
+
+//------------------------------------//
+//         Delta Trace Writing        //
+//------------------------------------//
+
+struct TraceDeltaWriter
+{
+  FILE *out;
+  uint64_t count;
+  uint64_t offset;     // bytes written
+
+  // Dictionary, and an open addressed hash from PC to index + 1
+  uint32_t *dict;
+  uint32_t dict_size;
+  uint32_t dict_cap;
+  uint32_t *hash_pc;
+  uint32_t *hash_id;
+  uint32_t hash_cap;   // power of two, at most half full
+
+  // Start of every block written
+  uint64_t *index;
+  uint32_t blocks;
+  uint32_t index_cap;
+
+  // Block being filled
+  uint32_t *ids;
+  uint8_t *outcomes;
+  size_t fill;
+  uint8_t *buf;        // encoded block
+};
+
+static uint32_t
+trace_hash(uint32_t pc)
+{
+  return (pc * 0x9E3779B1u) ^ (pc >> 15);
+}
+
+static void
+trace_dict_grow(TraceDeltaWriter *w)
+{
+  uint32_t cap = w->hash_cap ? 2 * w->hash_cap : 4096;
+  uint32_t *pcs = (uint32_t *)calloc(cap, sizeof(uint32_t));
+  uint32_t *ids = (uint32_t *)calloc(cap, sizeof(uint32_t));
+  for (uint32_t i = 0; i < w->hash_cap; i++) {
+    if (w->hash_id[i]) {
+      uint32_t h = trace_hash(w->hash_pc[i]) & (cap - 1);
+      while (ids[h]) {
+        h = (h + 1) & (cap - 1);
+      }
+      pcs[h] = w->hash_pc[i];
+      ids[h] = w->hash_id[i];
+    }
+  }
+  free(w->hash_pc);
+  free(w->hash_id);
+  w->hash_pc = pcs;
+  w->hash_id = ids;
+  w->hash_cap = cap;
+}
+
+// Returns the dictionary index of 'pc', adding it if it is new
+static uint32_t
+trace_dict_id(TraceDeltaWriter *w, uint32_t pc)
+{
+  uint32_t h = trace_hash(pc) & (w->hash_cap - 1);
+  while (w->hash_id[h]) {
+    if (w->hash_pc[h] == pc) {
+      return w->hash_id[h] - 1;
+    }
+    h = (h + 1) & (w->hash_cap - 1);
+  }
+
+  if (w->dict_size == w->dict_cap) {
+    w->dict_cap = w->dict_cap ? 2 * w->dict_cap : 1024;
+    w->dict = (uint32_t *)realloc(w->dict, w->dict_cap * sizeof(uint32_t));
+  }
+  uint32_t id = w->dict_size++;
+  w->dict[id] = pc;
+  w->hash_pc[h] = pc;
+  w->hash_id[h] = id + 1;
+  if (2 * w->dict_size > w->hash_cap) {
+    trace_dict_grow(w);
+  }
+  return id;
+}
+
+static uint8_t *
+trace_put_varint(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+static void
+trace_write(TraceDeltaWriter *w, const void *data, size_t len)
+{
+  fwrite(data, 1, len, w->out);
+  w->offset += len;
+}
+
+// Pad the output to a multiple of 8 bytes
+static void
+trace_write_align(TraceDeltaWriter *w)
+{
+  static const char pad[8];
+  trace_write(w, pad, align8(w->offset) - w->offset);
+}
+
+// Encode and write the block being filled
+static void
+trace_flush_block(TraceDeltaWriter *w)
+{
+  size_t n = w->fill;
+  if (n == 0) {
+    return;
+  }
+  if (w->blocks + 1 >= w->index_cap) {
+    w->index_cap = w->index_cap ? 2 * w->index_cap : 256;
+    w->index = (uint64_t *)realloc(w->index, w->index_cap * sizeof(uint64_t));
+  }
+  w->index[w->blocks++] = w->offset;
+
+  size_t words = (n + 63) / 64;
+  uint64_t *bits = (uint64_t *)w->buf;
+  memset(bits, 0, words * 8);
+  for (size_t i = 0; i < n; i++) {
+    bits[i / 64] |= (uint64_t)(w->outcomes[i] & 1) << (i % 64);
+  }
+
+  uint8_t *p = w->buf + words * 8;
+  uint32_t prev = 0;
+  uint32_t delta = 0;
+  uint64_t run = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t d = w->ids[i] - prev;
+    prev = w->ids[i];
+    if (d == delta) {
+      run++;
+      continue;
+    }
+    if (run > 0) {
+      p = trace_put_varint(p, ((run - 1) << 1) | 1);
+      run = 0;
+    }
+    uint32_t z = (d << 1) ^ -(d >> 31);
+    p = trace_put_varint(p, (uint64_t)z << 1);
+    delta = d;
+  }
+  if (run > 0) {
+    p = trace_put_varint(p, ((run - 1) << 1) | 1);
+  }
+
+  trace_write(w, w->buf, p - w->buf);
+  trace_write_align(w);
+  w->fill = 0;
+}
+
+TraceDeltaWriter *
+traceDeltaWriter_open(const char *path)
+{
+  FILE *out = fopen(path, "wb");
+  if (out == NULL) {
+    return NULL;
+  }
+
+  TraceDeltaWriter *w = (TraceDeltaWriter *)calloc(1, sizeof(TraceDeltaWriter));
+  w->out = out;
+  w->ids = (uint32_t *)malloc(TRACE_BATCH * sizeof(uint32_t));
+  w->outcomes = (uint8_t *)malloc(TRACE_BATCH);
+  // Outcome words plus at most 6 bytes per token
+  w->buf = (uint8_t *)malloc(TRACE_BATCH / 8 + 8 + 6 * TRACE_BATCH);
+  trace_dict_grow(w);
+
+  // Placeholder header, rewritten on close
+  TraceDeltaHeader h;
+  memset(&h, 0, sizeof(h));
+  trace_write(w, &h, sizeof(h));
+  return w;
+}
+
+void
+traceDeltaWriter_append(TraceDeltaWriter *w, const uint32_t *pc,
+                        const uint8_t *outcome, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    w->ids[w->fill] = trace_dict_id(w, pc[i]);
+    w->outcomes[w->fill] = outcome[i];
+    if (++w->fill == TRACE_BATCH) {
+      trace_flush_block(w);
+    }
+  }
+  w->count += n;
+}
+
+int
+traceDeltaWriter_close(TraceDeltaWriter *w)
+{
+  trace_flush_block(w);
+
+  TraceDeltaHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_DELTA_MAGIC, sizeof(TRACE_DELTA_MAGIC));
+  h.version = TRACE_DELTA_VERSION;
+  h.block = TRACE_BATCH;
+  h.count = w->count;
+  h.blocks = w->blocks;
+  if (w->index == NULL) {
+    w->index = (uint64_t *)malloc(sizeof(uint64_t));
+  }
+  // The last block ends where the dictionary starts
+  w->index[w->blocks] = w->offset;
+
+  h.dictOffset = w->offset;
+  h.dictSize = w->dict_size;
+  trace_write(w, w->dict, w->dict_size * sizeof(uint32_t));
+  trace_write_align(w);
+  h.indexOffset = w->offset;
+  trace_write(w, w->index, (w->blocks + 1) * sizeof(uint64_t));
+
+  int ok = !ferror(w->out) && fseek(w->out, 0, SEEK_SET) == 0 &&
+           fwrite(&h, sizeof(h), 1, w->out) == 1;
+  ok = (fclose(w->out) == 0) && ok;
+
+  free(w->dict);
+  free(w->hash_pc);
+  free(w->hash_id);
+  free(w->index);
+  free(w->ids);
+  free(w->outcomes);
+  free(w->buf);
+  free(w);
+  return ok;
+}
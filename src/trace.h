@@ -0,0 +1,221 @@
+//========================================================//
+//  trace.h                                               //
+//  Header file for branch trace input                    //
+//                                                        //
+//  Readers for the text trace format, the packed binary  //
+//  trace format and the compressed delta trace format    //
+//========================================================//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+//------------------------------------//
+//        Binary Trace Format         //
+//------------------------------------//
+//
+// All fields are little-endian.
+//
+//   offset 0   char     magic[8]   "BPTRACE\0"
+//   offset 8   uint32_t version    TRACE_BIN_VERSION
+//   offset 12  uint32_t flags      reserved, 0
+//   offset 16  uint64_t count      number of branches
+//   offset 24  uint32_t pc[count]
+//   aligned 8  uint64_t outcome[(count + 63) / 64]
+//
+// Outcome of branch i is bit (i % 64) of outcome word i / 64.
+//
+#define TRACE_BIN_MAGIC   "BPTRACE"
+#define TRACE_BIN_VERSION 1
+
+struct TraceBinHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t count;
+};
+typedef struct TraceBinHeader TraceBinHeader;
+
+//------------------------------------//
+//        Delta Trace Format          //
+//------------------------------------//
+//
+// A compressed format that still decodes at memory speed. All
+// fields are little-endian.
+//
+//   offset 0   char     magic[8]     "BPDELTA\0"
+//   offset 8   uint32_t version      TRACE_DELTA_VERSION
+//   offset 12  uint32_t block        branches per block, at most TRACE_BATCH
+//   offset 16  uint64_t count        number of branches
+//   offset 24  uint64_t dictOffset   of uint32_t pc[dictSize]
+//   offset 32  uint32_t dictSize     distinct PCs
+//   offset 36  uint32_t blocks       (count + block - 1) / block
+//   offset 40  uint64_t indexOffset  of uint64_t offset[blocks + 1]
+//
+// Each PC is replaced by its index in the dictionary, in order of
+// first appearance. Block b occupies offset[b] to offset[b + 1],
+// starts on an 8-byte boundary and holds
+//
+//   uint64_t outcome[(n + 63) / 64]  as in the binary format
+//   uint8_t  token[]                 the dictionary index stream
+//
+// Tokens are LEB128 varints. A token t with bit 0 clear adds the
+// zigzag-decoded delta t >> 1 to the previous index; one with bit 0
+// set repeats the last delta (t >> 1) + 1 more times. The previous
+// index and delta are 0 at the start of each block, so any block can
+// be decoded on its own.
+//
+#define TRACE_DELTA_MAGIC   "BPDELTA"
+#define TRACE_DELTA_VERSION 1
+
+struct TraceDeltaHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t block;
+  uint64_t count;
+  uint64_t dictOffset;
+  uint32_t dictSize;
+  uint32_t blocks;
+  uint64_t indexOffset;
+};
+typedef struct TraceDeltaHeader TraceDeltaHeader;
+
+//------------------------------------//
+//           Trace Reading            //
+//------------------------------------//
+
+// Number of branches handed out by one call to trace_next
+#define TRACE_BATCH 65536
+
+// A run of consecutive branches. The arrays are owned by the
+// trace and stay valid until the next call to trace_next
+struct TraceBatch
+{
+  const uint32_t *pc;
+  const uint8_t *outcome;
+  size_t n;
+};
+typedef struct TraceBatch TraceBatch;
+
+typedef struct Trace Trace;
+
+// Input accounting, used to report parse throughput
+struct TraceStats
+{
+  uint64_t bytes;     // bytes of trace consumed
+  uint64_t branches;  // branches handed out
+  uint64_t parse_ns;  // time spent producing batches
+};
+typedef struct TraceStats TraceStats;
+
+// Open a trace file, detecting its format. A NULL path or "-"
+// reads a text trace from stdin
+//
+// Returns NULL if the file cannot be opened
+//
+Trace *trace_open(const char *path);
+
+// Fetch the next batch of branches
+//
+// Returns False at the end of the trace
+//
+int trace_next(Trace *t, TraceBatch *b);
+
+// Drop the next 'n' branches. Binary traces seek directly, text
+// traces parse and discard them on the following trace_next calls
+//
+void trace_skip(Trace *t, uint64_t n);
+
+void trace_stats(Trace *t, TraceStats *stats);
+
+// Returns True if the trace is parsed on a producer thread of its
+// own, as bzip2 traces are, rather than in trace_next
+//
+int trace_threaded(const Trace *t);
+
+void trace_close(Trace *t);
+
+// A whole trace decoded into memory, for runs that replay it
+struct TraceData
+{
+  uint32_t *pc;
+  uint8_t *outcome;
+  uint64_t n;
+};
+typedef struct TraceData TraceData;
+
+// Read the entire trace at 'path' into memory
+//
+// Returns NULL if the file cannot be opened
+//
+TraceData *traceData_load(const char *path);
+
+void traceData_destroy(TraceData *d);
+
+//------------------------------------//
+//        Decoded Trace Cache         //
+//------------------------------------//
+//
+// Text and bzip2 traces can be decoded once into a cache directory
+// as binary traces, named "<hash>-<size>.bpt" after a 64-bit hash
+// and the size of the source file's contents. trace_open then maps
+// the cached copy instead of parsing the source again, whatever its
+// path. Each use updates the copy's modification time, and when the
+// directory grows past its limit the least recently used copies are
+// removed.
+//
+#define TRACE_CACHE_LIMIT (1ull << 30) // default limit in bytes
+
+// Cache traces opened from now on in 'dir', created if missing,
+// keeping at most 'limit' bytes there, or TRACE_CACHE_LIMIT if it
+// is 0. A NULL 'dir' turns the cache off. Call before any trace is
+// opened on another thread
+//
+void trace_cache_configure(const char *dir, uint64_t limit);
+
+//------------------------------------//
+//        Binary Trace Writing        //
+//------------------------------------//
+
+typedef struct TraceWriter TraceWriter;
+
+// Create a binary trace at 'path'. The file must be seekable
+// since the header is completed on close
+//
+TraceWriter *traceWriter_open(const char *path);
+
+void traceWriter_append(TraceWriter *w, const uint32_t *pc,
+                        const uint8_t *outcome, size_t n);
+
+// Flush the outcome bits and header
+//
+// Returns True if Successful
+//
+int traceWriter_close(TraceWriter *w);
+
+//------------------------------------//
+//         Delta Trace Writing        //
+//------------------------------------//
+
+typedef struct TraceDeltaWriter TraceDeltaWriter;
+
+// Create a delta trace at 'path'. Blocks are written as they fill,
+// and the dictionary and block index on close, so the file must be
+// seekable
+//
+TraceDeltaWriter *traceDeltaWriter_open(const char *path);
+
+void traceDeltaWriter_append(TraceDeltaWriter *w, const uint32_t *pc,
+                             const uint8_t *outcome, size_t n);
+
+// Flush the last block, dictionary, index and header
+//
+// Returns True if Successful
+//
+int traceDeltaWriter_close(TraceDeltaWriter *w);
+
+#endif
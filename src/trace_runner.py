@@ -1,5 +1,4 @@
 import subprocess
-from pprint import pformat
 
 files = [
     "fp_1.bz2",
@@ -22,17 +21,14 @@ preds = {
 }
 
 
-def runPreds():
-    outputs = []
-    for file in files:
-        pout = []
-        for name, pred in preds.items():
-            pout.append({name: subprocess.check_output(
-                "bunzip2 -kc ../traces/{} | ./predictor --{}".format(file, pred), shell=True, text=True).strip()})
-        outputs.append(pout)
-    return outputs
+def runPreds(output="data.csv", fmt="csv"):
+    # Every trace is decoded once and all runs share the cores; see ./dse --help
+    cmd = ["./dse", "--format", fmt, "--output", output]
+    for pred in preds.values():
+        cmd += ["--config", pred]
+    cmd += ["../traces/{}".format(file) for file in files]
+    subprocess.check_call(cmd)
 
 
 if __name__ == "__main__":
-    with open("data.txt", "w") as f:
-        f.write(pformat(runPreds()))
+    runPreds()
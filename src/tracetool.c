@@ -0,0 +1,154 @@
+//========================================================//
+//  tracetool.c                                           //
+//  Conversion utility for branch traces                  //
+//                                                        //
+//  tracetool convert trace.bz2 trace.bpt                 //
+//  tracetool compress trace.bz2 trace.bpd                //
+//  tracetool predictions run.bpp                         //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+#include "predictions.h"
+
+void
+usage()
+{
+  fprintf(stderr,"Usage: tracetool convert <in> <out>\n");
+  fprintf(stderr,"       tracetool compress <in> <out>\n");
+  fprintf(stderr,"       tracetool text <in>\n");
+  fprintf(stderr,"       tracetool predictions|correct <in>\n");
+  fprintf(stderr," Commands:\n");
+  fprintf(stderr," convert      Write any readable trace as a binary trace\n");
+  fprintf(stderr," compress     Write any readable trace as a delta trace\n");
+  fprintf(stderr," text         Print any readable trace in the text format\n");
+  fprintf(stderr," predictions  Print a --packed stream as the --verbose text\n");
+  fprintf(stderr," correct      Print the correctness bits of a --packed-correct\n"
+                 "              stream, 1 for each correct prediction\n");
+  fprintf(stderr," Use - as <in> to read a text trace or packed stream from stdin\n");
+}
+
+int
+convert(const char *in, const char *out)
+{
+  Trace *t = trace_open(in);
+  if (t == NULL) {
+    fprintf(stderr, "Unable to open trace %s\n", in);
+    return 1;
+  }
+  TraceWriter *w = traceWriter_open(out);
+  if (w == NULL) {
+    fprintf(stderr, "Unable to create %s\n", out);
+    trace_close(t);
+    return 1;
+  }
+
+  TraceBatch b;
+  while (trace_next(t, &b)) {
+    traceWriter_append(w, b.pc, b.outcome, b.n);
+  }
+  trace_close(t);
+
+  if (!traceWriter_close(w)) {
+    fprintf(stderr, "Error writing %s\n", out);
+    return 1;
+  }
+  return 0;
+}
+
+int
+compress(const char *in, const char *out)
+{
+  Trace *t = trace_open(in);
+  if (t == NULL) {
+    fprintf(stderr, "Unable to open trace %s\n", in);
+    return 1;
+  }
+  TraceDeltaWriter *w = traceDeltaWriter_open(out);
+  if (w == NULL) {
+    fprintf(stderr, "Unable to create %s\n", out);
+    trace_close(t);
+    return 1;
+  }
+
+  TraceBatch b;
+  while (trace_next(t, &b)) {
+    traceDeltaWriter_append(w, b.pc, b.outcome, b.n);
+  }
+  trace_close(t);
+
+  if (!traceDeltaWriter_close(w)) {
+    fprintf(stderr, "Error writing %s\n", out);
+    return 1;
+  }
+  return 0;
+}
+
+int
+text(const char *in)
+{
+  Trace *t = trace_open(in);
+  if (t == NULL) {
+    fprintf(stderr, "Unable to open trace %s\n", in);
+    return 1;
+  }
+
+  TraceBatch b;
+  while (trace_next(t, &b)) {
+    for (size_t i = 0; i < b.n; i++) {
+      printf("0x%x %d\n", b.pc[i], b.outcome[i]);
+    }
+  }
+  trace_close(t);
+  return 0;
+}
+
+int
+predictions(const char *in, int correct)
+{
+  PredictionReader *r = predictionReader_open(in);
+  if (r == NULL) {
+    fprintf(stderr, "Unable to open prediction stream %s\n", in);
+    return 1;
+  }
+  if (correct && !(predictionReader_flags(r) & PREDICTIONS_CORRECT)) {
+    fprintf(stderr, "%s was not written with --packed-correct\n", in);
+    predictionReader_close(r);
+    return 1;
+  }
+
+  const uint8_t *pred, *ok;
+  char *buf = NULL;
+  size_t n, cap = 0;
+  while ((n = predictionReader_next(r, &pred, &ok)) > 0) {
+    if (2 * n > cap) {
+      cap = 2 * n;
+      buf = (char *)realloc(buf, cap);
+    }
+    fwrite(buf, 1, predictions_format_text(correct ? ok : pred, n, buf), stdout);
+  }
+  free(buf);
+  predictionReader_close(r);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc == 4 && !strcmp(argv[1], "convert")) {
+    return convert(argv[2], argv[3]);
+  } else if (argc == 4 && !strcmp(argv[1], "compress")) {
+    return compress(argv[2], argv[3]);
+  } else if (argc == 3 && !strcmp(argv[1], "text")) {
+    return text(argv[2]);
+  } else if (argc == 3 && !strcmp(argv[1], "predictions")) {
+    return predictions(argv[2], 0);
+  } else if (argc == 3 && !strcmp(argv[1], "correct")) {
+    return predictions(argv[2], 1);
+  }
+
+  usage();
+  return 1;
+}
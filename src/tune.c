@@ -0,0 +1,264 @@
+//========================================================//
+//  tune.c                                                //
+//  Source file for the configuration tuner               //
+//========================================================//
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "tune.h"
+#include "trace.h"
+#include "sim.h"
+#include "pool.h"
+
+uint64_t
+tune_parse_budget(const char *s)
+{
+  char *end;
+  double value = strtod(s, &end);
+  if (end == s || value <= 0) {
+    return 0;
+  }
+
+  if (*end == 'K' || *end == 'k') {
+    value *= 1024;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    value *= 1024 * 1024;
+    end++;
+  }
+  if (!strcmp(end, "B") || !strcasecmp(end, "byte") || !strcasecmp(end, "bytes")) {
+    value *= 8;
+  } else if (*end != '\0' && strcasecmp(end, "b") && strcasecmp(end, "bit") &&
+             strcasecmp(end, "bits")) {
+    return 0;
+  }
+  return (uint64_t)value;
+}
+
+// Add 'c' to the list if it can be built, fits the budget and uses
+// enough of it
+static int
+tune_add(PredictorConfig c, uint64_t budget, PredictorConfig **list, int *n)
+{
+  if (!predictor_config_valid(&c)) {
+    return 0;
+  }
+  uint64_t bits = predictor_storage_bits(&c);
+  if (bits > budget || bits < budget / 4) {
+    return 0;
+  }
+  *list = (PredictorConfig *)realloc(*list, (*n + 1) * sizeof(PredictorConfig));
+  (*list)[(*n)++] = c;
+  return 1;
+}
+
+int
+tune_candidates(uint64_t budget, PredictorConfig **list, int *n)
+{
+  int added = 0;
+  for (int g = 1; g <= 24; g++) {
+    PredictorConfig c = {GSHARE, g, 0, 0};
+    added += tune_add(c, budget, list, n);
+  }
+  for (int g = 1; g <= 20; g++) {
+    for (int l = 1; l <= 20; l++) {
+      for (int p = 1; p <= 20; p++) {
+        PredictorConfig c = {TOURNAMENT, g, l, p};
+        added += tune_add(c, budget, list, n);
+      }
+    }
+  }
+  PredictorConfig custom = {CUSTOM, 0, 0, 0};
+  added += tune_add(custom, budget, list, n);
+  // TAGE takes the largest tables its budget allows
+  PredictorConfig tage = {TAGE, (int)(budget / 1024), 0, 0};
+  added += tune_add(tage, budget, list, n);
+  return added;
+}
+
+struct TuneTask
+{
+  const PredictorConfig *config;
+  const TraceData *data;
+  uint64_t prefix;         // branches to run
+  uint64_t mispredictions;
+};
+typedef struct TuneTask TuneTask;
+
+static void
+tune_task(Pool *pool, void *arg)
+{
+  (void)pool; // a candidate submits no further work
+  TuneTask *task = (TuneTask *)arg;
+  TraceData prefix = *task->data;
+  prefix.n = task->prefix;
+  task->mispredictions = sim_run(task->config, &prefix);
+}
+
+// Sort key for the survivors of an objective
+struct TuneScore
+{
+  int config;
+  double rate;
+};
+typedef struct TuneScore TuneScore;
+
+static int
+tune_score_cmp(const void *a, const void *b)
+{
+  const TuneScore *x = (const TuneScore *)a;
+  const TuneScore *y = (const TuneScore *)b;
+  if (x->rate != y->rate) {
+    return x->rate < y->rate ? -1 : 1;
+  }
+  return x->config - y->config;
+}
+
+int
+tune_run(const char **paths, int ntraces, uint64_t budget, int jobs,
+         TuneResult *best, FILE *log)
+{
+  PredictorConfig *configs = NULL;
+  int nconfigs = 0;
+  if (tune_candidates(budget, &configs, &nconfigs) == 0) {
+    if (log != NULL) {
+      fprintf(log, "No configuration fits in %llu bits\n", (unsigned long long)budget);
+    }
+    return 0;
+  }
+
+  TraceData **data = (TraceData **)calloc(ntraces, sizeof(TraceData *));
+  int ok = 1;
+  for (int t = 0; t < ntraces && ok; t++) {
+    data[t] = traceData_load(paths[t]);
+    if (data[t] == NULL) {
+      if (log != NULL) {
+        fprintf(log, "Unable to open trace %s\n", paths[t]);
+      }
+      ok = 0;
+    }
+  }
+
+  // One objective per trace and a last one for the mean over traces,
+  // each with its own survivors
+  int nobj = ntraces + 1;
+  int **alive = (int **)calloc(nobj, sizeof(int *));
+  int *nalive = (int *)calloc(nobj, sizeof(int));
+  for (int o = 0; o < nobj && ok; o++) {
+    alive[o] = (int *)malloc(nconfigs * sizeof(int));
+    for (int c = 0; c < nconfigs; c++) {
+      alive[o][c] = c;
+    }
+    nalive[o] = nconfigs;
+  }
+
+  // Results by configuration and trace. A run on the same prefix as
+  // in the previous round is reused
+  TuneTask *tasks = (TuneTask *)calloc((size_t)nconfigs * ntraces, sizeof(TuneTask));
+  uint8_t *needed = (uint8_t *)malloc((size_t)nconfigs * ntraces);
+  TuneScore *scores = (TuneScore *)malloc(nconfigs * sizeof(TuneScore));
+
+  int rounds = 0;
+  while ((1 << rounds) < nconfigs) {
+    rounds++;
+  }
+
+  Pool *pool = ok ? pool_create(jobs) : NULL;
+  for (int r = 0; r <= rounds && ok; r++) {
+    memset(needed, 0, (size_t)nconfigs * ntraces);
+    for (int o = 0; o < nobj; o++) {
+      for (int i = 0; i < nalive[o]; i++) {
+        for (int t = 0; t < ntraces; t++) {
+          if (o == ntraces || o == t) {
+            needed[alive[o][i] * ntraces + t] = 1;
+          }
+        }
+      }
+    }
+
+    int submitted = 0;
+    for (int t = 0; t < ntraces; t++) {
+      uint64_t n = data[t]->n;
+      uint64_t prefix = n >> (rounds - r);
+      if (prefix < TUNE_MIN_PREFIX) {
+        prefix = n < TUNE_MIN_PREFIX ? n : TUNE_MIN_PREFIX;
+      }
+      for (int c = 0; c < nconfigs; c++) {
+        TuneTask *task = &tasks[c * ntraces + t];
+        if (needed[c * ntraces + t] && task->prefix != prefix) {
+          task->config = &configs[c];
+          task->data = data[t];
+          task->prefix = prefix;
+          pool_submit(pool, tune_task, task);
+          submitted++;
+        }
+      }
+    }
+    pool_wait(pool);
+    if (log != NULL) {
+      fprintf(log, "Round %d of %d: %d runs on 1/%d of each trace\n", r + 1,
+              rounds + 1, submitted, 1 << (rounds - r));
+    }
+
+    // Keep the better half of every objective
+    for (int o = 0; o < nobj; o++) {
+      for (int i = 0; i < nalive[o]; i++) {
+        int c = alive[o][i];
+        double rate = 0;
+        for (int t = 0; t < ntraces; t++) {
+          TuneTask *task = &tasks[c * ntraces + t];
+          if (o == ntraces || o == t) {
+            rate += 100.0 * task->mispredictions / (task->prefix ? task->prefix : 1);
+          }
+        }
+        scores[i].config = c;
+        scores[i].rate = o == ntraces ? rate / ntraces : rate;
+      }
+      qsort(scores, nalive[o], sizeof(TuneScore), tune_score_cmp);
+      if (r < rounds) {
+        nalive[o] = (nalive[o] + 1) / 2;
+      }
+      for (int i = 0; i < nalive[o]; i++) {
+        alive[o][i] = scores[i].config;
+      }
+
+      if (r == rounds) {
+        int c = alive[o][0];
+        TuneResult *res = &best[o];
+        res->config = configs[c];
+        res->bits = predictor_storage_bits(&configs[c]);
+        res->branches = 0;
+        res->mispredictions = 0;
+        for (int t = 0; t < ntraces; t++) {
+          if (o == ntraces || o == t) {
+            res->branches += tasks[c * ntraces + t].prefix;
+            res->mispredictions += tasks[c * ntraces + t].mispredictions;
+          }
+        }
+        res->rate = scores[0].rate;
+      }
+    }
+  }
+  if (pool != NULL) {
+    pool_destroy(pool);
+  }
+
+  for (int o = 0; o < nobj; o++) {
+    free(alive[o]);
+  }
+  for (int t = 0; t < ntraces; t++) {
+    if (data[t] != NULL) {
+      traceData_destroy(data[t]);
+    }
+  }
+  free(alive);
+  free(nalive);
+  free(tasks);
+  free(needed);
+  free(scores);
+  free(data);
+  free(configs);
+  return ok;
+}
@@ -0,0 +1,60 @@
+//========================================================//
+//  tune.h                                                //
+//  Header file for the configuration tuner               //
+//                                                        //
+//  Searches every predictor configuration that fits a    //
+//  storage budget for the most accurate one              //
+//========================================================//
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "predictor.h"
+
+// Shortest trace prefix a configuration is judged on
+#define TUNE_MIN_PREFIX 100000
+
+struct TuneResult
+{
+  PredictorConfig config;
+  uint64_t bits;        // storage of 'config'
+  uint64_t branches;
+  uint64_t mispredictions;
+  double rate;          // percent, the mean over traces overall
+};
+typedef struct TuneResult TuneResult;
+
+// Parse a storage budget such as "64Kbit", "8KB" or "65536". K and M
+// are powers of 1024, a B or byte(s) suffix counts bytes and a plain
+// number or bit(s) suffix counts bits
+//
+// Returns the budget in bits, 0 if it is malformed
+//
+uint64_t tune_parse_budget(const char *s);
+
+// Append every configuration worth trying within 'budget' bits to
+// the growable array '*list' of length '*n'. Configurations using
+// less than a quarter of the budget are pruned
+//
+// Returns the number of configurations added
+//
+int tune_candidates(uint64_t budget, PredictorConfig **list, int *n);
+
+// Find the configuration within 'budget' bits with the lowest
+// misprediction rate on each of the 'ntraces' traces in 'paths', and
+// the one with the lowest mean rate over all of them, by successive
+// halving: every candidate runs on a short prefix of the traces, the
+// better half runs again on a prefix twice as long, and so on until
+// one remains and runs on the whole traces. Runs use 'jobs' threads,
+// one per core if not positive. Progress goes to 'log' if not NULL
+//
+// Fills best[0..ntraces-1] per trace and best[ntraces] overall
+//
+// Returns True if Successful
+//
+int tune_run(const char **paths, int ntraces, uint64_t budget, int jobs,
+             TuneResult *best, FILE *log);
+
+#endif